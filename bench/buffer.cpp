@@ -0,0 +1,68 @@
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <ez/buffer.hpp>
+
+// compares plain (non-atomic) buffer handles with shared_buffer handles and
+// fan-out of one payload to several worker threads with and without copying
+
+using steady_clock = std::chrono::steady_clock;
+
+template <class F>
+double measure(size_t _iterations, F&& _fn)
+{
+    auto start = steady_clock::now();
+    _fn();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - start).count();
+    return double(ns) / _iterations;
+}
+
+int main()
+{
+    const size_t iterations = 10'000'000;
+    const size_t payload_size = 64*1024;
+    const unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+    const size_t per_thread = 100'000;
+
+    ez::buffer payload(payload_size);
+    ez::shared_buffer shared(payload);
+
+    auto plain_ns = measure(iterations, [&]
+    {
+        for (size_t i = 0; i < iterations; ++i)
+            ez::buffer copy(payload);
+    });
+
+    auto atomic_ns = measure(iterations, [&]
+    {
+        for (size_t i = 0; i < iterations; ++i)
+            ez::shared_buffer copy(shared);
+    });
+
+    std::cout << "handle copy, buffer:        " << plain_ns << " ns/op" << std::endl;
+    std::cout << "handle copy, shared_buffer: " << atomic_ns << " ns/op" << std::endl;
+
+    auto fan_out = [&](auto&& _fn)
+    {
+        return measure(threads * per_thread, [&]
+        {
+            std::vector<std::thread> pool;
+            for (unsigned t = 0; t < threads; ++t)
+                pool.emplace_back([&] { for (size_t i = 0; i < per_thread; ++i) _fn(); });
+
+            for (auto& t: pool)
+                t.join();
+        });
+    };
+
+    auto copy_ns = fan_out([&] { ez::buffer b(shared.ptr(), shared.size()); });
+    auto view_ns = fan_out([&] { ez::buffer b(shared); });
+
+    std::cout << "fan-out to " << threads << " threads, copy payload: " << copy_ns << " ns/op" << std::endl;
+    std::cout << "fan-out to " << threads << " threads, shared view:  " << view_ns << " ns/op" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include <ez/events.hpp>
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// dispatch cost per event on many connections: fd -> state lookup in on_event, as callbacks
+// do it with plain fds, against a per-fd handler; every fd is a dup of one eventfd, so one
+// write makes all of them ready and the loop only dispatches; the worker starts the next
+// round itself, the main thread sleeps
+
+using steady_clock = std::chrono::steady_clock;
+
+struct connection
+{
+    ez::event_loop::handler_t   handler;
+    uint64_t                    events = 0;
+};
+
+static std::unordered_map<int, connection*> by_fd;
+static int efd = -1;
+static uint64_t per_round = 0, dispatched = 0, total = 0;   // worker thread only
+static std::atomic<bool> done {false};
+
+static void next_round()
+{
+    if (++dispatched % per_round != 0)
+        return;
+
+    if (dispatched == total)
+        done = true;
+    else
+    {
+        uint64_t c = 1;
+        write(efd, &c, 8);
+    }
+}
+
+static void on_fd_event(void*, int _fd, ez::event_loop::event_e _ev, unsigned)
+{
+    if (_ev != ez::event_loop::event_e::read)
+        return;
+
+    by_fd.find(_fd)->second->events++;
+    next_round();
+}
+
+static void on_handler_event(void* _param, int, ez::event_loop::event_e _ev, unsigned)
+{
+    if (_ev != ez::event_loop::event_e::read)
+        return;
+
+    static_cast<connection*>(_param)->events++;
+    next_round();
+}
+
+static double run(bool _handlers, std::vector<connection*>& _conns, unsigned _rounds)
+{
+    ez::event_loop loop;
+    loop.init();
+    loop.on_event(nullptr, on_fd_event);
+
+    std::thread t([&loop] { loop.start(1); });
+    while (loop.workers() == 0)
+        std::this_thread::yield();
+
+    for (auto c: _conns)
+    {
+        if (_handlers)
+            loop.add_fd(&c->handler, 0);
+        else
+            loop.add_fd(c->handler.fd, 0);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100)); // added by the worker
+
+    per_round = _conns.size();
+    dispatched = 0;
+    total = per_round * _rounds;
+    done = false;
+
+    auto start = steady_clock::now();
+
+    uint64_t c = 1;
+    write(efd, &c, 8);
+    while (!done)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - start).count();
+
+    loop.stop();
+    t.join();
+
+    return double(ns) / (double(_rounds) * _conns.size());
+}
+
+int main()
+{
+    const unsigned rounds = 100;
+    size_t count = 100'000;
+
+    rlimit rl{};
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < count + 64)
+        count = rl.rlim_cur - 64;
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    std::vector<connection*> conns;
+    for (size_t i = 0; i < count; ++i)
+    {
+        auto c = new connection;
+        c->handler.fn = on_handler_event;
+        c->handler.param = c;
+        c->handler.fd = dup(efd);
+        if (c->handler.fd == -1)
+        {
+            delete c;
+            break;
+        }
+
+        conns.push_back(c);
+        by_fd[c->handler.fd] = c;
+    }
+
+    std::cout << conns.size() << " connections" << std::endl;
+    // best of a few alternating runs, the kernel part of the cost is noisy
+
+    double lookup = 1e9, handler = 1e9;
+    for (int i = 0; i < 5; ++i)
+    {
+        lookup = std::min(lookup, run(false, conns, rounds));
+        handler = std::min(handler, run(true, conns, rounds));
+    }
+
+    std::cout << "fd lookup: " << lookup << " ns/event" << std::endl;
+    std::cout << "handler  : " << handler << " ns/event" << std::endl;
+
+    for (auto c: conns)
+    {
+        close(c->handler.fd);
+        delete c;
+    }
+
+    close(efd);
+    return 0;
+}
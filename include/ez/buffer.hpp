@@ -8,10 +8,40 @@
 
 namespace ez
 {
+    class buffer;
+
+    // immutable payload with atomic reference counting, can be handed between threads;
+    // each thread wraps it into its own ez::buffer to get a private read position
+
+    class shared_buffer
+    {
+        public:
+
+            shared_buffer();
+            ~shared_buffer();
+
+            shared_buffer(const shared_buffer& _right);
+            const shared_buffer& operator = (const shared_buffer& _right);
+
+            explicit shared_buffer(const buffer& _source);
+            shared_buffer(const void* _data, size_t _size);
+
+            const uint8_t* ptr() const;
+            size_t size() const;
+
+        private:
+
+            friend class buffer;
+            struct impl; struct impl* m_impl;
+    };
+
     class buffer
     {
         public:
         
+            struct uninitialized_t {};
+            static constexpr uninitialized_t uninitialized {};
+
             buffer();
             ~buffer();
         
@@ -19,20 +49,45 @@ namespace ez
             const buffer& operator = (const buffer& _right);
         
             explicit buffer(size_t _size);
+            buffer(size_t _size, uninitialized_t); // contents are not zeroed
             buffer(const std::vector<uint8_t>&);
             buffer(const void* _data, size_t _size, bool _copy = true);
             buffer(const std::string& _str);
             buffer(const std::string_view _str);
             buffer(const char* _str);
+            buffer(const shared_buffer& _shared); // no copy until changed, keeps reference to shared payload
+
+            // a handle of a shared_buffer reads the shared payload: reserve, resize and append copy it
+            // first, writes through ptr() go through mutable_ptr() that does the same
 
             uint8_t* ptr() const;
+            uint8_t* mutable_ptr();
             const char* c_str() const;
             size_t size() const;
 
             void set_size(size_t _size);
+
+            // growth keeps all handles pointing to the same data
+
+            size_t capacity() const;
+            void reserve(size_t _capacity);
+            void resize(size_t _size);
+            void append(const void* _data, size_t _size);
+            void append(std::string_view _str);
         
             size_t position() const;
             void set_position(size_t _pos);
+
+            // size-class pool used for impl header and payload
+
+            struct pool_stats_t
+            {
+                uint64_t hits = 0;
+                uint64_t misses = 0;
+            };
+
+            static void enable_pool(bool _flag);
+            static pool_stats_t pool_stats();
         
         private:
         
@@ -3,6 +3,13 @@
 
 #include <stddef.h>
 #include <stdexcept>
+#include <sys/types.h>
+
+#if defined(WIN32)
+struct iovec { void* iov_base; size_t iov_len; };
+#else
+#include <sys/uio.h>
+#endif
 
 namespace ez
 {
@@ -23,6 +30,8 @@ namespace ez
             
             virtual ssize_t send(const buffer&) = 0;
             virtual ssize_t send(const uint8_t* _data, size_t _size) = 0;
+            virtual ssize_t send(const iovec* _iov, int _count) = 0; // gather write, may be partial
+            virtual ssize_t send_file(int _fd, off_t _offset, size_t _size) = 0; // may be partial
             virtual ssize_t recv(buffer& _buffer, size_t _desired_size = 0) = 0;
             virtual ssize_t recv(uint8_t* _data, size_t _size, size_t _desired_size = 0) = 0;
         
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <ez/socket.hpp>
+#include <ez/tls.hpp>
+#include <ez/http.hpp>
+
+namespace ez
+{
+    // client connections kept open by host, port and tls for reuse, so a request doesn't pay
+    // for tcp and tls handshakes; thread safe, a connection is used by one borrower at a time
+
+    class connection_pool
+    {
+            struct impl;
+
+        public:
+
+            struct limits_t
+            {
+                size_t      max_per_host = 8;       // open connections, borrowed and idle
+                size_t      max_idle_per_host = 4;
+                unsigned    idle_timeout_ms = 30000;
+                unsigned    wait_ms = 5000;         // for a slot when the host is at its limit
+                unsigned    connect_timeout = 5;    // s, as socket::connect
+                unsigned    io_timeout = 30;        // s, socket::set_timeout, 0 - none
+                bool        check_cert = true;
+            };
+
+            class connection
+            {
+                public:
+
+                    ez::socket& socket() { return m_socket; }
+                    ez::channel& channel() { return m_tls ? static_cast<ez::channel&>(*m_tls) : m_socket; }
+                    ez::http& http() { return *m_http; }
+                    bool reused() const { return m_reused; } // was idle in the pool before
+
+                private:
+
+                    friend class connection_pool;
+
+                    ez::socket                  m_socket;
+                    std::unique_ptr<ez::tls>    m_tls;
+                    std::unique_ptr<ez::http>   m_http;
+                    std::string                 m_key;
+                    int64_t                     m_idle_since = 0;   // ms
+                    bool                        m_reused = false;
+            };
+
+            // a borrowed connection; release() gives it back when its last exchange left it clean
+            // (whole response read, keep-alive), destroyed without release() it is closed; a lease
+            // may outlive its pool, its connection is closed then
+
+            class lease
+            {
+                public:
+
+                    lease() = default;
+                    lease(lease&& _right);
+                    lease& operator = (lease&& _right);
+                    lease(const lease&) = delete;
+                    const lease& operator = (const lease&) = delete;
+                    ~lease();
+
+                    connection* operator -> () const { return m_connection; }
+                    connection& operator * () const { return *m_connection; }
+                    explicit operator bool() const { return m_connection != nullptr; }
+
+                    void release();
+                    void close();
+
+                private:
+
+                    friend class connection_pool;
+
+                    impl*               m_pool = nullptr;
+                    connection*         m_connection = nullptr;
+            };
+
+            struct stats_t
+            {
+                size_t      open = 0;
+                size_t      idle = 0;
+                uint64_t    created = 0;
+                uint64_t    reused = 0;
+            };
+
+            connection_pool();
+            explicit connection_pool(const limits_t& _limits);
+            connection_pool(const connection_pool&) = delete;
+            const connection_pool& operator = (const connection_pool&) = delete;
+            ~connection_pool(); // closes idle connections, the last lease out frees the rest
+
+            // the most recently used idle connection that passes a health check (one non-blocking
+            // peek), or a new one, with _fresh always new; the host is resolved with ez::resolve;
+            // throws when it can't connect or the host stays at its limit for wait_ms
+
+            lease borrow(std::string_view _host, uint16_t _port, bool _tls, bool _fresh = false);
+
+            // closes connections idle for longer than idle_timeout_ms, borrow does it for its host;
+            // call it periodically, e.g. from an event_loop timer; returns the number closed
+
+            size_t evict();
+
+            stats_t stats() const;
+
+        private:
+
+            impl* m_impl;
+    };
+}
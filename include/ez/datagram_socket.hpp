@@ -0,0 +1,98 @@
+#pragma once
+
+#include <ez/channel.hpp>
+#include <ez/ip.hpp>
+
+namespace ez
+{
+    // udp socket for high datagram rates: batches of datagrams per system call (linux: recvmmsg,
+    // sendmmsg, a loop elsewhere), received datagrams land in a ring of slots allocated once, gso and
+    // gro where the kernel has them; for an event_loop make it non-blocking, add fd() like a socket's
+    // and call recv_batch until it returns 0; as a channel, a connected one moves one datagram a call
+
+    class datagram_socket final : public channel
+    {
+        public:
+
+            using fd_t = int;
+
+            // a received datagram in a ring slot, valid until the next recv_batch or set_ring
+
+            struct message_t
+            {
+                const uint8_t*  data = nullptr;
+                size_t          size = 0;
+                ip_address      peer;               // v4 peers of a dual stack socket come as v4
+                uint16_t        port = 0;
+                uint16_t        segment = 0;        // gro: datagrams of this size coalesced, the last may be shorter
+                bool            truncated = false;  // longer than the slot, the rest is lost
+            };
+
+            struct datagram_t
+            {
+                const uint8_t*      data = nullptr;
+                size_t              size = 0;
+                const ip_address*   peer = nullptr; // nullptr - the connected peer
+                uint16_t            port = 0;
+            };
+
+            datagram_socket();
+            datagram_socket(datagram_socket&& _right);
+            datagram_socket(const datagram_socket& _right) = delete;
+            const datagram_socket& operator = (const datagram_socket& _right) = delete;
+            ~datagram_socket();
+
+            fd_t fd() const;
+            uint16_t port() const;  // local, after bind or connect
+            bool is_connected() const;
+            void close();
+
+            void set_nonblocking(bool _flag);
+            bool is_nonblocking() const;
+
+            // kernel socket buffers in bytes, 0 - leave as is; a burst over the receive buffer is
+            // dropped, linux caps them at net.core.rmem_max and wmem_max
+            void set_buffer_size(size_t _recv, size_t _send);
+
+            // the first of them creates the socket for the family of _address; on a v6 address
+            // with _v6_only false, any_v6() takes v4 datagrams too; port 0 - any free port
+            void bind(const ip_address& _address, uint16_t _port, bool _share = false, bool _v6_only = false);
+            void connect(const ip_address& _address, uint16_t _port);
+
+            // _slots datagrams of up to _slot_size bytes per recv_batch, 64 x 2048 by default;
+            // with gro a slot takes several datagrams, give it 65535 bytes
+            void set_ring(size_t _slots, size_t _slot_size);
+
+            // linux: the kernel coalesces datagrams of a flow into one message (UDP_GRO);
+            // returns false when it isn't supported
+            bool set_gro(bool _flag);
+
+            // fills up to the ring size of messages with one system call, a blocking socket waits
+            // for the first only; returns the number received, 0 when nothing is waiting
+            size_t recv_batch(const message_t*& _messages);
+
+            // returns the number sent, fewer when the socket buffer fills up on a non-blocking
+            // socket; an error after the first datagram ends the batch
+            size_t send_batch(const datagram_t* _datagrams, size_t _count);
+
+            // _size bytes as datagrams of _segment bytes, the last may be shorter; with gso (linux)
+            // the kernel or the nic splits them, one system call for up to 64 of them, otherwise
+            // they go through send_batch; returns the number of bytes sent, whole datagrams
+            size_t send_segments(const uint8_t* _data, size_t _size, uint16_t _segment, const ip_address* _peer = nullptr, uint16_t _port = 0);
+
+            // channel interface, connected only: a call sends or receives one datagram,
+            // a datagram longer than the buffer is cut
+
+            ssize_t send(const buffer& _data);
+            ssize_t send(const uint8_t* _data, size_t _size);
+            ssize_t send(const iovec* _iov, int _count);
+            ssize_t send_file(int _fd, off_t _offset, size_t _size); // not supported, throws
+            ssize_t recv(buffer& _data, size_t _desired_size = 0);
+            ssize_t recv(uint8_t* _data, size_t _size, size_t _desired_size = 0);
+            bool can_read() const;
+
+        private:
+
+            struct impl; impl* m_impl;
+    };
+}
@@ -1,6 +1,12 @@
 
 #pragma once
 
+#include <cstdint>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <ez/buffer.hpp>
+
 namespace ez
 {
     class event_loop
@@ -24,17 +30,179 @@ namespace ez
 
             unsigned workers() const;
 
+            // workers are joined before start() returns; an exception thrown on a worker stops the
+            // loop and start() rethrows it, the first one if several workers failed
+
             void start(unsigned _workers, int _timeout = -1);
             void stop();
 
+            // graceful stop: workers stop accepting on their listeners (add_listener) and start() returns
+            // once they have no fds left, as counted by load(), or after _grace_ms; fds leave with
+            // remove_fd or a closed/error event; fds of the main loop aren't counted, so without workers
+            // it waits the whole grace period; draining() tells callbacks to refuse new work
+
+            void shutdown(unsigned _grace_ms);
+            bool draining() const;
+
             void add_fd(int _fd);
             void add_fd(int _fd, unsigned _worker);
 
             void remove_fd(int _fd, unsigned _worker);
 
+            // fds are edge triggered, data left unread waits for the next edge: drain_fd appends to _data
+            // until the fd would block, but at most _budget bytes, then the fd is armed again and gets
+            // another read event after the other ready fds, so one busy connection can't starve them;
+            // when the peer shut down, closed comes after the read events for the data it left (epoll,
+            // kqueue); call it from the fd's callback with its worker; returns bytes read, 0 when closed
+            // by peer, -2 when there was nothing to read, -1 on errors (errno)
+
+            ssize_t drain_fd(int _fd, buffer& _data, unsigned _worker, size_t _budget = 64 * 1024);
+
+            // per-fd handler: events of the fd go to fn with param instead of on_event, so the callback
+            // gets the connection state without a lookup by fd; the handler is not copied and must stay
+            // valid until remove_fd and the end of the current batch, release it from a posted task
+
+            struct handler_t
+            {
+                on_event_t  fn = nullptr;
+                void*       param = nullptr;
+                int         fd = -1;
+            };
+
+            void add_fd(handler_t* _handler);
+            void add_fd(handler_t* _handler, unsigned _worker);
+
+            // worker for a new fd is picked by load: event rate over the last second, then number
+            // of fds; power_of_two compares two random workers only, so placement from several
+            // threads doesn't pile up on one worker
+
+            enum class placement_e
+            {
+                least_loaded,
+                power_of_two
+            };
+
+            struct load_t
+            {
+                unsigned    fds = 0;
+                uint64_t    events = 0;
+                uint64_t    events_per_sec = 0;
+                uint64_t    migrated = 0;   // idle fds moved to other workers
+            };
+
+            unsigned place_fd(int _fd, placement_e _policy = placement_e::power_of_two); // returns worker
+            unsigned place_fd(handler_t* _handler, placement_e _policy = placement_e::power_of_two);
+            load_t load(unsigned _worker) const;
+
+            // fds without events for _idle_ms are moved from busy workers to the least loaded one,
+            // callbacks for a moved fd come with the new worker index; 0 (default) disables,
+            // not supported by io_uring backend; on_migrate is called on the old worker before the
+            // move, when no callback of the fd runs: move what is bound to the old worker there
+            // (timers scheduled on it), or return false to keep the fd; if the move fails, it's
+            // called again with _from and _to swapped; remove_fd finds a moved fd by itself
+
+            using on_migrate_t = bool(*)(void*, int _fd, handler_t* _handler, unsigned _from, unsigned _to);
+
+            void set_migration(unsigned _idle_ms);
+            void on_migrate(void* _param, on_migrate_t);
+
+            // polling of workers: with spin_us a worker keeps polling without blocking for that long
+            // after its last event before it sleeps, trading a cpu for wake up latency; busy_poll_us
+            // sets napi busy polling of the poller (linux 6.9+: epoll, io_uring without budget), single
+            // sockets can use socket::set_busy_poll; batch is max events per poll; set before start()
+
+            struct polling_t
+            {
+                unsigned    spin_us = 0;
+                unsigned    batch = 100;
+                unsigned    busy_poll_us = 0;
+                uint16_t    busy_poll_budget = 0;   // packets per busy poll, 0 - kernel default
+                bool        prefer_busy_poll = false;
+            };
+
+            struct poll_stats_t
+            {
+                uint64_t    spin_ns = 0;    // in polls without blocking while spinning
+                uint64_t    sleep_ns = 0;   // in blocking polls
+                uint64_t    spins = 0;
+                uint64_t    sleeps = 0;
+            };
+
+            void set_polling(const polling_t& _polling);
+            poll_stats_t poll_stats(unsigned _worker) const;
+
+            // worker threads (linux): worker w is pinned to cpus[w % cpus.size()]; with irq_device and
+            // no cpus it runs where the irq of rx queue w % queues of that network device goes, so it
+            // handles the packets on the cpu that got them; workers allocate their state themselves
+            // after pinning, it is on their numa node with the default first touch policy; set before start()
+
+            struct affinity_t
+            {
+                std::vector<std::vector<unsigned>> cpus;
+                std::string irq_device;
+            };
+
+            void set_affinity(const affinity_t& _affinity);
+
+            // accept sharding: every worker owns a listening fd bound with SO_REUSEPORT (socket::listen
+            // with _share), accepts connections itself and keeps them, so the main loop is not on the
+            // accept path; on_accept is called on the worker before the new fd gets its first event,
+            // returning false rejects and closes the connection; setting *_handler (nullptr on the call)
+            // registers the fd with it as add_fd(handler_t*) would; listeners are added before start()
+
+            using on_accept_t = bool(*)(void*, int _listen_fd, int _fd, unsigned _worker, handler_t** _handler);
+
+            void on_accept(void* _param, on_accept_t);
+            void add_listener(int _fd, unsigned _worker);
+
             void on_event(void* _param, on_event_t);
             void on_timeout(on_timeout_t);
 
+            // timers: a hierarchical timer wheel per loop with 1 ms resolution, expired timers fire once
+            // on the loop thread after every batch of events, so they are on time on a busy loop too;
+            // schedule and cancel may be called from any thread, cancel returns false when the timer
+            // has fired already; timers of workers are dropped on stop
+
+            using on_timer_t = void(*)(void*, uint64_t _id, unsigned _worker);
+
+            uint64_t schedule(unsigned _ms, void* _param, on_timer_t); // returns timer id
+            uint64_t schedule(unsigned _ms, void* _param, on_timer_t, unsigned _worker);
+            bool cancel(uint64_t _id);
+            bool cancel(uint64_t _id, unsigned _worker);
+
+            // runs _fn once on the loop thread after its current batch of events; lock free, may be
+            // called from any thread, wake ups are coalesced until the loop drains its tasks;
+            // tasks not run before stop are dropped
+
+            using task_t = void(*)(void*, unsigned _worker);
+
+            void post(void* _param, task_t);
+            void post(void* _param, task_t, unsigned _worker);
+
+            // completion based i/o, available with io_uring backend only, others throw;
+            // the callback gets the result of the operation: accepted fd, received or sent size,
+            // 0 when peer closed the connection or -errno; received data is valid during the call
+
+            enum class op_e
+            {
+                accept,
+                recv,
+                send
+            };
+
+            using on_complete_t = void(*)(void*, int _fd, op_e _op, int _result, const uint8_t* _data, unsigned _worker);
+
+            static bool completions_supported();
+            void on_complete(void* _param, on_complete_t);
+
+            void accept(int _fd);                   // multishot, a completion for every connection
+            void accept(int _fd, unsigned _worker);
+            void recv(int _fd);                     // multishot into the loop's provided buffers
+            void recv(int _fd, unsigned _worker);
+            void send(int _fd, const buffer& _data); // completes when all data is sent or on error,
+                                                     // sends to one fd are queued and keep their order
+            void send(int _fd, const buffer& _data, unsigned _worker);
+
         private:
 
             struct impl; impl* m_impl;
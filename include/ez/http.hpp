@@ -5,12 +5,15 @@
 #include <tuple>
 #include <unordered_map>
 #include <stdexcept>
+#include <functional>
 
 #include <ez/buffer.hpp>
 #include <ez/channel.hpp>
 
 namespace ez
 {
+    class connection_pool;
+
     class http
     {
         public:
@@ -38,20 +41,109 @@ namespace ez
             using response_t = std::tuple<unsigned, std::string, headers_t, buffer>;
             using request_t = std::tuple<std::string, std::string, headers_t, buffer>;
 
+            // header fields as spans over the receive buffer, valid until the next message is
+            // received; lookup is case-insensitive and doesn't allocate
+
+            class headers_view
+            {
+                public:
+
+                    struct field_t // same layout as phr_header
+                    {
+                        const char* name;
+                        size_t      name_len;
+                        const char* value;
+                        size_t      value_len;
+
+                        std::string_view key() const { return {name, name_len}; }
+                        std::string_view val() const { return {value, value_len}; }
+                    };
+
+                    headers_view() = default;
+                    headers_view(const field_t* _fields, size_t _count) : m_fields(_fields), m_count(_count) {}
+
+                    const field_t* begin() const { return m_fields; }
+                    const field_t* end() const { return m_fields + m_count; }
+                    size_t size() const { return m_count; }
+                    bool empty() const { return m_count == 0; }
+
+                    std::string_view find(std::string_view _name) const; // empty view if not present
+                    bool contains(std::string_view _name) const;
+
+                private:
+
+                    const field_t*  m_fields = nullptr;
+                    size_t          m_count = 0;
+            };
+
+            struct file_t // response body streamed from file, fd must stay open until send_complete
+            {
+                int     fd = -1;
+                off_t   offset = 0;
+                size_t  size = 0;
+            };
+
+            // head buffer starts at initial_buffer_size and grows in steps up to max_head_size,
+            // it's shrunk back when the next message starts; new limits apply to the next message
+
+            struct limits_t
+            {
+                size_t  initial_buffer_size = 1024;
+                size_t  max_head_size = 64*1024;    // start line and headers
+                size_t  max_headers = 64;           // the header array grows on demand up to it
+                size_t  max_body_size = 10*1024*1024; // not applied to streamed bodies with Content-Length
+            };
+
+            void set_limits(const limits_t& _limits);
+            const limits_t& limits() const;
+
             state_e state() const;
-            void reset();
+            void reset(); // flushes queued responses, throws if they can't be sent right now
             void set_channel(channel& _ch);
 
+            // streaming mode: body portions are passed to handler as they arrive instead of
+            // being collected, recv_request/recv_response return an empty body when it's done;
+            // head of the message is available when state() is waiting_body
+
+            using body_handler_t = std::function<void(const uint8_t* _data, size_t _size)>;
+            void on_body(body_handler_t _handler);
+
+            const headers_t& headers() const;
+            headers_view headers_ref() const;
+            size_t content_length() const;
+            bool chunked() const;
+
+            // headers_t is filled only for compatibility, with 'false' the returned tuples
+            // and headers() have empty headers and headers_ref() should be used instead
+            void build_headers(bool _flag);
+            const std::string& method() const;
+            const std::string& path() const;
+            bool keep_alive() const; // false for 'Connection: close' or HTTP/1.0 without keep-alive
+
             // client
 
             response_t recv_response();
             void send_request(const request_t& _request);
 
-            // server
+            // one request over a pooled connection, a Host header is added when missing; interim 1xx
+            // responses are skipped, a body without a length is read until the server closes; the
+            // connection goes back to the pool when the response keeps it alive and had a known length;
+            // a reused connection may have been closed by the server while idle, idempotent requests
+            // that got no response on one are sent once more on a new connection
+
+            static response_t request(connection_pool& _pool, std::string_view _host, uint16_t _port, bool _tls, const request_t& _request);
+
+            // server; pipelined requests are parsed from already received data, their responses
+            // are queued and flushed together when no more complete requests are buffered;
+            // a queued response leaves state() at sending_body; when request_buffered() is true
+            // recv_request() should be called right away, no read event comes for data that is
+            // already received; file_t responses are never queued
         
             request_t recv_request();
             void send_response(const response_t& _response);
+            void send_response(const response_t& _response, const file_t& _body);
             void send_more();
+            bool request_buffered() const;
 
         private:
         
@@ -1,6 +1,6 @@
-
 #pragma once
 
+#include <string>
 #include <string_view>
 #include <inttypes.h>
 
@@ -18,15 +18,58 @@ namespace ez
         {
             S_addr = _saddr;
         }
-        
+
         ipv4_t(uint8_t _1 = 0, uint8_t _2 = 0, uint8_t _3 = 0, uint8_t _4 = 0)
         {
             S_un_b.s_b1 = _1; S_un_b.s_b2 = _2; S_un_b.s_b3 = _3; S_un_b.s_b4 = _4;
         }
-        
+
         explicit ipv4_t(std::string_view _source);
     };
 
+    // v4 or v6 address, bytes in network order, v4 in the first 4; parse and format
+    // don't allocate, "fe80::1%eth0" and "fe80::1%2" set the scope (interface index)
+
+    struct ip_address
+    {
+        enum class family_e : uint8_t
+        {
+            v4,
+            v6
+        };
+
+        static constexpr size_t max_length = 64;    // of format(), with the scope
+
+        uint8_t     bytes[16] = {};
+        uint32_t    scope = 0;
+        family_e    family = family_e::v4;
+
+        ip_address() = default;
+        ip_address(ipv4_t _v4);
+        explicit ip_address(std::string_view _source);
+
+        static ip_address any_v6();         // ::, listen on it for dual stack
+        static ip_address loopback_v6();    // ::1
+
+        // false on invalid input, _result is left unchanged then
+
+        static bool parse(std::string_view _source, ip_address& _result);
+
+        // writes at most max_length chars, no terminator; v6 as in rfc 5952
+
+        size_t format(char* _out) const;
+        std::string to_string() const;
+
+        bool is_v4() const { return family == family_e::v4; }
+        bool is_v6() const { return family == family_e::v6; }
+        bool is_any() const;
+        bool is_v4_mapped() const;  // ::ffff:a.b.c.d
+
+        ipv4_t v4() const;          // of a v4 or v4 mapped address, throws otherwise
+
+        bool operator == (const ip_address& _right) const;
+        bool operator != (const ip_address& _right) const { return !(*this == _right); }
+    };
+
     ipv4_t resolve(std::string_view _name);
 }
-
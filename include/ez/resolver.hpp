@@ -0,0 +1,79 @@
+#pragma once
+
+#include <ez/ip.hpp>
+#include <ez/events.hpp>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ez
+{
+    // non-blocking dns resolver on a loop thread: udp queries to the servers in turn, an /etc/hosts
+    // overlay and a cache that keeps answers for their ttl, not found answers too (rfc 2308);
+    // concurrent lookups of a name share one query; names are queried as given, no search domains
+
+    class resolver
+    {
+        public:
+
+            enum class status_e
+            {
+                ok,
+                not_found,  // no such name or no addresses of the family
+                timeout,    // no server answered
+                error       // invalid name or server failure
+            };
+
+            enum class query_e
+            {
+                v4,
+                v6,
+                any         // both, v4 addresses first
+            };
+
+            // with no servers, servers and their options timeout and attempts come from resolv_conf;
+            // attempts is the number of rounds over the servers; ttls are capped by max_ttl,
+            // not found answers without a soa record are kept for negative_ttl
+
+            struct config_t
+            {
+                std::vector<ip_address> servers;
+                uint16_t                port = 53;
+                unsigned                timeout_ms = 1000;
+                unsigned                attempts = 2;
+                unsigned                max_ttl = 3600;
+                unsigned                negative_ttl = 30;
+                size_t                  max_entries = 10000;
+                std::string             resolv_conf = "/etc/resolv.conf";
+                std::string             hosts = "/etc/hosts";   // empty - no overlay
+            };
+
+            using on_resolve_t = void(*)(void* _param, status_e, const ip_address* _addresses, size_t _count, unsigned _worker);
+
+            resolver(event_loop& _loop);                    // on the main loop
+            resolver(event_loop& _loop, unsigned _worker);
+            resolver(const resolver&) = delete;
+            const resolver& operator = (const resolver&) = delete;
+            ~resolver();
+
+            void init();
+            void init(const config_t& _config);
+
+            // on the loop thread (from its callbacks, timers or posted tasks) once it runs; literal
+            // addresses, hosts and cached answers call _fn before resolve returns true, otherwise it
+            // is called later on the loop thread; every query has its own socket on a random port,
+            // answers are taken from the servers it went to only; sockets are in the loop only while
+            // their queries are in flight, so they don't hold a worker's shutdown; destroy on the loop
+            // thread or after the loop stopped, pending callbacks are not called then
+
+            bool resolve(std::string_view _name, query_e _query, void* _param, on_resolve_t _fn);
+
+            void clear_cache();
+            size_t cached() const;
+
+        private:
+
+            struct impl; impl* m_impl;
+    };
+}
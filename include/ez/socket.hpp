@@ -4,6 +4,8 @@
 #include <ez/channel.hpp>
 #include <ez/ip.hpp>
 
+#include <vector>
+
 namespace ez
 {
     class buffer;
@@ -43,18 +45,45 @@ namespace ez
             void set_close_on_exec();
 
             void listen(ipv4_t _address, uint16_t _port, size_t _max_clients, bool _share);
+
+            // on a v6 address with _v6_only false, any_v6() takes v4 connections too (dual stack)
+            void listen(const ip_address& _address, uint16_t _port, size_t _max_clients, bool _share, bool _v6_only = false);
             void listen(std::string_view _adr, size_t _max_clients, bool _share);
 
+            // linux: connection goes to the listener with index = receiving cpu % _group_size,
+            // index is the order of listen() calls with _share; set on any socket of the group
+            void set_cpu_steering(unsigned _group_size);
+
+            // linux: poll the device queue for up to _usecs before sleeping, 0 - off;
+            // sockets of a loop with busy poll set don't need it
+            void set_busy_poll(unsigned _usecs, bool _prefer = false);
+
             void connect(ipv4_t _address, uint16_t _port, unsigned _timeout, ipv4_t _bind_to = ipv4_t());
             void connect_async(ipv4_t _address, uint16_t _port, ipv4_t _bind_to = ipv4_t());
+            void connect(const ip_address& _address, uint16_t _port, unsigned _timeout, const ip_address& _bind_to = ip_address());
+            void connect_async(const ip_address& _address, uint16_t _port, const ip_address& _bind_to = ip_address());
             void connect(std::string_view _adr, unsigned _timeout);
 
-            socket accept();
+            // v4 peers of a dual stack listener come as v4, not ::ffff:a.b.c.d
+            socket accept(ip_address* _peer = nullptr, uint16_t* _peer_port = nullptr);
+
+            struct peer_t
+            {
+                ip_address  address;
+                uint16_t    port = 0;
+            };
+
+            // drains the accept queue of a non-blocking listener, up to _max connections, appended to
+            // _sockets and their peers to _peers; the sockets are non-blocking already, returns the number
+            // accepted, 0 when the queue is empty; an error after the first connection ends the batch
+            size_t accept(std::vector<socket>& _sockets, size_t _max, std::vector<peer_t>* _peers = nullptr);
 
             // channel interface
 
             ssize_t send(const buffer& _data);
             ssize_t send(const uint8_t* _data, size_t _size);
+            ssize_t send(const iovec* _iov, int _count);
+            ssize_t send_file(int _fd, off_t _offset, size_t _size);
             ssize_t recv(buffer& _data, size_t _desired_size = 0);
             ssize_t recv(uint8_t* _data, size_t _size, size_t _desired_size = 0);
             bool can_read() const;
@@ -39,6 +39,8 @@ namespace ez
         
             ssize_t send(const buffer& _data) override;
             ssize_t send(const uint8_t* _data, size_t _size) override;
+            ssize_t send(const iovec* _iov, int _count) override;
+            ssize_t send_file(int _fd, off_t _offset, size_t _size) override;
             ssize_t recv(buffer& _data, size_t _desired_size = 0) override;
             ssize_t recv(uint8_t* _data, size_t _size, size_t _desired_size = 0) override;
         
@@ -0,0 +1,159 @@
+#include "affinity.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
+
+namespace ez {
+
+#ifdef __linux__
+
+// ------------------------------------------------------------------------------------------
+// "0-3,8" as in smp_affinity_list
+
+static std::vector<unsigned> parse_cpu_list(const std::string& _list)
+{
+    std::vector<unsigned> result;
+    std::stringstream ss(_list);
+    std::string range;
+
+    while (std::getline(ss, range, ','))
+    {
+        unsigned first = 0, last = 0;
+        if (auto n = sscanf(range.c_str(), "%u-%u", &first, &last); n == 1)
+            last = first;
+        else if (n != 2)
+            continue;
+
+        for (unsigned c = first; c <= last; ++c)
+            result.push_back(c);
+    }
+
+    return result;
+}
+
+// irq names are the device or its bus device (virtio3 for eth0), a dash and the queue
+
+static bool is_rx_irq(const std::string& _name, const std::vector<std::string>& _prefixes)
+{
+    for (auto& p: _prefixes)
+    {
+        if (_name.size() <= p.size() + 1 || _name.compare(0, p.size(), p) != 0 || _name[p.size()] != '-')
+            continue;
+
+        std::string queue = _name.substr(p.size() + 1);
+        std::transform(queue.begin(), queue.end(), queue.begin(), [](char c) { return char(tolower(c)); });
+
+        if (queue.find("rx") != std::string::npos || queue.find("input") != std::string::npos)
+            return true;
+    }
+
+    return false;
+}
+
+cpu_sets_t rx_queue_cpus(const std::string& _device)
+{
+    std::vector<std::string> prefixes = { _device };
+
+    char link[PATH_MAX];
+    std::string path = "/sys/class/net/" + _device + "/device";
+    if (auto n = readlink(path.c_str(), link, sizeof(link) - 1); n > 0)
+    {
+        link[n] = 0;
+        std::string bus = link;
+        prefixes.push_back(bus.substr(bus.rfind('/') + 1));
+    }
+
+    std::ifstream interrupts("/proc/interrupts");
+    if (!interrupts)
+        throw std::runtime_error("can't read /proc/interrupts");
+
+    cpu_sets_t result;
+    std::string line;
+
+    while (std::getline(interrupts, line))
+    {
+        std::stringstream ss(line);
+        std::string irq, name, token;
+        ss >> irq;
+
+        while (ss >> token)
+            name = token;
+
+        if (irq.empty() || !isdigit(irq[0]) || !is_rx_irq(name, prefixes))
+            continue;
+
+        irq.pop_back(); // ':'
+        std::ifstream affinity("/proc/irq/" + irq + "/smp_affinity_list");
+        std::string list;
+        if (affinity >> list)
+            if (auto cpus = parse_cpu_list(list); !cpus.empty())
+                result.push_back(cpus);
+    }
+
+    if (result.empty())
+        throw std::runtime_error("no rx queue irqs of " + _device);
+
+    return result;
+}
+
+// ------------------------------------------------------------------------------------------
+
+void check_cpus(const cpu_sets_t& _cpus)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        throw std::runtime_error("sched_getaffinity() error");
+
+    for (auto& set: _cpus)
+    {
+        if (set.empty())
+            throw std::runtime_error("empty cpu set");
+
+        for (auto c: set)
+            if (c >= CPU_SETSIZE || !CPU_ISSET(c, &allowed))
+                throw std::runtime_error("cpu " + std::to_string(c) + " is not available");
+    }
+}
+
+bool pin_thread(const std::vector<unsigned>& _cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto c: _cpus)
+        CPU_SET(c, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+#else
+
+cpu_sets_t rx_queue_cpus(const std::string&)
+{
+    throw std::runtime_error("irq affinity is not supported");
+}
+
+void check_cpus(const cpu_sets_t& _cpus)
+{
+    if (!_cpus.empty())
+        throw std::runtime_error("cpu pinning is not supported");
+}
+
+bool pin_thread(const std::vector<unsigned>& _cpus)
+{
+    return _cpus.empty();
+}
+
+#endif
+
+}
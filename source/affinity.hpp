@@ -0,0 +1,72 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+
+namespace ez
+{
+    using cpu_sets_t = std::vector<std::vector<unsigned>>;
+
+    // linux: cpus the irqs of a network device's rx queues are routed to, in queue order
+
+    cpu_sets_t rx_queue_cpus(const std::string& _device);
+
+    // throws when a set is empty or has cpus the process isn't allowed to run on
+
+    void check_cpus(const cpu_sets_t& _cpus);
+
+    // pins the calling thread, false when the system refused
+
+    bool pin_thread(const std::vector<unsigned>& _cpus);
+
+    // workers set themselves up on their own thread (after pinning, so their memory is first
+    // touched on their numa node), start waits for all of them, then lets them run together
+
+    struct worker_startup
+    {
+        std::mutex              lock;
+        std::condition_variable cv;
+        unsigned                ready = 0;
+        bool                    go = false;
+        std::string             error;  // of the first worker that failed
+
+        void reset()
+        {
+            ready = 0;
+            go = false;
+            error.clear();
+        }
+
+        // worker side, false when start gave up
+
+        bool set_ready(const std::string& _error = std::string())
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if (!_error.empty() && error.empty())
+                error = _error;
+
+            ++ready;
+            cv.notify_all();
+            cv.wait(l, [this] { return go; });
+            return error.empty();
+        }
+
+        // start side, returns the error of a worker, empty when all are ready
+
+        std::string wait(unsigned _workers)
+        {
+            std::unique_lock<std::mutex> l(lock);
+            cv.wait(l, [this, _workers] { return ready == _workers; });
+            return error;
+        }
+
+        void release()
+        {
+            std::lock_guard<std::mutex> l(lock);
+            go = true;
+            cv.notify_all();
+        }
+    };
+}
@@ -1,26 +1,367 @@
 
 #include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <algorithm>
 
 #include <ez/buffer.hpp>
 
+// ------------------------------------------------------------------------------------------
+// impl header and payload live in one block, blocks of the same size class are cached
+// in per-thread free lists, so short-lived message buffers don't hit the heap at all
+
+namespace
+{
+    constexpr size_t pool_capacity[] = { 0, 64, 256, 1024, 4096, 8192, 16384, 65536 };
+    constexpr size_t pool_classes = sizeof(pool_capacity) / sizeof(pool_capacity[0]);
+    constexpr size_t pool_header = 96; // room for any impl header, blocks of a class are interchangeable
+    constexpr size_t pool_cache_bytes = 1024 * 1024; // per class, per thread, headers included
+    constexpr uint8_t heap_block = 0xff;
+
+#ifdef EZ_NO_BUFFER_POOL
+    std::atomic<bool> g_pool_enabled {false};
+#else
+    std::atomic<bool> g_pool_enabled {true};
+#endif
+
+    struct free_block { free_block* next; };
+
+    // hits and misses are written by the owning thread only, pool_stats() reads them
+    // through the list of live caches and adds what exited threads left behind
+
+    struct thread_cache
+    {
+        free_block* head[pool_classes] = {};
+        size_t count[pool_classes] = {};
+        std::atomic<uint64_t> hits {0};
+        std::atomic<uint64_t> misses {0};
+        thread_cache* prev = nullptr;
+        thread_cache* next = nullptr;
+
+        thread_cache();
+        ~thread_cache();
+    };
+
+    std::mutex g_caches_mutex;
+    thread_cache* g_caches = nullptr;
+    uint64_t g_exited_hits = 0;
+    uint64_t g_exited_misses = 0;
+
+    thread_local thread_cache t_cache;
+    thread_local bool t_cache_alive = true;
+
+    thread_cache::thread_cache()
+    {
+        std::lock_guard<std::mutex> lock(g_caches_mutex);
+        next = g_caches;
+        if (next) next->prev = this;
+        g_caches = this;
+    }
+
+    thread_cache::~thread_cache()
+    {
+        t_cache_alive = false;
+        for (size_t i = 0; i < pool_classes; ++i)
+        {
+            while (head[i])
+            {
+                auto next = head[i]->next;
+                free(head[i]);
+                head[i] = next;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(g_caches_mutex);
+        g_exited_hits += hits.load(std::memory_order_relaxed);
+        g_exited_misses += misses.load(std::memory_order_relaxed);
+        if (prev) prev->next = next; else g_caches = next;
+        if (next) next->prev = prev;
+    }
+
+    inline void count_up(std::atomic<uint64_t>& _counter)
+    {
+        // single writer, no locked instruction
+        _counter.store(_counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    inline uint8_t class_of(size_t _capacity)
+    {
+        for (uint8_t i = 0; i < pool_classes; ++i)
+            if (_capacity <= pool_capacity[i])
+                return i;
+
+        return heap_block;
+    }
+
+    void* block_alloc(size_t _header, size_t& _capacity, uint8_t& _class)
+    {
+        _class = g_pool_enabled.load(std::memory_order_relaxed) ? class_of(_capacity) : heap_block;
+
+        if (_class == heap_block)
+        {
+            void* p = malloc(_header + _capacity);
+            if (!p) throw std::bad_alloc();
+            return p;
+        }
+
+        _capacity = pool_capacity[_class];
+
+        if (t_cache_alive && t_cache.head[_class])
+        {
+            auto b = t_cache.head[_class];
+            t_cache.head[_class] = b->next;
+            --t_cache.count[_class];
+            count_up(t_cache.hits);
+            return b;
+        }
+
+        if (t_cache_alive)
+            count_up(t_cache.misses);
+        else
+        {
+            std::lock_guard<std::mutex> lock(g_caches_mutex);
+            ++g_exited_misses;
+        }
+
+        void* p = malloc(pool_header + _capacity);
+        if (!p) throw std::bad_alloc();
+        return p;
+    }
+
+    void block_free(void* _block, uint8_t _class)
+    {
+        if (_class == heap_block || !t_cache_alive ||
+            (t_cache.count[_class] + 1) * (pool_header + pool_capacity[_class]) > pool_cache_bytes)
+        {
+            free(_block);
+            return;
+        }
+
+        auto b = static_cast<free_block*>(_block);
+        b->next = t_cache.head[_class];
+        t_cache.head[_class] = b;
+        ++t_cache.count[_class];
+    }
+}
+
+// ------------------------------------------------------------------------------------------
+
 namespace ez
 {
+    struct shared_buffer::impl
+    {
+        uint8_t* m_data = nullptr;
+        size_t m_size = 0;
+        uint8_t m_class = heap_block;
+
+        std::atomic<unsigned> m_refs {1};
+        void inc_ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+        void dec_ref() { if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) destroy(this); }
+
+        static impl* create(const void* _data, size_t _size);
+        static void destroy(impl* _impl);
+    };
+
+    shared_buffer::impl* shared_buffer::impl::create(const void* _data, size_t _size)
+    {
+        constexpr size_t header_size = (sizeof(impl) + 15) & ~size_t(15);
+        static_assert(header_size <= pool_header, "impl outgrew pool_header");
+
+        uint8_t cls;
+        size_t capacity = _size;
+        auto block = block_alloc(header_size, capacity, cls);
+        auto p = new (block) impl;
+        p->m_class = cls;
+        p->m_data = static_cast<uint8_t*>(block) + header_size;
+        p->m_size = _size;
+        if (_size > 0)
+            memcpy(p->m_data, _data, _size);
+        return p;
+    }
+
+    void shared_buffer::impl::destroy(impl* _impl)
+    {
+        auto cls = _impl->m_class;
+        _impl->~impl();
+        block_free(_impl, cls);
+    }
+
+    // ------------------------------------------------------------------------------------------
+
+    shared_buffer::shared_buffer() : m_impl(nullptr)
+    {
+    }
+
+    shared_buffer::~shared_buffer()
+    {
+        if (m_impl)
+            m_impl->dec_ref();
+    }
+
+    shared_buffer::shared_buffer(const shared_buffer& _right) : m_impl(_right.m_impl)
+    {
+        if (m_impl)
+            m_impl->inc_ref();
+    }
+
+    const shared_buffer& shared_buffer::operator = (const shared_buffer& _right)
+    {
+        if (this == &_right || m_impl == _right.m_impl) return *this;
+
+        if (_right.m_impl)
+            _right.m_impl->inc_ref();
+
+        if (m_impl)
+            m_impl->dec_ref();
+
+        m_impl = _right.m_impl;
+        return *this;
+    }
+
+    shared_buffer::shared_buffer(const buffer& _source) : m_impl(impl::create(_source.ptr(), _source.size()))
+    {
+    }
+
+    shared_buffer::shared_buffer(const void* _data, size_t _size) : m_impl(impl::create(_data, _size))
+    {
+    }
+
+    const uint8_t* shared_buffer::ptr() const
+    {
+        return m_impl ? m_impl->m_data : nullptr;
+    }
+
+    size_t shared_buffer::size() const
+    {
+        return m_impl ? m_impl->m_size : 0;
+    }
+
+    // ------------------------------------------------------------------------------------------
+
     struct buffer::impl
     {
         uint8_t* m_data = nullptr;
         size_t m_size = 0;
         size_t m_orig_size = 0;
         size_t m_position = 0;
-        bool m_own_data = true;
+        size_t m_capacity = 0; // real size of the block behind m_data
+        void* m_own_data = nullptr; // payload block allocated separately after growth
+        uint8_t m_class = heap_block;
+        uint8_t m_data_class = heap_block;
+        shared_buffer::impl* m_shared = nullptr; // payload borrowed from shared_buffer
 
-        unsigned m_refs;
+        unsigned m_refs = 1;
         void inc_ref() { ++m_refs; }
-        void dec_ref() { --m_refs; if (m_refs == 0) { if (m_own_data) delete [] m_data; delete this; } }
+        void dec_ref() { --m_refs; if (m_refs == 0) release(); }
+
+        void release()
+        {
+            if (m_own_data)
+                block_free(m_own_data, m_data_class);
+
+            if (m_shared)
+                m_shared->dec_ref();
+
+            destroy(this);
+        }
+
+        static constexpr size_t header_size();
+        static impl* create(size_t _capacity);
+        static void destroy(impl* _impl);
+
+        void grow(size_t _capacity);
+        void unshare() { if (m_shared) grow(m_orig_size); }
     };
     
-    buffer::buffer() : m_impl(new impl)
+    constexpr size_t buffer::impl::header_size()
+    {
+        return (sizeof(impl) + 15) & ~size_t(15);
+    }
+
+    buffer::impl* buffer::impl::create(size_t _capacity)
+    {
+        static_assert(header_size() <= pool_header, "impl outgrew pool_header");
+
+        uint8_t cls;
+        auto block = block_alloc(header_size(), _capacity, cls);
+        auto p = new (block) impl;
+        p->m_class = cls;
+        p->m_data = static_cast<uint8_t*>(block) + header_size();
+        p->m_orig_size = _capacity;
+        p->m_capacity = _capacity;
+        return p;
+    }
+
+    void buffer::impl::destroy(impl* _impl)
     {
-        m_impl->m_refs = 1;
+        auto cls = _impl->m_class;
+        _impl->~impl();
+        block_free(_impl, cls);
+    }
+
+    void buffer::impl::grow(size_t _capacity)
+    {
+        if (_capacity <= m_capacity && !m_shared)
+        {
+            m_orig_size = std::max(m_orig_size, _capacity);
+            return;
+        }
+
+        // geometric growth, blocks have the same layout as impl blocks to share free lists;
+        // a shared payload is copied, other workers may be reading it
+
+        auto capacity = m_shared ? std::max(_capacity, m_size) : std::max(_capacity, m_capacity * 2);
+        uint8_t cls;
+        auto block = block_alloc(header_size(), capacity, cls);
+        auto data = static_cast<uint8_t*>(block) + header_size();
+
+        memcpy(data, m_data, m_size);
+
+        if (m_own_data)
+            block_free(m_own_data, m_data_class);
+
+        if (m_shared)
+        {
+            m_shared->dec_ref();
+            m_shared = nullptr;
+        }
+
+        m_own_data = block;
+        m_data_class = cls;
+        m_data = data;
+        m_capacity = capacity;
+        m_orig_size = std::max(m_orig_size, _capacity);
+    }
+
+    // ------------------------------------------------------------------------------------------
+
+    void buffer::enable_pool(bool _flag)
+    {
+        g_pool_enabled = _flag;
+    }
+
+    buffer::pool_stats_t buffer::pool_stats()
+    {
+        std::lock_guard<std::mutex> lock(g_caches_mutex);
+
+        pool_stats_t st;
+        st.hits = g_exited_hits;
+        st.misses = g_exited_misses;
+        for (auto c = g_caches; c; c = c->next)
+        {
+            st.hits += c->hits.load(std::memory_order_relaxed);
+            st.misses += c->misses.load(std::memory_order_relaxed);
+        }
+        return st;
+    }
+
+    // ------------------------------------------------------------------------------------------
+
+    buffer::buffer() : m_impl(impl::create(0))
+    {
+        m_impl->m_orig_size = 0;
     }
     
     buffer::buffer(const buffer& _right) : m_impl(nullptr)
@@ -41,71 +382,78 @@ namespace ez
         return *this;
     }
     
-    buffer::buffer(size_t _size) : m_impl(new impl)
+    buffer::buffer(size_t _size) : m_impl(impl::create(_size))
     {
-        m_impl->m_refs = 1;
-        m_impl->m_data = new unsigned char[_size];
         memset(m_impl->m_data, 0, _size);
         m_impl->m_size = _size;
         m_impl->m_orig_size = _size;
     }
 
-    buffer::buffer(const std::vector<uint8_t>& _vec) : m_impl(new impl)
+    buffer::buffer(size_t _size, uninitialized_t) : m_impl(impl::create(_size))
+    {
+        m_impl->m_size = _size;
+        m_impl->m_orig_size = _size;
+    }
+
+    buffer::buffer(const std::vector<uint8_t>& _vec) : m_impl(impl::create(_vec.size()))
     {
-        m_impl->m_refs = 1;
-        m_impl->m_data = new uint8_t[_vec.size()];
         m_impl->m_size = _vec.size();
         m_impl->m_orig_size = _vec.size();
         memcpy(m_impl->m_data, _vec.data(), _vec.size());
     }
     
-    buffer::buffer(const void *_data, size_t _size, bool _copy) : m_impl(new impl)
+    buffer::buffer(const void *_data, size_t _size, bool _copy) : m_impl(impl::create(_copy ? _size : 0))
     {
         const uint8_t* dp = reinterpret_cast<const uint8_t*>(_data);
-        m_impl->m_refs = 1;
         if (_copy)
-        {
-            m_impl->m_data = new unsigned char[_size];
             memcpy(m_impl->m_data, dp, _size);
-            m_impl->m_own_data = true;
-        }
         else
         {
             m_impl->m_data = (uint8_t*) dp;
-            m_impl->m_own_data = false;
+            m_impl->m_capacity = _size;
         }
 
         m_impl->m_size = _size;
         m_impl->m_orig_size = _size;
     }
 
-    buffer::buffer(const std::string& _str) : m_impl(new impl)
+    buffer::buffer(const std::string& _str) : m_impl(impl::create(_str.size()))
     {
-        m_impl->m_refs = 1;
-        m_impl->m_data = new uint8_t[_str.size()];
         m_impl->m_size = _str.size();
         m_impl->m_orig_size = _str.size();
         memcpy(m_impl->m_data, _str.c_str(), _str.size());
     }
 
-    buffer::buffer(const std::string_view _str)
+    buffer::buffer(const std::string_view _str) : m_impl(impl::create(_str.size()))
     {
-        m_impl->m_refs = 1;
-        m_impl->m_data = new uint8_t[_str.size()];
         m_impl->m_size = _str.size();
         m_impl->m_orig_size = _str.size();
         memcpy(m_impl->m_data, _str.data(), _str.size());
     }
     
-    buffer::buffer(const char* _str) : m_impl(new impl)
+    buffer::buffer(const char* _str) : m_impl(nullptr)
     {
-        m_impl->m_refs = 1;
         size_t len = strlen(_str);
-        m_impl->m_data = new uint8_t[len];
+        m_impl = impl::create(len);
         m_impl->m_size = len;
         m_impl->m_orig_size = len;
         memcpy(m_impl->m_data, _str, len);
     }
+
+    buffer::buffer(const shared_buffer& _shared) : m_impl(impl::create(0))
+    {
+        if (_shared.m_impl)
+        {
+            _shared.m_impl->inc_ref();
+            m_impl->m_shared = _shared.m_impl;
+            m_impl->m_data = _shared.m_impl->m_data;
+            m_impl->m_size = _shared.m_impl->m_size;
+            m_impl->m_orig_size = m_impl->m_size;
+            m_impl->m_capacity = m_impl->m_size;
+        }
+        else
+            m_impl->m_orig_size = 0;
+    }
     
     buffer::~buffer()
     {
@@ -117,6 +465,12 @@ namespace ez
         return m_impl->m_data + m_impl->m_position;
     }
 
+    uint8_t* buffer::mutable_ptr()
+    {
+        m_impl->unshare();
+        return ptr();
+    }
+
     const char* buffer::c_str() const
     {
         return reinterpret_cast<const char*>(m_impl->m_data) + m_impl->m_position;
@@ -132,6 +486,49 @@ namespace ez
         if (_size <= m_impl->m_orig_size)
             m_impl->m_size = _size;
     }
+
+    size_t buffer::capacity() const
+    {
+        return m_impl->m_orig_size;
+    }
+
+    void buffer::reserve(size_t _capacity)
+    {
+        m_impl->grow(_capacity);
+    }
+
+    void buffer::resize(size_t _size)
+    {
+        m_impl->unshare();
+
+        if (_size > m_impl->m_orig_size)
+            m_impl->grow(_size);
+
+        if (_size > m_impl->m_size)
+            memset(m_impl->m_data + m_impl->m_size, 0, _size - m_impl->m_size);
+
+        m_impl->m_size = _size;
+        if (m_impl->m_position > _size)
+            m_impl->m_position = _size;
+    }
+
+    void buffer::append(const void* _data, size_t _size)
+    {
+        if (_size == 0)
+            return;
+
+        auto need = m_impl->m_size + _size;
+        if (need > m_impl->m_orig_size || m_impl->m_shared)
+            m_impl->grow(need);
+
+        memcpy(m_impl->m_data + m_impl->m_size, _data, _size);
+        m_impl->m_size = need;
+    }
+
+    void buffer::append(std::string_view _str)
+    {
+        append(_str.data(), _str.size());
+    }
     
     size_t buffer::position() const
     {
@@ -149,4 +546,3 @@ namespace ez
         m_impl->m_position = _pos;
     }
 }
-
@@ -0,0 +1,360 @@
+#include <ez/connection_pool.hpp>
+
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <chrono>
+#include <stdexcept>
+#include <errno.h>
+#include <sys/socket.h>
+
+namespace ez {
+
+// ------------------------------------------------------------------------------------------
+
+static int64_t now_ms()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// closed by the peer or failed; data waiting on an idle plain connection means the previous
+// response wasn't read to its end, tls may get session tickets after the handshake though
+
+static bool healthy(connection_pool::connection& _connection, bool _tls)
+{
+    uint8_t byte;
+    auto n = ::recv(_connection.socket().fd(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    if (n == 0)
+        return false;
+
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    return _tls;
+}
+
+struct connection_pool::impl
+{
+    struct host_t
+    {
+        size_t                      open = 0;
+        std::vector<connection*>    idle;   // most recently used last
+    };
+
+    limits_t                                    m_limits;
+    mutable std::mutex                          m_lock;
+    std::condition_variable                     m_cv;
+    std::unordered_map<std::string, host_t>     m_hosts;
+    uint64_t                                    m_created = 0;
+    uint64_t                                    m_reused = 0;
+    bool                                        m_closed = false;   // the pool is gone, leases are out
+
+    size_t open() const
+    {
+        size_t n = 0;
+        for (auto& [key, host]: m_hosts)
+            n += host.open;
+        return n;
+    }
+
+    // idle for too long, moved to _closing, the caller deletes them after unlocking
+
+    void expire(host_t& _host, int64_t _now, std::vector<connection*>& _closing)
+    {
+        auto& idle = _host.idle;
+        auto it = idle.begin();
+        while (it != idle.end() && _now - (*it)->m_idle_since >= m_limits.idle_timeout_ms)
+            ++it;
+
+        _closing.insert(_closing.end(), idle.begin(), it);
+        _host.open -= size_t(it - idle.begin());
+        idle.erase(idle.begin(), it);
+    }
+
+    void give_back(connection* _connection, bool _keep);
+    connection* connect(std::string_view _host, uint16_t _port, bool _tls);
+
+    static void close(std::vector<connection*>& _connections)
+    {
+        for (auto c: _connections)
+            delete c;
+    }
+};
+
+// ------------------------------------------------------------------------------------------
+
+connection_pool::connection_pool()
+{
+    m_impl = new impl;
+}
+
+connection_pool::connection_pool(const limits_t& _limits)
+{
+    m_impl = new impl;
+    m_impl->m_limits = _limits;
+}
+
+// leases still out keep the impl, the last one given back deletes it
+
+connection_pool::~connection_pool()
+{
+    std::vector<connection*> closing;
+    bool last = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_impl->m_lock);
+        m_impl->m_closed = true;
+
+        for (auto& [key, host]: m_impl->m_hosts)
+        {
+            closing.insert(closing.end(), host.idle.begin(), host.idle.end());
+            host.open -= host.idle.size();
+            host.idle.clear();
+        }
+
+        last = m_impl->open() == 0;
+    }
+
+    impl::close(closing);
+
+    if (last)
+        delete m_impl;
+}
+
+connection_pool::lease connection_pool::borrow(std::string_view _host, uint16_t _port, bool _tls, bool _fresh)
+{
+    auto& _this = *m_impl;
+
+    std::string key(_host);
+    for (auto& c: key)
+        if (c >= 'A' && c <= 'Z')
+            c = char(c - 'A' + 'a');
+
+    key += ':' + std::to_string(_port) + (_tls ? "s" : "");
+
+    lease result;
+    result.m_pool = m_impl;
+
+    std::vector<connection*> closing;
+    std::unique_lock<std::mutex> lock(_this.m_lock);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_this.m_limits.wait_ms);
+
+    for (;;)
+    {
+        // looked up again after every wait, evict() erases hosts with nothing open meanwhile
+        auto& host = _this.m_hosts[key];
+        _this.expire(host, now_ms(), closing);
+
+        if (!_fresh && !host.idle.empty())
+        {
+            // taken out and probed unlocked, it stays counted as open meanwhile
+
+            auto c = host.idle.back();
+            host.idle.pop_back();
+
+            lock.unlock();
+            impl::close(closing);
+            closing.clear();
+
+            bool ok = healthy(*c, _tls);
+            if (!ok)
+                delete c;
+
+            lock.lock();
+
+            if (ok)
+            {
+                c->m_reused = true;
+                ++_this.m_reused;
+                result.m_connection = c;
+                break;
+            }
+
+            --_this.m_hosts[key].open;
+            _this.m_cv.notify_all();
+            continue;
+        }
+
+        // a fresh one replaces an idle one at the limit
+        if (_fresh && host.open >= _this.m_limits.max_per_host && !host.idle.empty())
+        {
+            closing.push_back(host.idle.front());
+            host.idle.erase(host.idle.begin());
+            --host.open;
+        }
+
+        if (host.open < _this.m_limits.max_per_host)
+        {
+            ++host.open;
+            break;
+        }
+
+        if (_this.m_cv.wait_until(lock, deadline) == std::cv_status::timeout)
+        {
+            lock.unlock();
+            impl::close(closing);
+            throw std::runtime_error("connection pool: too many connections to " + key);
+        }
+    }
+
+    lock.unlock();
+    impl::close(closing);
+
+    if (!result.m_connection)
+    {
+        try
+        {
+            result.m_connection = _this.connect(_host, _port, _tls);
+            result.m_connection->m_key = key;
+        }
+        catch (...)
+        {
+            lock.lock();
+            --_this.m_hosts[key].open; // counted, so evict() kept it
+            _this.m_cv.notify_all(); // waiters of all hosts share it
+            throw;
+        }
+    }
+
+    return result;
+}
+
+connection_pool::connection* connection_pool::impl::connect(std::string_view _host, uint16_t _port, bool _tls)
+{
+    ip_address address;
+    if (!ip_address::parse(_host, address))
+        address = resolve(_host);
+
+    std::unique_ptr<connection> c(new connection);
+    c->m_socket.connect(address, _port, m_limits.connect_timeout);
+    if (m_limits.io_timeout > 0)
+        c->m_socket.set_timeout(m_limits.io_timeout);
+
+    if (_tls)
+    {
+        c->m_tls = std::make_unique<ez::tls>(c->m_socket);
+        c->m_tls->connect(_host, m_limits.check_cert);
+        c->m_tls->handshake();
+    }
+
+    c->m_http = std::make_unique<ez::http>(c->channel());
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    ++m_created;
+    return c.release();
+}
+
+void connection_pool::impl::give_back(connection* _connection, bool _keep)
+{
+    std::vector<connection*> closing;
+    bool last = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto& host = m_hosts[_connection->m_key];
+
+        if (_keep && !m_closed && host.idle.size() < m_limits.max_idle_per_host)
+        {
+            _connection->m_idle_since = now_ms();
+            host.idle.push_back(_connection);
+        }
+        else
+        {
+            closing.push_back(_connection);
+            --host.open;
+        }
+
+        m_cv.notify_all(); // waiters of all hosts share it
+        last = m_closed && open() == 0;
+    }
+
+    close(closing);
+
+    if (last)
+        delete this;
+}
+
+size_t connection_pool::evict()
+{
+    auto& _this = *m_impl;
+    std::vector<connection*> closing;
+
+    {
+        std::lock_guard<std::mutex> lock(_this.m_lock);
+        auto now = now_ms();
+
+        for (auto it = _this.m_hosts.begin(); it != _this.m_hosts.end(); )
+        {
+            _this.expire(it->second, now, closing);
+            it = it->second.open == 0 ? _this.m_hosts.erase(it) : std::next(it);
+        }
+    }
+
+    impl::close(closing);
+    return closing.size();
+}
+
+connection_pool::stats_t connection_pool::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_impl->m_lock);
+
+    stats_t result;
+    result.created = m_impl->m_created;
+    result.reused = m_impl->m_reused;
+
+    for (auto& [key, host]: m_impl->m_hosts)
+    {
+        result.open += host.open;
+        result.idle += host.idle.size();
+    }
+
+    return result;
+}
+
+// ------------------------------------------------------------------------------------------
+
+connection_pool::lease::lease(lease&& _right)
+{
+    m_pool = _right.m_pool;
+    m_connection = _right.m_connection;
+    _right.m_connection = nullptr;
+}
+
+connection_pool::lease& connection_pool::lease::operator = (lease&& _right)
+{
+    if (this != &_right)
+    {
+        close();
+        m_pool = _right.m_pool;
+        m_connection = _right.m_connection;
+        _right.m_connection = nullptr;
+    }
+
+    return *this;
+}
+
+connection_pool::lease::~lease()
+{
+    close();
+}
+
+void connection_pool::lease::release()
+{
+    if (m_connection)
+        m_pool->give_back(m_connection, true);
+
+    m_connection = nullptr;
+}
+
+void connection_pool::lease::close()
+{
+    if (m_connection)
+        m_pool->give_back(m_connection, false);
+
+    m_connection = nullptr;
+}
+
+}
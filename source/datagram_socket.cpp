@@ -0,0 +1,693 @@
+#include <ez/datagram_socket.hpp>
+#include <ez/buffer.hpp>
+#include "sockaddr.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#if defined(__APPLE__) || defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#endif
+
+#if defined(__linux__)
+#include <netinet/udp.h>
+
+// older headers than the kernels they run on
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+namespace ez {
+
+// ------------------------------------------------------------------------------------------
+
+#if defined(__linux__)
+using mmsg_t = mmsghdr;
+#else
+struct mmsg_t { msghdr msg_hdr; unsigned msg_len; };
+#endif
+
+static constexpr size_t default_slots = 64;
+static constexpr size_t default_slot_size = 2048;
+static constexpr size_t send_batch_size = 64;
+static constexpr size_t max_segments = 64;      // per gso send, older kernels take no more
+static constexpr size_t max_gso_size = 65000;   // fits an ip datagram with headers
+
+static bool would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+[[noreturn]] static void fail(const char* _what)
+{
+    std::string s = std::string("datagram socket: ") + _what + ", errno=" + std::to_string(errno);
+    throw channel::error(s.c_str());
+}
+
+// recvmmsg takes the first datagram as a blocking socket would, the rest only if they are waiting;
+// returns -1 with errno when nothing was received
+
+static int recv_messages(int _fd, mmsg_t* _messages, unsigned _count)
+{
+#if defined(__linux__)
+    return ::recvmmsg(_fd, _messages, _count, MSG_WAITFORONE, nullptr);
+#else
+    unsigned n = 0;
+    for (; n < _count; ++n)
+    {
+        auto result = ::recvmsg(_fd, &_messages[n].msg_hdr, n == 0 ? 0 : MSG_DONTWAIT);
+        if (result < 0)
+            return n > 0 ? int(n) : -1;
+
+        _messages[n].msg_len = unsigned(result);
+    }
+
+    return int(n);
+#endif
+}
+
+static int send_messages(int _fd, mmsg_t* _messages, unsigned _count)
+{
+#if defined(__linux__)
+    return ::sendmmsg(_fd, _messages, _count, 0);
+#else
+    unsigned n = 0;
+    for (; n < _count; ++n)
+    {
+        auto result = ::sendmsg(_fd, &_messages[n].msg_hdr, 0);
+        if (result < 0)
+            return n > 0 ? int(n) : -1;
+
+        _messages[n].msg_len = unsigned(result);
+    }
+
+    return int(n);
+#endif
+}
+
+// ------------------------------------------------------------------------------------------
+
+struct datagram_socket::impl
+{
+    union control_t // gro segment size
+    {
+        cmsghdr     header;
+        uint8_t     data[64];
+    };
+
+    int             m_fd = -1;
+    uint16_t        m_port = 0;
+    bool            m_connected = false;
+    bool            m_nonblocking = false;
+    bool            m_gro = false;
+    int             m_gso = -1;     // not probed yet
+
+    // receive ring, allocated once, the kernel writes straight into its slots
+
+    std::vector<uint8_t>            m_data;
+    std::vector<mmsg_t>             m_recv;
+    std::vector<iovec>              m_recv_iov;
+    std::vector<sockaddr_storage>   m_recv_names;
+    std::vector<control_t>          m_recv_control;
+    std::vector<message_t>          m_messages;
+
+    mmsg_t              m_send[send_batch_size];
+    iovec               m_send_iov[send_batch_size];
+    sockaddr_storage    m_send_names[send_batch_size];
+
+    void create(const ip_address& _address)
+    {
+        if (m_fd != -1)
+            return;
+
+        int family = _address.is_v4() ? AF_INET : AF_INET6;
+#ifdef SOCK_CLOEXEC
+        m_fd = ::socket(family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+#else
+        m_fd = ::socket(family, SOCK_DGRAM, IPPROTO_UDP);
+#endif
+        if (m_fd == -1)
+            fail("can't create socket");
+
+        if (m_nonblocking)
+            fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    void local_port()
+    {
+        sockaddr_storage sa;
+        socklen_t length = sizeof(sa);
+        if (::getsockname(m_fd, reinterpret_cast<sockaddr*>(&sa), &length) == 0)
+            from_sockaddr(sa, &m_port);
+    }
+
+    void ring(size_t _slots, size_t _slot_size)
+    {
+        m_data.assign(_slots * _slot_size, 0);
+        m_recv.assign(_slots, mmsg_t());
+        m_recv_iov.resize(_slots);
+        m_recv_names.resize(_slots);
+        m_recv_control.resize(_slots);
+        m_messages.assign(_slots, message_t());
+
+        for (size_t i = 0; i < _slots; ++i)
+        {
+            m_recv_iov[i].iov_base = m_data.data() + i * _slot_size;
+            m_recv_iov[i].iov_len = _slot_size;
+            m_messages[i].data = m_data.data() + i * _slot_size;
+
+            auto& header = m_recv[i].msg_hdr;
+            header.msg_name = &m_recv_names[i];
+            header.msg_iov = &m_recv_iov[i];
+            header.msg_iovlen = 1;
+            header.msg_control = &m_recv_control[i];
+        }
+    }
+
+    bool gso_supported()
+    {
+#if defined(__linux__)
+        if (m_gso == -1)
+        {
+            // before 4.18 the kernel ignores the option and would send one large datagram
+            int value = 0;
+            socklen_t length = sizeof(value);
+            m_gso = ::getsockopt(m_fd, SOL_UDP, UDP_SEGMENT, &value, &length) == 0;
+        }
+
+        return m_gso == 1;
+#else
+        return false;
+#endif
+    }
+};
+
+// ------------------------------------------------------------------------------------------
+
+datagram_socket::datagram_socket()
+{
+    m_impl = new impl;
+}
+
+datagram_socket::datagram_socket(datagram_socket&& _right)
+{
+    m_impl = _right.m_impl;
+    _right.m_impl = new impl;
+}
+
+datagram_socket::~datagram_socket()
+{
+    close();
+    delete m_impl;
+}
+
+datagram_socket::fd_t datagram_socket::fd() const
+{
+    return m_impl->m_fd;
+}
+
+uint16_t datagram_socket::port() const
+{
+    return m_impl->m_port;
+}
+
+bool datagram_socket::is_connected() const
+{
+    return m_impl->m_connected;
+}
+
+void datagram_socket::close()
+{
+    auto& _this = *m_impl;
+
+    if (_this.m_fd != -1)
+    {
+        ::close(_this.m_fd);
+        _this.m_fd = -1;
+    }
+
+    _this.m_connected = false;
+    _this.m_gro = false;
+    _this.m_gso = -1;
+}
+
+// before bind or connect it applies when they create the socket
+
+void datagram_socket::set_nonblocking(bool _flag)
+{
+    auto& _this = *m_impl;
+
+    if (_this.m_fd != -1)
+    {
+        int opts;
+        if ((opts = fcntl(_this.m_fd, F_GETFL)) < 0)
+            throw channel::error("can't get socket options");
+
+        if (_flag)
+            opts |= O_NONBLOCK;
+        else
+            opts &= ~O_NONBLOCK;
+
+        if (fcntl(_this.m_fd, F_SETFL, opts) < 0)
+            throw channel::error("can't set socket options");
+    }
+
+    _this.m_nonblocking = _flag;
+}
+
+bool datagram_socket::is_nonblocking() const
+{
+    return m_impl->m_nonblocking;
+}
+
+void datagram_socket::set_buffer_size(size_t _recv, size_t _send)
+{
+    auto& _this = *m_impl;
+
+    if (_this.m_fd == -1)
+        throw channel::error("datagram socket: buffer size needs a bound or connected socket");
+
+    int size = static_cast<int>(std::min<size_t>(_recv, INT_MAX));
+    if (_recv && setsockopt(_this.m_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1)
+        fail("can't set receive buffer size");
+
+    size = static_cast<int>(std::min<size_t>(_send, INT_MAX));
+    if (_send && setsockopt(_this.m_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1)
+        fail("can't set send buffer size");
+}
+
+// ------------------------------------------------------------------------------------------
+
+void datagram_socket::bind(const ip_address& _address, uint16_t _port, bool _share, bool _v6_only)
+{
+    auto& _this = *m_impl;
+    _this.create(_address);
+
+    if (_address.is_v6())
+    {
+        // the system default differs (linux: off, bsd: on), always set it
+        int set = _v6_only ? 1 : 0;
+        setsockopt(_this.m_fd, IPPROTO_IPV6, IPV6_V6ONLY, &set, sizeof(set));
+    }
+
+    if (_share)
+    {
+        int set = 1;
+        setsockopt(_this.m_fd, SOL_SOCKET, SO_REUSEADDR, &set, sizeof(set));
+        setsockopt(_this.m_fd, SOL_SOCKET, SO_REUSEPORT, &set, sizeof(set));
+    }
+
+    sockaddr_storage sa;
+    auto length = to_sockaddr(_address, _port, sa);
+
+    if (::bind(_this.m_fd, reinterpret_cast<sockaddr*>(&sa), length) == -1)
+        fail("can't bind to selected address");
+
+    _this.local_port();
+}
+
+void datagram_socket::connect(const ip_address& _address, uint16_t _port)
+{
+    auto& _this = *m_impl;
+    _this.create(_address);
+
+    sockaddr_storage sa;
+    auto length = to_sockaddr(_address, _port, sa);
+
+    if (::connect(_this.m_fd, reinterpret_cast<sockaddr*>(&sa), length) == -1)
+        fail("can't connect");
+
+    _this.m_connected = true;
+    _this.local_port();
+}
+
+void datagram_socket::set_ring(size_t _slots, size_t _slot_size)
+{
+    if (_slots == 0 || _slot_size == 0)
+        throw channel::error("datagram socket: empty receive ring");
+
+    m_impl->ring(_slots, _slot_size);
+}
+
+bool datagram_socket::set_gro(bool _flag)
+{
+    auto& _this = *m_impl;
+
+    if (_this.m_fd == -1)
+        throw channel::error("datagram socket: gro needs a bound or connected socket");
+
+#if defined(__linux__)
+    int set = _flag ? 1 : 0;
+    if (setsockopt(_this.m_fd, SOL_UDP, UDP_GRO, &set, sizeof(set)) == 0)
+    {
+        _this.m_gro = _flag;
+        return true;
+    }
+#endif
+
+    _this.m_gro = false;
+    return !_flag;
+}
+
+// ------------------------------------------------------------------------------------------
+
+size_t datagram_socket::recv_batch(const message_t*& _messages)
+{
+    auto& _this = *m_impl;
+
+    if (_this.m_fd == -1)
+        throw channel::error("datagram socket: recv fail, socket is not bound or connected");
+
+    if (_this.m_messages.empty())
+        _this.ring(default_slots, default_slot_size);
+
+    // the kernel shortens these to what it wrote
+
+    auto slots = _this.m_recv.size();
+    for (size_t i = 0; i < slots; ++i)
+    {
+        auto& header = _this.m_recv[i].msg_hdr;
+        header.msg_namelen = sizeof(sockaddr_storage);
+        header.msg_controllen = _this.m_gro ? sizeof(impl::control_t) : 0;
+        header.msg_flags = 0;
+    }
+
+    int count;
+    for (;;)
+    {
+        count = recv_messages(_this.m_fd, _this.m_recv.data(), unsigned(slots));
+        if (count >= 0)
+            break;
+
+        if (errno == EINTR)
+            continue;
+
+        if (would_block())
+            return 0;
+
+        fail("recv failed");
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        auto& header = _this.m_recv[i].msg_hdr;
+        auto& message = _this.m_messages[i];
+
+        message.size = _this.m_recv[i].msg_len;
+        message.truncated = (header.msg_flags & MSG_TRUNC) != 0;
+        message.peer = from_sockaddr(_this.m_recv_names[i], &message.port);
+        message.segment = 0;
+
+#if defined(__linux__)
+        if (_this.m_gro)
+        {
+            for (auto c = CMSG_FIRSTHDR(&header); c; c = CMSG_NXTHDR(&header, c))
+            {
+                if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+                {
+                    int segment;
+                    memcpy(&segment, CMSG_DATA(c), sizeof(segment));
+                    if (segment > 0 && size_t(segment) < message.size)
+                        message.segment = uint16_t(segment);
+                }
+            }
+        }
+#endif
+    }
+
+    _messages = _this.m_messages.data();
+    return size_t(count);
+}
+
+size_t datagram_socket::send_batch(const datagram_t* _datagrams, size_t _count)
+{
+    auto& _this = *m_impl;
+
+    if (_this.m_fd == -1)
+        throw channel::error("datagram socket: send fail, socket is not bound or connected");
+
+    size_t sent = 0;
+    while (sent < _count)
+    {
+        auto n = std::min(_count - sent, send_batch_size);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            auto& datagram = _datagrams[sent + i];
+            auto& header = _this.m_send[i].msg_hdr;
+
+            header = msghdr();
+            _this.m_send_iov[i].iov_base = const_cast<uint8_t*>(datagram.data);
+            _this.m_send_iov[i].iov_len = datagram.size;
+            header.msg_iov = &_this.m_send_iov[i];
+            header.msg_iovlen = 1;
+
+            if (datagram.peer)
+            {
+                header.msg_name = &_this.m_send_names[i];
+                header.msg_namelen = to_sockaddr(*datagram.peer, datagram.port, _this.m_send_names[i]);
+            }
+            else if (!_this.m_connected)
+            {
+                throw channel::error("datagram socket: send fail, no peer and socket is not connected");
+            }
+        }
+
+        auto result = send_messages(_this.m_fd, _this.m_send, unsigned(n));
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (would_block() || sent > 0)
+                break;
+
+            fail("send failed");
+        }
+
+        sent += size_t(result); // fewer: the next call reports why
+    }
+
+    return sent;
+}
+
+size_t datagram_socket::send_segments(const uint8_t* _data, size_t _size, uint16_t _segment, const ip_address* _peer, uint16_t _port)
+{
+    auto& _this = *m_impl;
+
+    if (_this.m_fd == -1)
+        throw channel::error("datagram socket: send fail, socket is not bound or connected");
+
+    if (_segment == 0)
+        throw channel::error("datagram socket: send fail, zero segment size");
+
+    if (!_peer && !_this.m_connected)
+        throw channel::error("datagram socket: send fail, no peer and socket is not connected");
+
+    size_t sent = 0;
+
+#if defined(__linux__)
+    size_t per_call = std::min(max_segments, max_gso_size / _segment) * _segment;
+
+    if (per_call > _segment && _size > _segment && _this.gso_supported())
+    {
+        sockaddr_storage sa;
+        socklen_t length = _peer ? to_sockaddr(*_peer, _port, sa) : 0;
+
+        while (sent < _size)
+        {
+            auto n = std::min(per_call, _size - sent);
+
+            iovec iov { const_cast<uint8_t*>(_data + sent), n };
+            impl::control_t control;
+
+            msghdr header{};
+            header.msg_name = _peer ? &sa : nullptr;
+            header.msg_namelen = length;
+            header.msg_iov = &iov;
+            header.msg_iovlen = 1;
+
+            if (n > _segment)
+            {
+                header.msg_control = &control;
+                header.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+                auto c = CMSG_FIRSTHDR(&header);
+                c->cmsg_level = SOL_UDP;
+                c->cmsg_type = UDP_SEGMENT;
+                c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                memcpy(CMSG_DATA(c), &_segment, sizeof(_segment));
+            }
+
+            if (::sendmsg(_this.m_fd, &header, 0) >= 0)
+            {
+                sent += n;
+                continue;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            if (would_block())
+                return sent;
+
+            // no checksum offload on the route or the device (EIO), a segment over the mtu (EINVAL):
+            // the rest goes one datagram each
+            if (errno == EIO || errno == EOPNOTSUPP || errno == ENOPROTOOPT)
+                _this.m_gso = 0;
+            else if (errno != EINVAL)
+            {
+                if (sent > 0)
+                    return sent;
+
+                fail("send failed");
+            }
+
+            break;
+        }
+    }
+#endif
+
+    datagram_t batch[send_batch_size];
+
+    while (sent < _size)
+    {
+        size_t count = 0;
+        for (size_t at = sent; at < _size && count < send_batch_size; at += _segment)
+            batch[count++] = datagram_t { _data + at, std::min<size_t>(_segment, _size - at), _peer, _port };
+
+        size_t n;
+        try
+        {
+            n = send_batch(batch, count);
+        }
+        catch (const channel::error&)
+        {
+            if (sent == 0)
+                throw;
+            break;
+        }
+
+        for (size_t i = 0; i < n; ++i)
+            sent += batch[i].size;
+
+        if (n < count)
+            break;
+    }
+
+    return sent;
+}
+
+// ------------------------------------------------------------------------------------------
+
+ssize_t datagram_socket::send(const buffer& _data)
+{
+    return send(_data.ptr(), _data.size());
+}
+
+ssize_t datagram_socket::send(const uint8_t* _data, size_t _size)
+{
+    iovec iov { const_cast<uint8_t*>(_data), _size };
+    return send(&iov, 1);
+}
+
+ssize_t datagram_socket::send(const iovec* _iov, int _count)
+{
+    auto& _this = *m_impl;
+
+    if (!_this.m_connected)
+        throw channel::error("send fail: socket is not connected");
+
+    msghdr header{};
+    header.msg_iov = const_cast<iovec*>(_iov);
+    header.msg_iovlen = _count;
+
+    for (;;)
+    {
+        if (auto result = ::sendmsg(_this.m_fd, &header, 0); result >= 0)
+            return result;
+
+        if (errno == EINTR)
+            continue;
+
+        if (would_block())
+        {
+            if (_this.m_nonblocking)
+                return -3;
+
+            throw timeout();
+        }
+
+        fail("send failed");
+    }
+}
+
+ssize_t datagram_socket::send_file(int, off_t, size_t)
+{
+    throw channel::error("datagram socket: send_file is not supported");
+}
+
+ssize_t datagram_socket::recv(buffer& _destination, size_t _desired_size)
+{
+    return recv(_destination.mutable_ptr(), _destination.size(), _desired_size);
+}
+
+// an empty datagram returns 0 too, it doesn't mean closed
+
+ssize_t datagram_socket::recv(uint8_t* _data, size_t _size, size_t _desired_size)
+{
+    auto& _this = *m_impl;
+
+    if (!_this.m_connected)
+        throw channel::error("recv fail: socket is not connected");
+
+    if (_size < _desired_size)
+        throw channel::error("recv fail: buffer is too small for desired size");
+
+    for (;;)
+    {
+        if (auto result = ::recv(_this.m_fd, _data, _desired_size > 0 ? _desired_size : _size, 0); result >= 0)
+            return result;
+
+        if (errno == EINTR)
+            continue;
+
+        if (would_block())
+        {
+            if (_this.m_nonblocking)
+                return -2;
+
+            throw timeout();
+        }
+
+        fail("recv failed");
+    }
+}
+
+bool datagram_socket::can_read() const
+{
+    if (m_impl->m_fd == -1)
+        return false;
+
+    int nread = 0;
+    ioctl(m_impl->m_fd, FIONREAD, &nread);
+
+    return nread > 0;
+}
+
+}
@@ -0,0 +1,337 @@
+#include "dns.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+
+namespace ez::dns {
+
+// ------------------------------------------------------------------------------------------
+
+static inline void put16(uint8_t*& _p, uint16_t _value)
+{
+    *_p++ = uint8_t(_value >> 8);
+    *_p++ = uint8_t(_value);
+}
+
+static inline uint16_t get16(const uint8_t* _p)
+{
+    return uint16_t(_p[0] << 8 | _p[1]);
+}
+
+static inline uint32_t get32(const uint8_t* _p)
+{
+    return uint32_t(_p[0]) << 24 | uint32_t(_p[1]) << 16 | uint32_t(_p[2]) << 8 | _p[3];
+}
+
+std::string normalize(std::string_view _name)
+{
+    if (!_name.empty() && _name.back() == '.')
+        _name.remove_suffix(1);
+
+    std::string result(_name);
+    for (auto& c: result)
+        if (c >= 'A' && c <= 'Z')
+            c = char(c - 'A' + 'a');
+
+    return result;
+}
+
+size_t make_query(uint8_t* _out, uint16_t _id, std::string_view _name, uint16_t _type)
+{
+    if (!_name.empty() && _name.back() == '.')
+        _name.remove_suffix(1);
+
+    if (_name.empty() || _name.size() > 253)
+        return 0;
+
+    uint8_t* p = _out;
+    put16(p, _id);
+    put16(p, 0x0100);   // rd
+    put16(p, 1);        // questions
+    put16(p, 0);
+    put16(p, 0);
+    put16(p, 1);        // additional: opt
+
+    while (!_name.empty())
+    {
+        auto dot = _name.find('.');
+        auto label = _name.substr(0, dot);
+        if (label.empty() || label.size() > 63)
+            return 0;
+
+        *p++ = uint8_t(label.size());
+        memcpy(p, label.data(), label.size());
+        p += label.size();
+
+        _name.remove_prefix(dot == std::string_view::npos ? _name.size() : dot + 1);
+        if (dot != std::string_view::npos && _name.empty())
+            return 0; // "a.b.."
+    }
+
+    *p++ = 0;
+    put16(p, _type);
+    put16(p, 1);        // in
+
+    *p++ = 0;           // opt: root name, udp size in class, no extended flags
+    put16(p, opt);
+    put16(p, max_udp);
+    put16(p, 0);
+    put16(p, 0);
+    put16(p, 0);
+
+    return size_t(p - _out);
+}
+
+// ------------------------------------------------------------------------------------------
+// name at _pos as lowercase "a.b.c", follows compression pointers; _pos moves past it
+
+static bool read_name(const uint8_t* _msg, size_t _size, size_t& _pos, std::string& _name)
+{
+    _name.clear();
+
+    size_t pos = _pos;
+    bool jumped = false;
+
+    for (unsigned hops = 0; hops < 64; )
+    {
+        if (pos >= _size)
+            return false;
+
+        uint8_t length = _msg[pos];
+
+        if ((length & 0xc0) == 0xc0)
+        {
+            if (pos + 1 >= _size)
+                return false;
+
+            size_t target = size_t(length & 0x3f) << 8 | _msg[pos + 1];
+            if (!jumped)
+                _pos = pos + 2;
+
+            jumped = true;
+            pos = target;
+            ++hops;
+            continue;
+        }
+
+        if (length & 0xc0)
+            return false;
+
+        if (length == 0)
+        {
+            if (!jumped)
+                _pos = pos + 1;
+            return _name.size() <= 253;
+        }
+
+        if (pos + 1 + length > _size)
+            return false;
+
+        if (!_name.empty())
+            _name += '.';
+
+        for (size_t i = pos + 1; i < pos + 1 + length; ++i)
+        {
+            char c = char(_msg[i]);
+            _name += c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+        }
+
+        pos += 1 + size_t(length);
+    }
+
+    return false;
+}
+
+struct record_t
+{
+    std::string name;
+    uint16_t    type;
+    uint32_t    ttl;
+    size_t      data;   // offset of rdata
+    uint16_t    size;
+};
+
+static bool read_records(const uint8_t* _msg, size_t _size, size_t& _pos, unsigned _count, std::vector<record_t>& _records)
+{
+    for (unsigned i = 0; i < _count; ++i)
+    {
+        record_t r;
+        if (!read_name(_msg, _size, _pos, r.name) || _pos + 10 > _size)
+            return false;
+
+        r.type = get16(_msg + _pos);
+        r.ttl = get32(_msg + _pos + 4);
+        r.size = get16(_msg + _pos + 8);
+        r.data = _pos + 10;
+
+        if (r.ttl > 0x7fffffff) // rfc 2181
+            r.ttl = 0;
+
+        _pos = r.data + r.size;
+        if (_pos > _size)
+            return false;
+
+        _records.push_back(std::move(r));
+    }
+
+    return true;
+}
+
+bool parse_response(const uint8_t* _msg, size_t _size, uint16_t _id, std::string_view _name, uint16_t _type, answer_t& _answer)
+{
+    if (_size < 12 || get16(_msg) != _id)
+        return false;
+
+    uint16_t flags = get16(_msg + 2);
+    if (!(flags & 0x8000) || (flags & 0x7800) != 0 || get16(_msg + 4) != 1)
+        return false;
+
+    size_t pos = 12;
+    std::string name, qname = normalize(_name);
+
+    if (!read_name(_msg, _size, pos, name) || pos + 4 > _size || name != qname ||
+        get16(_msg + pos) != _type || get16(_msg + pos + 2) != 1)
+        return false;
+
+    pos += 4;
+
+    _answer = answer_t();
+    _answer.rcode = uint8_t(flags & 0x0f);
+    _answer.truncated = (flags & 0x0200) != 0;
+
+    std::vector<record_t> answers, authority;
+    if (!read_records(_msg, _size, pos, get16(_msg + 6), answers) ||
+        !read_records(_msg, _size, pos, get16(_msg + 8), authority))
+    {
+        // a truncated message may end in the middle of a record, use what is complete
+        if (!_answer.truncated)
+            return false;
+    }
+
+    if (_answer.rcode != no_error && _answer.rcode != name_error)
+        return true;
+
+    // follow the cname chain from the question
+
+    uint32_t ttl = ~0u;
+    for (unsigned hops = 0; hops < 16; ++hops)
+    {
+        auto it = std::find_if(answers.begin(), answers.end(), [&](const record_t& _r) { return _r.type == cname && _r.name == qname; });
+        if (it == answers.end())
+            break;
+
+        size_t at = it->data;
+        ttl = std::min(ttl, it->ttl);
+        if (!read_name(_msg, _size, at, qname))
+            return false;
+    }
+
+    for (auto& r: answers)
+    {
+        if (r.type != _type || r.name != qname)
+            continue;
+
+        ip_address address;
+        if (_type == a && r.size == 4)
+            memcpy(address.bytes, _msg + r.data, 4);
+        else if (_type == aaaa && r.size == 16)
+        {
+            address.family = ip_address::family_e::v6;
+            memcpy(address.bytes, _msg + r.data, 16);
+        }
+        else
+            continue;
+
+        _answer.addresses.push_back(address);
+        ttl = std::min(ttl, r.ttl);
+    }
+
+    if (!_answer.addresses.empty())
+    {
+        _answer.ttl = ttl;
+        return true;
+    }
+
+    // negative answer: min of the soa ttl and its minimum field
+
+    for (auto& r: authority)
+    {
+        if (r.type != soa)
+            continue;
+
+        size_t at = r.data;
+        std::string skip;
+        if (read_name(_msg, _size, at, skip) && read_name(_msg, _size, at, skip) && at + 20 <= r.data + r.size)
+            _answer.ttl = std::min(r.ttl, get32(_msg + at + 16));
+
+        break;
+    }
+
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------
+
+resolv_conf_t read_resolv_conf(const std::string& _path)
+{
+    resolv_conf_t result;
+    std::ifstream file(_path);
+    std::string line;
+
+    while (std::getline(file, line))
+    {
+        std::stringstream ss(line);
+        std::string key, value;
+        if (!(ss >> key) || key[0] == '#' || key[0] == ';')
+            continue;
+
+        if (key == "nameserver" && ss >> value)
+        {
+            ip_address server;
+            if (ip_address::parse(value, server))
+                result.servers.push_back(server);
+        }
+        else if (key == "options")
+        {
+            while (ss >> value)
+            {
+                if (value.compare(0, 8, "timeout:") == 0)
+                    result.timeout_ms = unsigned(atoi(value.c_str() + 8)) * 1000;
+                else if (value.compare(0, 9, "attempts:") == 0)
+                    result.attempts = unsigned(atoi(value.c_str() + 9));
+            }
+        }
+    }
+
+    return result;
+}
+
+hosts_t read_hosts(const std::string& _path)
+{
+    hosts_t result;
+    std::ifstream file(_path);
+    std::string line;
+
+    while (std::getline(file, line))
+    {
+        if (auto hash = line.find('#'); hash != std::string::npos)
+            line.resize(hash);
+
+        std::stringstream ss(line);
+        std::string text, name;
+        ip_address address;
+
+        if (!(ss >> text) || !ip_address::parse(text, address))
+            continue;
+
+        while (ss >> name)
+            result[normalize(name)].push_back(address);
+    }
+
+    return result;
+}
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <ez/ip.hpp>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+
+namespace ez::dns
+{
+    enum type_e : uint16_t
+    {
+        a = 1,
+        cname = 5,
+        soa = 6,
+        aaaa = 28,
+        opt = 41
+    };
+
+    enum rcode_e : uint8_t
+    {
+        no_error = 0,
+        server_failure = 2,
+        name_error = 3
+    };
+
+    constexpr size_t max_udp = 1232; // edns buffer size we announce, fits the minimum v6 mtu
+
+    // query with recursion desired and an edns opt record, returns its size, 0 for an invalid name
+
+    size_t make_query(uint8_t* _out, uint16_t _id, std::string_view _name, uint16_t _type);
+
+    // addresses of _type at the end of the cname chain of the name, ttl is the smallest one of
+    // the chain; for an empty answer ttl comes from the soa record (rfc 2308), ~0 when there is none
+
+    struct answer_t
+    {
+        uint8_t                 rcode = 0;
+        bool                    truncated = false;
+        uint32_t                ttl = ~0u;
+        std::vector<ip_address> addresses;
+    };
+
+    // false when it is not a response to this query
+    bool parse_response(const uint8_t* _msg, size_t _size, uint16_t _id, std::string_view _name, uint16_t _type, answer_t& _answer);
+
+    // nameservers and options timeout:n attempts:n, 0 when not set; search domains are ignored
+
+    struct resolv_conf_t
+    {
+        std::vector<ip_address> servers;
+        unsigned                timeout_ms = 0;
+        unsigned                attempts = 0;
+    };
+
+    resolv_conf_t read_resolv_conf(const std::string& _path);
+
+    // lowercase name without a trailing dot -> addresses in file order
+
+    using hosts_t = std::unordered_map<std::string, std::vector<ip_address>>;
+
+    hosts_t read_hosts(const std::string& _path);
+
+    std::string normalize(std::string_view _name);
+}
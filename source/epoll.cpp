@@ -1,23 +1,37 @@
 
 #include <ez/events.hpp>
+#include "placement.hpp"
+#include "timer_wheel.hpp"
+#include "task_queue.hpp"
+#include "polling.hpp"
+#include "affinity.hpp"
+#include "read_budget.hpp"
 
 #include <thread>
+#include <mutex>
+#include <exception>
 #include <sys/wait.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 #include <sys/prctl.h>
 #include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <atomic>
 #include <string.h>
 #include <stdexcept>
+#include <vector>
+#include <algorithm>
 
 using namespace std::chrono_literals;
 
 // ------------------------------------------------------------------------------------------
 
-static inline bool epoll_add(int _epoll, int _fd, unsigned _ev = 0)
+// epoll data is a handler pointer or fd << 1 | 1, handlers are aligned so the low bit tells them apart
+
+static inline bool epoll_set(int _epoll, int _op, int _fd, unsigned _ev, ez::event_loop::handler_t* _handler)
 {
     struct epoll_event ev{};
     if (_ev == 0)
@@ -25,14 +39,73 @@ static inline bool epoll_add(int _epoll, int _fd, unsigned _ev = 0)
     else
         ev.events = _ev;
 
-    ev.data.fd = _fd;
+    if (_handler)
+        ev.data.ptr = _handler;
+    else
+        ev.data.u64 = (uint64_t(uint32_t(_fd)) << 1) | 1;
 
-    int n = epoll_ctl(_epoll, EPOLL_CTL_ADD, _fd, &ev);
+    int n = epoll_ctl(_epoll, _op, _fd, &ev);
     if (n != 0) return false;
 
     return true;
 }
 
+static inline bool epoll_add(int _epoll, int _fd, unsigned _ev = 0, ez::event_loop::handler_t* _handler = nullptr)
+{
+    return epoll_set(_epoll, EPOLL_CTL_ADD, _fd, _ev, _handler);
+}
+
+// edge triggered fd is reported again by the next epoll_wait if it's still ready
+
+static inline bool epoll_rearm(int _epoll, int _fd, ez::event_loop::handler_t* _handler)
+{
+    return epoll_set(_epoll, EPOLL_CTL_MOD, _fd, 0, _handler);
+}
+
+// napi busy polling of an epoll instance, linux 6.9+, older headers don't have it
+
+struct epoll_busy_poll
+{
+    uint32_t    busy_poll_usecs;
+    uint16_t    busy_poll_budget;
+    uint8_t     prefer_busy_poll;
+    uint8_t     pad;
+};
+
+#ifndef EPIOCSPARAMS
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, epoll_busy_poll)
+#endif
+
+static inline bool epoll_set_busy_poll(int _epoll, const ez::event_loop::polling_t& _polling)
+{
+    epoll_busy_poll params{};
+    params.busy_poll_usecs = _polling.busy_poll_us;
+    params.busy_poll_budget = _polling.busy_poll_budget;
+    params.prefer_busy_poll = _polling.prefer_busy_poll ? 1 : 0;
+    return ioctl(_epoll, EPIOCSPARAMS, &params) == 0;
+}
+
+static inline bool busy_poll_enabled(const ez::event_loop::polling_t& _polling)
+{
+    return _polling.busy_poll_us > 0 || _polling.busy_poll_budget > 0 || _polling.prefer_busy_poll;
+}
+
+// ------------------------------------------------------------------------------------------
+
+static thread_local int t_fd = -1; // of the event being dispatched, -1 between dispatches
+static thread_local bool t_rearmed = false; // drain_fd armed t_fd again
+
+static inline ez::event_loop::handler_t* event_handler(const epoll_event& _ev)
+{
+    return (_ev.data.u64 & 1) ? nullptr : static_cast<ez::event_loop::handler_t*>(_ev.data.ptr);
+}
+
+static inline int event_fd(const epoll_event& _ev)
+{
+    auto h = event_handler(_ev);
+    return h ? h->fd : static_cast<int>(_ev.data.u64 >> 1);
+}
+
 // ------------------------------------------------------------------------------------------
 
 namespace ez {
@@ -41,26 +114,61 @@ struct worker
 {
     int         stop_fd = -1;
     int         epoll_fd = -1;
-
-    std::atomic<bool> running {false};
-    std::atomic<bool> stopping {false};
+    int         wake_fd = -1;   // timers and tasks from other threads
+    loop_timers timers;
+    task_queue  tasks;
+    poll_meter  meter;
+    bool        drained = false; // no fds left while draining, worker thread only
 };
 
 struct event_loop::impl
 {
     on_event_t          m_event_fn;
     on_timeout_t        m_timeout_fn;
+    on_accept_t         m_accept_fn = nullptr;
     void*               m_param = nullptr;
-    worker*             m_worker = nullptr;
+    void*               m_accept_param = nullptr;
+    worker**            m_worker = nullptr;   // created by the worker threads
+    worker_load*        m_load = nullptr;
+    worker_load         m_main_fds;         // fds of the main epoll, for their handlers
     int                 m_epoll = -1;
     int                 m_stop_fd = -1;
-    unsigned            m_workers = 0;
+    int                 m_wake_fd = -1;
+    std::atomic<unsigned> m_workers {0};
+    std::vector<std::thread> m_threads;
+    loop_timers         m_timers;
+    task_queue          m_tasks;
+    std::atomic<unsigned> m_idle_ms {0};    // migration of idle fds, 0 - disabled
+    on_migrate_t        m_migrate_fn = nullptr;
+    void*               m_migrate_param = nullptr;
+    std::mutex          m_moving;           // held while an fd moves between workers
+    polling_t           m_polling;
+    cpu_sets_t          m_cpus;             // per worker, empty - not pinned
+    worker_startup      m_startup;
+    std::vector<std::pair<int, unsigned>> m_listeners; // fd, worker
+
+    std::atomic<bool>   m_draining {false};
+    std::atomic<unsigned> m_drained {0};    // workers without fds
+    std::atomic<uint64_t> m_drain_timer {0};
+    std::mutex          m_error_lock;
+    std::exception_ptr  m_error;            // first exception of a worker, rethrown by start()
 
     ~impl();
 
     void start_workers(unsigned int _workers, int _timeout);
+    void setup_worker(worker& _worker, unsigned _index);
+    void stop_workers();
+    void fail(std::exception_ptr _error);
+    void drain(unsigned _worker);
+    void check_drained(unsigned _worker);
     void process_events(int _kq, int _stopfd, unsigned _worker, int _timeout);
-    void process_fd(int _fd, uint32_t _flags, unsigned _worker);
+    void add_fd(int _fd, handler_t* _handler, unsigned _worker);
+    void process_fd(int _fd, uint32_t _flags, unsigned _worker, handler_t* _handler);
+    void migrate(unsigned _worker, int64_t _now);
+    bool move(int _fd, handler_t* _handler, unsigned _from, unsigned _to, int64_t _now);
+    void accept_all(int _fd, unsigned _worker);
+    uint64_t schedule(unsigned _ms, void* _param, on_timer_t _fn, unsigned _worker);
+    void post(void* _param, task_t _fn, unsigned _worker);
 };
 
 // ---------------------------------------------------------------------------------------------------------------------------------
@@ -74,6 +182,10 @@ void event_loop::init()
     m_impl->m_epoll = epoll_create1(EPOLL_CLOEXEC);
     if (m_impl->m_epoll == -1)
         throw std::runtime_error("epoll_create() error");
+
+    m_impl->m_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_impl->m_wake_fd == -1 || !epoll_add(m_impl->m_epoll, m_impl->m_wake_fd, EPOLLIN))
+        throw std::runtime_error("eventfd() main error");
 }
 
 event_loop::~event_loop()
@@ -85,6 +197,9 @@ event_loop::impl::~impl()
 {
     if (m_epoll != -1)
         close(m_epoll);
+
+    if (m_wake_fd != -1)
+        close(m_wake_fd);
 }
 
 unsigned event_loop::workers() const
@@ -101,6 +216,22 @@ void event_loop::stop()
     write(m_impl->m_stop_fd, &c, 8);
 }
 
+void event_loop::shutdown(unsigned _grace_ms)
+{
+    if (m_impl->m_stop_fd == -1 || m_impl->m_draining.exchange(true))
+        return;
+
+    for (unsigned i = 0; i < m_impl->m_workers; ++i)
+        m_impl->post(m_impl, [](void* _impl, unsigned _worker) { static_cast<impl*>(_impl)->drain(_worker); }, i);
+
+    m_impl->m_drain_timer = schedule(_grace_ms, this, [](void* _loop, uint64_t, unsigned) { static_cast<event_loop*>(_loop)->stop(); });
+}
+
+bool event_loop::draining() const
+{
+    return m_impl->m_draining.load(std::memory_order_relaxed);
+}
+
 void event_loop::add_fd(int _fd)
 {
     if(!epoll_add(m_impl->m_epoll, _fd))
@@ -109,10 +240,28 @@ void event_loop::add_fd(int _fd)
 
 void event_loop::add_fd(int _fd, unsigned _worker)
 {
-    if (_worker < m_impl->m_workers)
+    m_impl->add_fd(_fd, nullptr, _worker);
+}
+
+void event_loop::add_fd(handler_t* _handler)
+{
+    if(!epoll_add(m_impl->m_epoll, _handler->fd, 0, _handler))
+        throw std::runtime_error("can't add fd to epoll");
+
+    m_impl->m_main_fds.add(_handler->fd, 0, _handler);
+}
+
+void event_loop::add_fd(handler_t* _handler, unsigned _worker)
+{
+    m_impl->add_fd(_handler->fd, _handler, _worker);
+}
+
+void event_loop::impl::add_fd(int _fd, handler_t* _handler, unsigned _worker)
+{
+    if (_worker < m_workers)
     {
-        auto efd = m_impl->m_worker[_worker].epoll_fd;
-        if (!epoll_add(efd, _fd))
+        auto efd = m_worker[_worker]->epoll_fd;
+        if (!epoll_add(efd, _fd, 0, _handler))
         {
             std::string err = "can't add client: " + std::to_string(_fd) +
                               " to worker epoll: " + std::to_string(efd) +
@@ -120,11 +269,138 @@ void event_loop::add_fd(int _fd, unsigned _worker)
 
             throw std::runtime_error(err.c_str());
         }
+
+        m_load[_worker].add(_fd, worker_load::now(), _handler);
     }
     else
         throw std::runtime_error("wrong worker");
 }
 
+ssize_t event_loop::drain_fd(int _fd, buffer& _data, unsigned _worker, size_t _budget)
+{
+    bool more = false;
+    auto result = read_budget(_fd, _data, _budget, more);
+
+    if (more)
+    {
+        // the handler comes from the fd table, drain_fd may run outside the fd's own callback
+        bool main = _worker >= m_impl->m_workers;
+        auto handler = (main ? m_impl->m_main_fds : m_impl->m_load[_worker]).handler_of(_fd);
+        epoll_rearm(main ? m_impl->m_epoll : m_impl->m_worker[_worker]->epoll_fd, _fd, handler);
+        if (_fd == t_fd)
+            t_rearmed = true;
+    }
+
+    return result;
+}
+
+void event_loop::remove_fd(int _fd, unsigned _worker)
+{
+    if (_worker < m_impl->m_workers)
+    {
+        // the fd may have moved to another worker since the caller got _worker
+        auto owner = detach_fd(m_impl->m_load, m_impl->m_workers, m_impl->m_moving, _fd, _worker);
+        if (owner == m_impl->m_workers) // not counted anymore, closed or error event
+            owner = _worker;
+
+        epoll_ctl(m_impl->m_worker[owner]->epoll_fd, EPOLL_CTL_DEL, _fd, nullptr);
+
+        if (m_impl->m_draining.load(std::memory_order_relaxed)) // the worker checks if it was the last one
+            m_impl->post(m_impl, [](void* _impl, unsigned _w) { static_cast<impl*>(_impl)->check_drained(_w); }, owner);
+    }
+    else
+    {
+        epoll_ctl(m_impl->m_epoll, EPOLL_CTL_DEL, _fd, nullptr);
+        m_impl->m_main_fds.remove(_fd);
+    }
+}
+
+// ------------------------------------------------------------------------------------------
+
+unsigned event_loop::place_fd(int _fd, placement_e _policy)
+{
+    if (m_impl->m_workers == 0)
+        throw std::runtime_error("no workers to place fd");
+
+    auto w = pick_worker(m_impl->m_load, m_impl->m_workers, _policy);
+    add_fd(_fd, w);
+    return w;
+}
+
+unsigned event_loop::place_fd(handler_t* _handler, placement_e _policy)
+{
+    if (m_impl->m_workers == 0)
+        throw std::runtime_error("no workers to place fd");
+
+    auto w = pick_worker(m_impl->m_load, m_impl->m_workers, _policy);
+    add_fd(_handler, w);
+    return w;
+}
+
+event_loop::load_t event_loop::load(unsigned _worker) const
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->m_load[_worker].stats(worker_load::now());
+}
+
+void event_loop::set_migration(unsigned _idle_ms)
+{
+    m_impl->m_idle_ms = _idle_ms;
+}
+
+void event_loop::on_migrate(void* _param, on_migrate_t _fn)
+{
+    m_impl->m_migrate_param = _param;
+    m_impl->m_migrate_fn = _fn;
+}
+
+void event_loop::set_polling(const polling_t& _polling)
+{
+    if (m_impl->m_workers > 0)
+        throw std::runtime_error("polling is set before start()");
+
+    if (_polling.batch == 0)
+        throw std::runtime_error("polling batch can't be 0");
+
+    if (busy_poll_enabled(_polling)) // checked here, workers can't report it
+    {
+        int ep = epoll_create1(EPOLL_CLOEXEC);
+        bool ok = ep != -1 && epoll_set_busy_poll(ep, _polling);
+        int err = errno;
+
+        if (ep != -1)
+            close(ep);
+
+        if (!ok)
+            throw std::runtime_error("epoll busy poll is not supported, errno: " + std::to_string(err));
+    }
+
+    m_impl->m_polling = _polling;
+}
+
+void event_loop::set_affinity(const affinity_t& _affinity)
+{
+    if (m_impl->m_workers > 0)
+        throw std::runtime_error("affinity is set before start()");
+
+    auto cpus = _affinity.cpus;
+    if (cpus.empty() && !_affinity.irq_device.empty())
+        cpus = rx_queue_cpus(_affinity.irq_device);
+
+    check_cpus(cpus);
+    m_impl->m_cpus = cpus;
+}
+
+event_loop::poll_stats_t event_loop::poll_stats(unsigned _worker) const
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->m_worker[_worker]->meter.stats();
+}
+
 void event_loop::on_event(void* _param, on_event_t _ev)
 {
     m_impl->m_param = _param;
@@ -136,37 +412,256 @@ void event_loop::on_timeout(on_timeout_t _ev)
     m_impl->m_timeout_fn = _ev;
 }
 
+// ------------------------------------------------------------------------------------------
+
+uint64_t event_loop::impl::schedule(unsigned _ms, void* _param, on_timer_t _fn, unsigned _worker)
+{
+    auto& timers = _worker < m_workers ? m_worker[_worker]->timers : m_timers;
+    int wake_fd = _worker < m_workers ? m_worker[_worker]->wake_fd : m_wake_fd;
+
+    bool wake = false;
+    auto id = timers.schedule(_ms, _fn, _param, wake);
+
+    if (wake && wake_fd != -1)
+    {
+        uint64_t c = 1;
+        write(wake_fd, &c, 8);
+    }
+
+    return id;
+}
+
+uint64_t event_loop::schedule(unsigned _ms, void* _param, on_timer_t _fn)
+{
+    return m_impl->schedule(_ms, _param, _fn, -1);
+}
+
+uint64_t event_loop::schedule(unsigned _ms, void* _param, on_timer_t _fn, unsigned _worker)
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->schedule(_ms, _param, _fn, _worker);
+}
+
+void event_loop::impl::post(void* _param, task_t _fn, unsigned _worker)
+{
+    auto& tasks = _worker < m_workers ? m_worker[_worker]->tasks : m_tasks;
+    int wake_fd = _worker < m_workers ? m_worker[_worker]->wake_fd : m_wake_fd;
+
+    if (tasks.push(_param, _fn) && wake_fd != -1)
+    {
+        uint64_t c = 1;
+        write(wake_fd, &c, 8);
+    }
+}
+
+void event_loop::post(void* _param, task_t _fn)
+{
+    m_impl->post(_param, _fn, -1);
+}
+
+void event_loop::post(void* _param, task_t _fn, unsigned _worker)
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    m_impl->post(_param, _fn, _worker);
+}
+
+bool event_loop::cancel(uint64_t _id)
+{
+    return m_impl->m_timers.cancel(_id);
+}
+
+bool event_loop::cancel(uint64_t _id, unsigned _worker)
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->m_worker[_worker]->timers.cancel(_id);
+}
+
+// ------------------------------------------------------------------------------------------
+
+void event_loop::on_accept(void* _param, on_accept_t _fn)
+{
+    m_impl->m_accept_param = _param;
+    m_impl->m_accept_fn = _fn;
+}
+
+void event_loop::add_listener(int _fd, unsigned _worker)
+{
+    if (m_impl->m_workers > 0)
+        throw std::runtime_error("listeners are added before start()");
+
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK); // accepted until EAGAIN
+    m_impl->m_listeners.emplace_back(_fd, _worker);
+}
+
 
 // ------------------------------------------------------------------------------------------
 
 void event_loop::impl::start_workers(unsigned int _workers, int _timeout)
 {
-    m_workers = _workers;
-    m_worker = new worker[_workers];
+    for (auto& [fd, w]: m_listeners)
+        if (w >= _workers)
+            throw std::runtime_error("listener for wrong worker: " + std::to_string(w));
+
+    if (_workers == 0)
+        return;
+
+    m_worker = new worker*[_workers]();
+    m_load = new worker_load[_workers];
+    m_startup.reset();
 
     auto wrk = [this, _timeout](unsigned w)
     {
-        m_worker[w].running = true;
-        m_worker[w].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-        if (m_worker[w].epoll_fd == -1)
-            throw std::runtime_error("epoll_create() worker error");
-
-        m_worker[w].stop_fd = eventfd(0, EFD_CLOEXEC);
-        if (m_worker[w].stop_fd == -1)
-            throw std::runtime_error("eventfd() worker error");
-
-        std::string name = "worker " + std::to_string(w);
-        prctl(PR_SET_NAME, name.c_str(),0,0,0);
-
-        epoll_add(m_worker[w].epoll_fd, m_worker[w].stop_fd, EPOLLIN);
-        process_events(m_worker[w].epoll_fd, m_worker[w].stop_fd, w, _timeout); // blocks this thread
-        close(m_worker[w].epoll_fd);
-        close(m_worker[w].stop_fd);
-        m_worker[w].running = false;
+        std::string error;
+        if (!m_cpus.empty() && !pin_thread(m_cpus[w % m_cpus.size()]))
+            error = "can't pin worker " + std::to_string(w) + ", errno: " + std::to_string(errno);
+
+        auto& self = *(m_worker[w] = new worker); // after pinning, so it's first touched on its node
+
+        if (error.empty())
+        {
+            try
+            {
+                setup_worker(self, w);
+            }
+            catch (const std::exception& e)
+            {
+                error = e.what();
+            }
+        }
+
+        if (!m_startup.set_ready(error))
+            return;
+
+        try
+        {
+            process_events(self.epoll_fd, self.stop_fd, w, _timeout); // blocks this thread
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+        }
     };
 
     for (unsigned i = 0; i < _workers; ++i)
-        std::thread(wrk, i).detach(); // start worker
+        m_threads.emplace_back(wrk, i); // start worker
+
+    // everything is set up before start goes on, so fds and timers can be added right away
+
+    auto error = m_startup.wait(_workers);
+    if (error.empty())
+        m_workers = _workers; // workers see it after release
+
+    m_startup.release();
+
+    if (error.empty())
+        return;
+
+    stop_workers();
+    throw std::runtime_error(error);
+}
+
+// stops and joins workers, their fds and state go with them
+
+void event_loop::impl::stop_workers()
+{
+    for (unsigned i = 0; i < m_threads.size(); ++i)
+    {
+        uint64_t c = 1;
+        if (m_worker[i]->stop_fd != -1)
+            write(m_worker[i]->stop_fd, &c, 8);
+    }
+
+    for (auto& t: m_threads)
+        t.join();
+
+    for (unsigned i = 0; i < m_threads.size(); ++i)
+    {
+        for (int fd: {m_worker[i]->epoll_fd, m_worker[i]->stop_fd, m_worker[i]->wake_fd})
+            if (fd != -1)
+                close(fd);
+
+        delete m_worker[i];
+    }
+
+    m_threads.clear();
+    m_workers = 0;
+    delete [] m_worker;
+    delete [] m_load;
+    m_worker = nullptr;
+    m_load = nullptr;
+}
+
+// an exception in a worker stops the loop, start() rethrows it
+
+void event_loop::impl::fail(std::exception_ptr _error)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_error_lock);
+        if (!m_error)
+            m_error = _error;
+    }
+
+    uint64_t c = 1;
+    write(m_stop_fd, &c, 8);
+}
+
+// runs on the worker: no new connections, the loop stops when the last worker has no fds
+
+void event_loop::impl::drain(unsigned _worker)
+{
+    for (auto& [fd, w]: m_listeners)
+        if (w == _worker)
+            epoll_ctl(m_worker[_worker]->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+
+    check_drained(_worker);
+}
+
+void event_loop::impl::check_drained(unsigned _worker)
+{
+    auto& self = *m_worker[_worker];
+    if (self.drained || m_load[_worker].size() > 0)
+        return;
+
+    self.drained = true;
+    if (m_drained.fetch_add(1) + 1 == m_workers)
+    {
+        uint64_t c = 1;
+        write(m_stop_fd, &c, 8);
+    }
+}
+
+void event_loop::impl::setup_worker(worker& _worker, unsigned _index)
+{
+    _worker.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_worker.wake_fd == -1)
+        throw std::runtime_error("eventfd() worker error");
+
+    _worker.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (_worker.epoll_fd == -1)
+        throw std::runtime_error("epoll_create() worker error");
+
+    if (busy_poll_enabled(m_polling))
+        epoll_set_busy_poll(_worker.epoll_fd, m_polling);
+
+    _worker.stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (_worker.stop_fd == -1)
+        throw std::runtime_error("eventfd() worker error");
+
+    std::string name = "worker " + std::to_string(_index);
+    prctl(PR_SET_NAME, name.c_str(),0,0,0);
+
+    epoll_add(_worker.epoll_fd, _worker.stop_fd, EPOLLIN);
+    epoll_add(_worker.epoll_fd, _worker.wake_fd, EPOLLIN);
+
+    for (auto& [fd, lw]: m_listeners)
+        if (lw == _index && !epoll_add(_worker.epoll_fd, fd, EPOLLIN | EPOLLET))
+            throw std::runtime_error("can't add listener to worker epoll");
 }
 
 // ------------------------------------------------------------------------------------------
@@ -182,52 +677,102 @@ void event_loop::start(unsigned _workers, int _timeout)
 
     epoll_add(m_impl->m_epoll, m_impl->m_stop_fd, EPOLLIN);
 
-    m_impl->start_workers(_workers, 0);
-    m_impl->process_events(m_impl->m_epoll, m_impl->m_stop_fd, -1, _timeout);
+    m_impl->m_draining = false;
+    m_impl->m_drained = 0;
 
+    std::exception_ptr error;
+
+    try
+    {
+        m_impl->start_workers(_workers, 0);
+        m_impl->process_events(m_impl->m_epoll, m_impl->m_stop_fd, -1, _timeout);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+
+    m_impl->stop_workers(); // joined, nothing writes the stop fd after it
+    m_impl->m_timers.cancel(m_impl->m_drain_timer);
+    m_impl->m_drain_timer = 0;
+
+    epoll_ctl(m_impl->m_epoll, EPOLL_CTL_DEL, m_impl->m_stop_fd, nullptr);
     close(m_impl->m_stop_fd);
     m_impl->m_stop_fd = -1;
+    m_impl->m_draining = false;
 
-    if (m_impl->m_workers == 0)
-        return;
-
-    bool found = false;
-    while(!found) // wait until all workers stop
+    if (!error)
     {
-        for (unsigned i = 0; i < m_impl->m_workers; ++i)
-        {
-            if (m_impl->m_worker[i].running)
-            {
-                found = true;
-                if (!m_impl->m_worker[i].stopping)
-                {
-                    m_impl->m_worker[i].stopping = true;
-                    uint64_t c = 1;
-                    write(m_impl->m_worker[i].stop_fd, &c, 8);
-                }
-            }
-        }
-
-        std::this_thread::sleep_for(100ms);
+        std::lock_guard<std::mutex> lock(m_impl->m_error_lock);
+        std::swap(error, m_impl->m_error);
     }
 
-    m_impl->m_workers = 0;
-    delete [] m_impl->m_worker;
+    if (error)
+        std::rethrow_exception(error);
 }
 
 // ------------------------------------------------------------------------------------------
 
 void event_loop::impl::process_events(int _ep, int _stopfd, unsigned _worker, int _timeout)
 {
-    const int num_events = 100;
-    epoll_event events[num_events];
+    int num_events = static_cast<int>(m_polling.batch);
+    std::vector<epoll_event> storage(num_events);
+    auto events = storage.data();
+    auto load = _worker < m_workers ? &m_load[_worker] : nullptr;
+    auto meter = _worker < m_workers ? &m_worker[_worker]->meter : nullptr;
+    unsigned spin_us = meter ? m_polling.spin_us : 0;
+    auto& timers = _worker < m_workers ? m_worker[_worker]->timers : m_timers;
+    auto& tasks = _worker < m_workers ? m_worker[_worker]->tasks : m_tasks;
+    int wake_fd = _worker < m_workers ? m_worker[_worker]->wake_fd : m_wake_fd;
+    int64_t last_migration = 0;
+    bool more_tasks = false;
+
+    std::vector<int> listeners;
+    for (auto& [fd, w]: m_listeners)
+        if (w == _worker)
+            listeners.push_back(fd);
+
     for(;;)
     {
-        int result = 0;
-        if (_timeout > 0 )
-            result = epoll_wait(_ep, events, num_events, _timeout);
-        else
-            result = epoll_wait(_ep, events, num_events, -1);
+        // with migration enabled workers wake up to check for idle fds, and for the next timer
+
+        bool draining = load && m_draining.load(std::memory_order_relaxed);
+        unsigned idle_ms = load && !draining ? m_idle_ms.load(std::memory_order_relaxed) : 0;
+        int wait = _timeout > 0 ? _timeout : -1;
+        if (idle_ms > 0 && (wait == -1 || unsigned(wait) > idle_ms))
+            wait = static_cast<int>(idle_ms);
+
+        if (meter)
+            wait = meter->before(wait, spin_us);
+
+        wait = more_tasks ? 0 : timers.wait(wait);
+
+        int result = epoll_wait(_ep, events, num_events, wait);
+        timers.awake();
+
+        if (meter)
+            meter->after(wait, result);
+
+        if (load && result >= 0)
+        {
+            auto now = worker_load::now();
+            load->count(result, now);
+
+            if (idle_ms > 0)
+            {
+                load->lock.lock();
+                for (int i = 0; i < result; ++i)
+                    if (auto it = load->fds.find(event_fd(events[i])); it != load->fds.end())
+                        it->second.last = now;
+                load->lock.unlock();
+
+                if (now - last_migration >= idle_ms)
+                {
+                    last_migration = now;
+                    migrate(_worker, now);
+                }
+            }
+        }
 
         if (result < 0 && errno == EINTR)
             continue;
@@ -242,56 +787,217 @@ void event_loop::impl::process_events(int _ep, int _stopfd, unsigned _worker, in
         }
         else if (result == 0)
         {
-            if (m_timeout_fn)
+            if (m_timeout_fn && _timeout > 0 && wait == _timeout) // not a wake up for timers
                 m_timeout_fn(m_param, _worker);
-
-            continue;
         }
 
         for (int i = 0; i < result; ++i)
         {
-            auto fd = events[i].data.fd;
+            auto fd = event_fd(events[i]);
 
             if (fd > 0 && fd == _stopfd && events[i].events & EPOLLIN)
             {
                 uint64_t c = 0;
-                if (read(fd, &c, 8) == 8 && c == 1)
+                if (read(fd, &c, 8) == 8 && c > 0)
                     return;
             }
 
-            process_fd(fd, events[i].events, _worker);
+            if (fd == wake_fd)
+            {
+                uint64_t c = 0;
+                read(fd, &c, 8);
+                continue;
+            }
+
+            if (!listeners.empty() && std::find(listeners.begin(), listeners.end(), fd) != listeners.end())
+            {
+                accept_all(fd, _worker);
+                continue;
+            }
+
+            t_fd = fd;
+            process_fd(fd, events[i].events, _worker, event_handler(events[i]));
+            t_fd = -1;
         }
+
+        more_tasks = tasks.run(_worker);
+        timers.fire(_worker);
+
+        if (draining)
+            check_drained(_worker);
     }
 }
 
 // ------------------------------------------------------------------------------------------
 
-void event_loop::impl::process_fd(int _fd, uint32_t _flags, unsigned _worker)
+void event_loop::impl::process_fd(int _fd, uint32_t _flags, unsigned _worker, handler_t* _handler)
 {
-    if (!m_event_fn)
+    auto fn = _handler ? _handler->fn : m_event_fn;
+    auto param = _handler ? _handler->param : m_param;
+
+    if (!fn)
         return;
 
     if (_flags & EPOLLRDHUP)
     {
-        m_event_fn(m_param, _fd, event_e::closed, _worker);
+        // data sent before the shutdown is read first; when drain_fd ran out of budget the rearmed
+        // fd comes again with EPOLLRDHUP, closed follows its last read
+
+        if (_flags & EPOLLIN)
+        {
+            t_rearmed = false;
+            fn(param, _fd, event_e::read, _worker);
+            if (t_rearmed)
+                return;
+        }
+
+        if (_worker < m_workers)
+            m_load[_worker].remove(_fd);
+
+        fn(param, _fd, event_e::closed, _worker);
         return;
     }
 
     if ((_flags & EPOLLERR) || (_flags & EPOLLHUP))
     {
-        m_event_fn(m_param, _fd, event_e::error, _worker);
+        if (_worker < m_workers)
+            m_load[_worker].remove(_fd);
+
+        fn(param, _fd, event_e::error, _worker);
         return;
     }
 
     if (_flags & EPOLLIN)
-        m_event_fn(m_param, _fd, event_e::read, _worker);
+        fn(param, _fd, event_e::read, _worker);
 
     if (_flags & EPOLLOUT)
-        m_event_fn(m_param, _fd, event_e::write, _worker);
+        fn(param, _fd, event_e::write, _worker);
+}
+
+// ------------------------------------------------------------------------------------------
+// edge triggered listener, accept until the backlog is empty
+
+void event_loop::impl::accept_all(int _fd, unsigned _worker)
+{
+    for (;;)
+    {
+        int fd = accept4(_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return; // EAGAIN, or out of fds until some are closed
+        }
+
+        handler_t* handler = nullptr;
+        if (m_accept_fn && !m_accept_fn(m_accept_param, _fd, fd, _worker, &handler))
+        {
+            close(fd);
+            continue;
+        }
+
+        if (epoll_add(m_worker[_worker]->epoll_fd, fd, 0, handler))
+            m_load[_worker].add(fd, worker_load::now(), handler);
+        else
+            close(fd);
+    }
+}
+
+// ------------------------------------------------------------------------------------------
+// runs on the worker thread between batches, so moved fds have no events pending here
+
+void event_loop::impl::migrate(unsigned _worker, int64_t _now)
+{
+    auto target = least_loaded(m_load, m_workers, _now);
+    if (target == _worker)
+        return;
+
+    auto count = migration_count(m_load[_worker], m_load[target], _now);
+    if (count == 0)
+        return;
+
+    for (auto [fd, handler]: m_load[_worker].idle(_now - m_idle_ms, count))
+    {
+        if (m_migrate_fn && !m_migrate_fn(m_migrate_param, fd, handler, _worker, target))
+            continue;
+
+        if (!move(fd, handler, _worker, target, _now) && m_migrate_fn)
+            m_migrate_fn(m_migrate_param, fd, handler, target, _worker);
+    }
 }
 
+// remove_fd from another thread waits for the move and finds the fd on _to; false when the fd
+// stays on _from, re-added after a failed move
+
+bool event_loop::impl::move(int _fd, handler_t* _handler, unsigned _from, unsigned _to, int64_t _now)
+{
+    std::lock_guard<std::mutex> lock(m_moving);
+
+    if (!m_load[_from].remove(_fd))
+        return true; // removed meanwhile
+
+    if (epoll_ctl(m_worker[_from]->epoll_fd, EPOLL_CTL_DEL, _fd, nullptr) != 0)
+        return true; // closed without remove_fd
 
+    if (epoll_add(m_worker[_to]->epoll_fd, _fd, 0, _handler))
+    {
+        m_load[_to].add(_fd, _now, _handler);
+        m_load[_from].migrated.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (epoll_add(m_worker[_from]->epoll_fd, _fd, 0, _handler))
+        m_load[_from].add(_fd, _now, _handler);
+
+    return false;
 }
 
+// ------------------------------------------------------------------------------------------
+// completion based i/o needs io_uring backend
 
+[[noreturn]] static void completions_not_supported()
+{
+    throw std::runtime_error("epoll backend doesn't support completions");
+}
 
+bool event_loop::completions_supported()
+{
+    return false;
+}
+
+void event_loop::on_complete(void*, on_complete_t)
+{
+    completions_not_supported();
+}
+
+void event_loop::accept(int)
+{
+    completions_not_supported();
+}
+
+void event_loop::accept(int, unsigned)
+{
+    completions_not_supported();
+}
+
+void event_loop::recv(int)
+{
+    completions_not_supported();
+}
+
+void event_loop::recv(int, unsigned)
+{
+    completions_not_supported();
+}
+
+void event_loop::send(int, const buffer&)
+{
+    completions_not_supported();
+}
+
+void event_loop::send(int, const buffer&, unsigned)
+{
+    completions_not_supported();
+}
+
+}
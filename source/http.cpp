@@ -1,5 +1,7 @@
 
 #include <ez/http.hpp>
+#include <ez/connection_pool.hpp>
+#include "send_queue.hpp"
 
 #include <string.h>
 #include "picohttpparser.c"
@@ -7,12 +9,45 @@
 #include <charconv>
 #include <functional>
 #include <algorithm>
+#include <cstddef>
+#include <vector>
 
 namespace ez {
 
+static_assert(sizeof(phr_header) == sizeof(http::headers_view::field_t) &&
+              offsetof(phr_header, name_len) == offsetof(http::headers_view::field_t, name_len) &&
+              offsetof(phr_header, value) == offsetof(http::headers_view::field_t, value) &&
+              offsetof(phr_header, value_len) == offsetof(http::headers_view::field_t, value_len),
+              "headers_view::field_t must match phr_header");
+
+// header array grows by doubling up to max_headers, 16 entries (512 bytes) cover most heads
+
+static constexpr size_t initial_headers = 16;
+
+// ascii only, header names are tokens so locale is irrelevant
+
+static bool isequal(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        unsigned char x = a[i], y = b[i];
+        if (x == y)
+            continue;
+
+        x |= 0x20;
+        if (x != (y | 0x20) || x < 'a' || x > 'z')
+            return false;
+    }
+
+    return true;
+}
+
 struct http::impl
 {
-    phr_header m_pheaders[30];
+    std::vector<phr_header> m_pheaders;
     phr_chunked_decoder m_chunked_decoder{};
     size_t m_num_headers = 0;
     char *m_method_ptr = nullptr, *m_path_ptr = nullptr, *m_message_ptr = nullptr;
@@ -20,43 +55,62 @@ struct http::impl
 
     state_e             m_state = state_e::waiting_header;
     http::headers_t     m_headers;
-    unsigned            m_recv_buffer_size = 8192;
-    unsigned            m_max_request_body_size = 10*1024*1024;
+    limits_t            m_limits;
+    unsigned            m_min_staging_size = 4096;
     int                 m_status = 0;
-    unsigned            m_body_size = 0;
-    unsigned            m_header_size = 0;
-    unsigned            m_chunk_size = 0;
+    size_t              m_data_size = 0;        // bytes received into m_buffer
+    size_t              m_header_size = 0;
+    size_t              m_body_size = 0;
+    size_t              m_body_received = 0;
+    size_t              m_staged_size = 0;      // undecoded chunked bytes after the head
+    size_t              m_leftover_pos = 0;     // bytes of the next pipelined message
+    size_t              m_leftover_size = 0;
+    unsigned            m_deferred = 0;         // responses queued while next request is ready, none sent yet
+    static constexpr unsigned m_max_deferred = 16;
+    int                 m_minor_version = 1;
+    bool                m_keep_alive = true;
     std::string         m_method;
     std::string         m_path;
     std::string         m_message;
-    bool                m_new_body_buffer = false;
     bool                m_chunked = false;
+    bool                m_length_given = false; // Content-Length
+    bool                m_until_close = false;  // response without a length, the body ends with the connection
+    bool                m_head_request = false; // the response to it has no body
+    bool                m_build_headers = true;
+    body_handler_t      m_body_handler;
 
     std::reference_wrapper<channel> m_channel;
     
     buffer          m_buffer;
     buffer          m_body;
     buffer          m_send_buffer;
+    send_queue      m_send_queue;       // header and body slices, sent with one gather write
 
     impl(channel& _ch);
 
     void reset();
+    void next_message();
+    bool next_request_ready() const;
     void send_more();
+    void flush();
     void send_request(std::string_view _method, std::string_view _path, const headers_t& _hdrs, buffer _body);
     void send_response(unsigned _code, std::string_view _message, const headers_t& _hdrs, buffer _body);
-    
-    bool isequal(const std::string& a, const std::string& b)
-    {
-        return std::equal(a.begin(), a.end(),
-                          b.begin(), b.end(),
-                          [](char a, char b) {
-                              return std::tolower(a) == std::tolower(b);
-                          });
-    }
-  
-    request_t recv();
+    void send_response(unsigned _code, std::string_view _message, const headers_t& _hdrs, const file_t& _body);
+    void send_or_defer();
+    void make_response_head(unsigned _code, std::string_view _message, const headers_t& _hdrs, size_t _body_size);
+
     response_t recv_response();
+    response_t response() const;
     request_t recv_request();
+    bool recv_message(bool _request);
+    bool recv_head(bool _request);
+    void parse_headers();
+    void start_body();
+    void rebase(const uint8_t* _old);
+    bool recv_body();
+    bool recv_chunked();
+    bool recv_until_close();
+    void append_body(const uint8_t* _data, size_t _size);
 };
 
 // -----------------------------------------------------------------------------------------------------------
@@ -72,10 +126,27 @@ http::~http()
 
 http::impl::impl(channel& _ch) : m_channel(_ch)
 {
-    m_buffer = buffer(m_recv_buffer_size);
+    m_pheaders.resize(std::min(initial_headers, m_limits.max_headers));
+    m_buffer = buffer(m_limits.initial_buffer_size, buffer::uninitialized);
     reset();
 }
 
+void http::set_limits(const limits_t& _limits)
+{
+    if (_limits.initial_buffer_size == 0 || _limits.max_head_size < _limits.initial_buffer_size)
+        throw error("http: invalid limits");
+
+    m_impl->m_limits = _limits;
+
+    if (m_impl->m_state == state_e::waiting_header && m_impl->m_data_size == 0)
+        m_impl->m_buffer = buffer(_limits.initial_buffer_size, buffer::uninitialized);
+}
+
+const http::limits_t& http::limits() const
+{
+    return m_impl->m_limits;
+}
+
 void http::set_channel(channel& _ch)
 {
     m_impl->m_channel = _ch;
@@ -92,14 +163,17 @@ void http::send_more()
 void http::impl::send_more()
 {
     if (m_state == state_e::sending_body)
+        flush();
+}
+
+void http::impl::flush()
+{
+    m_deferred = 0; // once sending started, the rest of the queue must go out before the next recv
+
+    if (m_send_queue.flush(m_channel.get()))
     {
-        if (auto sz = m_channel.get().send(m_send_buffer); sz == m_send_buffer.size())
-        {
-            m_state = state_e::send_complete;
-            m_send_buffer = buffer();
-        }
-        else if (sz > 0)
-            m_send_buffer.set_position(m_send_buffer.position() + sz);
+        m_state = state_e::send_complete;
+        m_send_buffer = buffer();
     }
 }
 
@@ -113,46 +187,123 @@ void http::send_request(const http::request_t& _request)
 
 // -----------------------------------------------------------------------------------------------------------
 
+static bool idempotent(std::string_view _method)
+{
+    for (auto m: {"GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE"})
+        if (_method == m)
+            return true;
+
+    return false;
+}
+
+http::response_t http::request(connection_pool& _pool, std::string_view _host, uint16_t _port, bool _tls, const request_t& _request)
+{
+    const auto& [method, path, headers, body] = _request;
+
+    headers_t with_host;
+    bool has_host = std::any_of(headers.begin(), headers.end(), [](const auto& _h) { return isequal(_h.first, "Host"); });
+    if (!has_host)
+    {
+        with_host = headers;
+        with_host.emplace("Host", (_port == (_tls ? 443 : 80)) ? std::string(_host) : std::string(_host) + ":" + std::to_string(_port));
+    }
+
+    for (bool fresh = false; ; fresh = true)
+    {
+        auto lease = _pool.borrow(_host, _port, _tls, fresh);
+        auto& client = lease->http();
+        bool retry = lease->reused() && idempotent(method);
+
+        auto& _impl = *client.m_impl;
+
+        response_t response;
+        try
+        {
+            client.reset();
+            _impl.send_request(method, path, has_host ? headers : with_host, body);
+            response = client.recv_response();
+
+            // interim responses (100 Continue) come before the final one
+            for (unsigned status = std::get<0>(response); status >= 100 && status < 200 && status != 101; status = std::get<0>(response))
+            {
+                _impl.next_message();
+                response = client.recv_response();
+            }
+        }
+        catch (const std::exception&)
+        {
+            // a blocking socket throws at the end of a body that ends with the connection, closed
+            // by the server rather than reset (socket::recv closes it then)
+            if (_impl.m_until_close && _impl.m_state == state_e::waiting_body && !lease->socket().is(socket::state::connected))
+            {
+                _impl.m_keep_alive = false;
+                return _impl.response();
+            }
+
+            if (retry)
+                continue;
+            throw;
+        }
+
+        auto status = std::get<0>(response);
+        if (status == 0) // closed before a response
+        {
+            if (retry)
+                continue;
+            throw error("http: connection closed by server");
+        }
+
+        // a body that ends with the connection has it closed by now
+        if (client.keep_alive() && !_impl.m_until_close && status != 101)
+        {
+            // the body shares the receive buffer of the connection, the next borrower reuses it
+            auto& received = std::get<3>(response);
+            received = received.size() > 0 ? buffer(received.ptr(), received.size()) : buffer();
+            lease.release();
+        }
+
+        return response;
+    }
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
 void http::impl::send_request(std::string_view _method, std::string_view _path, const headers_t& _hdrs, buffer _body)
 {
     m_state = state_e::sending_body;
-    std::string req(_method.data(), _method.size());
-    req += " ";
-    req += _path;
-    req += " HTTP/1.1";
-    req += "\r\n";
+    m_head_request = _method == "HEAD";
+
+    m_send_buffer = buffer(256, buffer::uninitialized);
+    m_send_buffer.set_size(0);
+    m_send_buffer.append(_method);
+    m_send_buffer.append(" ");
+    m_send_buffer.append(_path);
+    m_send_buffer.append(" HTTP/1.1\r\n");
 
     for (const auto& [key, value]: _hdrs)
     {
         if (value.empty())
             continue;
         
-        req += key;
-        req += ": ";
-        req += value;
-        req += "\r\n";
+        m_send_buffer.append(key);
+        m_send_buffer.append(": ");
+        m_send_buffer.append(value);
+        m_send_buffer.append("\r\n");
     }
     
     if (_body.size() > 0 && !_hdrs.count("Content-Length"))
     {
-        req += "Content-Length: " + std::to_string(_body.size());
-        req += "\r\n";
+        m_send_buffer.append("Content-Length: " + std::to_string(_body.size()));
+        m_send_buffer.append("\r\n");
     }
 
-    req += "\r\n";
-    
-    m_send_buffer = buffer(req.size() + _body.size());
+    m_send_buffer.append("\r\n");
 
-    memcpy(m_send_buffer.ptr(), req.c_str(), req.size());
-    memcpy(m_send_buffer.ptr() + req.size(), _body.ptr(), _body.size());
+    m_send_queue.clear();
+    m_send_queue.push(m_send_buffer);
+    m_send_queue.push(_body);
 
-    if (auto sz = m_channel.get().send(m_send_buffer); sz == m_send_buffer.size())
-    {
-        m_state = state_e::send_complete;
-        m_send_buffer = buffer();
-    }
-    else if (sz > 0)
-        m_send_buffer.set_position(m_send_buffer.position() + sz);
+    flush();
 }
 
 // -----------------------------------------------------------------------------------------------------------
@@ -167,18 +318,140 @@ void http::reset()
     m_impl->reset();
 }
 
+// queued responses are owed to the peer, they are flushed before the connection state is dropped
+
 void http::http::impl::reset()
+{
+    if (!m_send_queue.empty())
+    {
+        flush();
+        if (!m_send_queue.empty())
+            throw error("http: can't reset while sending data");
+    }
+
+    m_leftover_size = 0;
+    next_message();
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// keeps pipelined bytes that came after the previous message and responses not flushed yet
+
+void http::impl::next_message()
 {
     m_state = state_e::waiting_header;
+    m_data_size = 0;
+    m_header_size = 0;
     m_body_size = 0;
+    m_body_received = 0;
+    m_staged_size = 0;
     m_buffer.set_position(0);
-    m_buffer.set_size(m_recv_buffer_size);
     m_body = buffer();
     m_send_buffer = buffer();
     m_headers.clear();
-    m_new_body_buffer = false;
+    m_num_headers = 0;
     m_chunked = false;
+    m_length_given = false;
+    m_until_close = false;
+    m_keep_alive = true;
     memset(&m_chunked_decoder, 0, sizeof(m_chunked_decoder));
+    m_chunked_decoder.consume_trailer = 1;
+
+    // drop the buffer and header array grown by a big head or staging area, so idle connections stay small
+
+    if (m_pheaders.size() > initial_headers)
+        std::vector<phr_header>(initial_headers).swap(m_pheaders);
+
+    if (m_buffer.capacity() > m_limits.initial_buffer_size && m_leftover_size <= m_limits.initial_buffer_size)
+    {
+        buffer fresh(m_limits.initial_buffer_size, buffer::uninitialized);
+        memcpy(fresh.ptr(), m_buffer.ptr() + m_leftover_pos, m_leftover_size);
+        m_buffer = fresh;
+    }
+    else
+    {
+        m_buffer.set_size(m_buffer.capacity());
+        memmove(m_buffer.ptr(), m_buffer.ptr() + m_leftover_pos, m_leftover_size);
+    }
+
+    m_data_size = m_leftover_size;
+    m_leftover_size = 0;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+void http::on_body(body_handler_t _handler)
+{
+    m_impl->m_body_handler = std::move(_handler);
+}
+
+const http::headers_t& http::headers() const
+{
+    return m_impl->m_headers;
+}
+
+http::headers_view http::headers_ref() const
+{
+    return headers_view(reinterpret_cast<const headers_view::field_t*>(m_impl->m_pheaders.data()), m_impl->m_num_headers);
+}
+
+size_t http::content_length() const
+{
+    return m_impl->m_body_size;
+}
+
+bool http::chunked() const
+{
+    return m_impl->m_chunked;
+}
+
+void http::build_headers(bool _flag)
+{
+    m_impl->m_build_headers = _flag;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+std::string_view http::headers_view::find(std::string_view _name) const
+{
+    for (auto& field: *this)
+        if (isequal(field.key(), _name))
+            return field.val();
+
+    return std::string_view();
+}
+
+bool http::headers_view::contains(std::string_view _name) const
+{
+    for (auto& field: *this)
+        if (isequal(field.key(), _name))
+            return true;
+
+    return false;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+const std::string& http::method() const
+{
+    return m_impl->m_method;
+}
+
+const std::string& http::path() const
+{
+    return m_impl->m_path;
+}
+
+bool http::keep_alive() const
+{
+    return m_impl->m_keep_alive;
+}
+
+// also after the queue is flushed because too many responses were deferred
+
+bool http::request_buffered() const
+{
+    auto state = m_impl->m_state;
+    return (state == state_e::send_complete || m_impl->m_deferred > 0) && m_impl->next_request_ready();
 }
 
 // -----------------------------------------------------------------------------------------------------------
@@ -189,369 +462,384 @@ http::request_t http::recv_request()
     return m_impl->recv_request();
 }
 
-http::http::request_t http::http::impl::recv_request()
+http::request_t http::impl::recv_request()
+{
+    if (!recv_message(true))
+        return http::request_t();
+
+    return std::make_tuple(m_method, m_path, m_headers, m_body);
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+http::response_t http::recv_response()
+{
+    return m_impl->recv_response();
+}
+
+http::response_t http::impl::recv_response()
+{
+    if (!recv_message(false))
+        return http::response_t();
+
+    return response();
+}
+
+http::response_t http::impl::response() const
+{
+    return std::make_tuple(static_cast<unsigned>(m_status), m_message, m_headers, m_body);
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// returns true when the whole message is received (or streamed to body handler)
+
+bool http::impl::recv_message(bool _request)
 {
     switch (m_state)
     {
         case state_e::sending_body:
-            throw error("http: can't recv while sending data");
+            if (m_deferred == 0)
+                throw error("http: can't recv while sending data");
+            [[fallthrough]]; // responses are only queued, the next request is already buffered
 
         case state_e::send_complete:
-            reset();
+            next_message();
             [[fallthrough]];
 
         case state_e::waiting_header:
         {
-            size_t data_size = 0;
-            for (;;) // recv data portion (size unknown, so we loop until necessary amount received)
-            {
-                if (auto block_size = m_channel.get().recv(m_buffer); block_size > 0)
-                {
-                    int minor_version = 0;
-                    m_buffer.set_position(0);
-                    m_num_headers = sizeof(m_pheaders) / sizeof(phr_header);
-                    int ret = phr_parse_request((const char*) m_buffer.ptr(), data_size + block_size,
-                                                (const char**) &m_method_ptr, &m_method_len,
-                                                (const char**) &m_path_ptr, &m_path_len, &minor_version,
-                                                m_pheaders, &m_num_headers, data_size);
-                    data_size += block_size;
-                    if (ret > 0) // all headers parsed
-                    {
-                        m_header_size = static_cast<unsigned>(ret);
-                        m_method = std::string_view(m_method_ptr, m_method_len);
-                        m_path = std::string_view(m_path_ptr, m_path_len);
-                        m_buffer.set_position(m_header_size);
-                        
-                        for (unsigned i = 0; i < m_num_headers; ++i)
-                        {
-                            auto field = std::string(m_pheaders[i].name, m_pheaders[i].name_len);
-                            auto value = std::string(m_pheaders[i].value, m_pheaders[i].value_len);
-
-                            m_headers.insert({field, value});
-
-                            if (isequal(field,"Content-Length"))
-                            {
-                                unsigned size = 0;
-                                if (auto [p, ec] = std::from_chars(value.data(), value.data() + value.size(), size); ec == std::errc())
-                                    m_body_size = size;
-                                else
-                                    throw error("http: can't parse 'Content-Length' value");
-                            }
-                            else if (isequal(field,"Transfer-Encoding"))
-                            {
-                                if (value == "chunked")
-                                {
-                                    m_chunked = true;
-                                    m_body_size = m_max_request_body_size;
-                                }
-                            }
-                        }
-
-                        if (m_body_size > 0) // must have body
-                        {
-                            if (m_body_size <= data_size - m_header_size) // body already received
-                            {
-                                m_buffer.set_size(m_header_size+m_body_size); // shrink buffer
-                                return std::make_tuple(m_method, m_path, m_headers, m_buffer);
-                            }
-                            
-                            if (m_body_size <= m_max_request_body_size)
-                            {
-                                m_state = state_e::waiting_body;
-
-                                if (m_buffer.size() < m_body_size) // alloc new if size is not enough
-                                {
-                                    m_new_body_buffer = true;
-                                    m_body = buffer(m_body_size);
-                                    auto tail_size = data_size - m_buffer.position();
-                                    if (tail_size > 0)
-                                    {
-                                        memcpy(m_body.ptr(), m_buffer.ptr(), tail_size);
-                                        if (m_chunked)
-                                        {
-                                            m_body.set_position(0);
-                                            m_body.set_size(tail_size);
-                                        }
-                                        else
-                                            m_body.set_position(tail_size);
-                                    }
-                                }
-                                else
-                                    m_buffer.set_position(data_size);
-
-                                break; // exit loop
-                            }
-                            else
-                                throw error("http: body is bigger than allowed");
-                        }
-                        else
-                            return std::make_tuple(m_method, m_path, m_headers, buffer());
-                    }
-                    else if (ret == -1)
-                        throw error("http: error parsing http headers");
-
-                    if (data_size == m_buffer.size())
-                        throw error("http: request is too big");
-                    
-                    m_buffer.set_position(data_size);
-                }
-                else // would block
-                    return http::http::request_t();
-
-            } //loop
+            if (!recv_head(_request))
+                return false;
+
+            m_state = state_e::waiting_body;
 
         } [[fallthrough]];
 
         case state_e::waiting_body:
+            return m_chunked ? recv_chunked() : m_until_close ? recv_until_close() : recv_body();
+
+        default:
+            throw error("invalid state");
+    }
+}
+
+// -----------------------------------------------------------------------------------------------------------
+
+bool http::impl::recv_head(bool _request)
+{
+    bool buffered = m_data_size > 0; // pipelined or partially received head, parse it first
+
+    for (;;) // recv data portion (size unknown, so we loop until necessary amount received)
+    {
+        size_t last_size = 0;
+
+        if (!buffered)
         {
-            for (;;)
+            if (m_data_size == m_buffer.size()) // grow in steps up to the limit
             {
-                if (m_chunked)
-                {
-                    size_t size = m_body.size();
-                    auto ret = phr_decode_chunked(&m_chunked_decoder, (char*) m_body.ptr(), &size);
-                    if (ret == -2)
-                    {
-                        m_body.set_size(m_max_request_body_size);
-                        m_body.set_position(m_body.position()+size);
-                        
-                        if (auto sz = m_channel.get().recv(m_body); sz > 0)
-                        {
-                            m_body.set_size(m_body.position()+sz);
-                        }
-                        else // would block
-                        {
-                            m_body.set_size(m_body.position());
-                            return http::http::request_t();
-                        }
-                    }
-                    else if (ret > 0)
-                    {
-                        m_body.set_size(m_body.position()+size);
-                        m_body.set_position(0);
-                        return std::make_tuple(m_method, m_path, m_headers, m_body);
-                    }
-                    else if (ret == -1)
-                        throw error("http: unable to parse chunked content");
-                }
-                else if (m_new_body_buffer)
-                {
-                    auto need = m_body_size - m_body.position();
-                    if (auto sz = m_channel.get().recv(m_body); sz == need)
-                    {
-                        m_body.set_position(0);
-                        return std::make_tuple(m_method, m_path, m_headers, m_body);
-                    }
-                    else if (sz > 0)
-                        m_body.set_position(m_body.position()+sz);
-                    else // would block
-                        return http::http::request_t();
-                }
-                else
-                {
-                    auto need = m_body_size + m_header_size - m_buffer.position();
-                    if (auto sz = m_channel.get().recv(m_buffer); sz == need)
-                    {
-                        m_buffer.set_position(m_header_size);
-                        m_buffer.set_size(m_header_size+m_body_size); // shrink buffer
-                        return std::make_tuple(m_method, m_path, m_headers, m_buffer);
-                    }
-                    else if (sz > 0)
-                        m_body.set_position(m_body.position()+sz);
-                    else // would block
-                        return http::http::request_t();
-                }
+                m_buffer.reserve(std::min(m_data_size * 2, m_limits.max_head_size));
+                m_buffer.set_size(m_buffer.capacity());
             }
+
+            auto block_size = m_channel.get().recv(m_buffer.ptr() + m_data_size, m_buffer.size() - m_data_size);
+            if (block_size <= 0) // would block
+                return false;
+
+            last_size = m_data_size;
+            m_data_size += block_size;
         }
-            
-        default:
-            throw error("invalid state");
+
+        buffered = false;
+
+        int minor_version = 0;
+        int ret = 0;
+        if (m_pheaders.size() > m_limits.max_headers) // limits lowered
+            m_pheaders.resize(m_limits.max_headers);
+        m_num_headers = m_pheaders.size(); // head is parsed from the start each time
+
+        if (_request)
+            ret = phr_parse_request((const char*) m_buffer.ptr(), m_data_size,
+                                    (const char**) &m_method_ptr, &m_method_len,
+                                    (const char**) &m_path_ptr, &m_path_len, &minor_version,
+                                    m_pheaders.data(), &m_num_headers, last_size);
+        else
+            ret = phr_parse_response((const char*) m_buffer.ptr(), m_data_size, &minor_version,
+                                     &m_status, (const char **) &m_message_ptr, &m_message_len,
+                                     m_pheaders.data(), &m_num_headers, last_size);
+
+        if (ret == -1 && m_num_headers == m_pheaders.size() && m_pheaders.size() < m_limits.max_headers)
+        {
+            m_pheaders.resize(std::min(m_pheaders.size() * 2, m_limits.max_headers));
+            buffered = true; // parse again with room for more headers
+            continue;
+        }
+
+        if (ret == -1)
+            throw error(m_num_headers == m_pheaders.size() ? "http: too many headers" : "http: error parsing http headers");
+        else if (ret == -2) // incomplete
+        {
+            if (m_data_size >= m_limits.max_head_size)
+                throw error("http: request is too big");
+            continue;
+        }
+
+        m_header_size = static_cast<size_t>(ret);
+        m_minor_version = minor_version;
+
+        if (_request)
+        {
+            m_method = std::string_view(m_method_ptr, m_method_len);
+            m_path = std::string_view(m_path_ptr, m_path_len);
+        }
+        else
+            m_message = std::string_view(m_message_ptr, m_message_len);
+
+        parse_headers();
+
+        // responses to HEAD, 1xx, 204 and 304 have no body whatever the headers say, other
+        // responses without a length end with the connection (rfc 9112 6.3); requests without
+        // one have no body
+
+        if (!_request)
+        {
+            if (m_head_request || (m_status >= 100 && m_status < 200) || m_status == 204 || m_status == 304)
+            {
+                m_body_size = 0;
+                m_chunked = false;
+            }
+            else if (!m_chunked && !m_length_given)
+                m_until_close = true;
+        }
+
+        start_body();
+        return true;
     }
 }
 
+void http::impl::parse_headers()
+{
+    m_keep_alive = m_minor_version >= 1;
+
+    for (unsigned i = 0; i < m_num_headers; ++i)
+    {
+        auto field = std::string_view(m_pheaders[i].name, m_pheaders[i].name_len);
+        auto value = std::string_view(m_pheaders[i].value, m_pheaders[i].value_len);
+
+        if (m_build_headers)
+            m_headers.emplace(field, value);
+
+        if (isequal(field, "Content-Length"))
+        {
+            size_t size = 0;
+            if (auto [p, ec] = std::from_chars(value.data(), value.data() + value.size(), size); ec == std::errc())
+            {
+                m_body_size = size;
+                m_length_given = true;
+            }
+            else
+                throw error("http: can't parse 'Content-Length' value");
+        }
+        else if (isequal(field, "Transfer-Encoding"))
+        {
+            if (isequal(value, "chunked"))
+                m_chunked = true;
+        }
+        else if (isequal(field, "Connection"))
+        {
+            if (isequal(value, "close"))
+                m_keep_alive = false;
+            else if (isequal(value, "keep-alive"))
+                m_keep_alive = true;
+        }
+    }
+
+    if (!m_chunked && !m_body_handler && m_body_size > m_limits.max_body_size)
+        throw error("http: body is bigger than allowed");
+}
+
 // -----------------------------------------------------------------------------------------------------------
+// bytes after the head are left in m_buffer, they are the first body portion
 
-http::response_t http::recv_response()
+void http::impl::start_body()
 {
-    return m_impl->recv_response();
+    auto tail = m_data_size - m_header_size;
+
+    m_body = buffer();
+    m_body_received = 0;
+
+    if (m_body_handler || m_chunked || m_until_close)
+    {
+        // the rest of m_buffer is used as staging area for incoming portions
+
+        if (m_buffer.size() - m_header_size < m_min_staging_size)
+        {
+            auto old = m_buffer.ptr();
+            m_buffer.reserve(m_header_size + m_min_staging_size);
+            m_buffer.set_size(m_buffer.capacity());
+            rebase(old);
+        }
+
+        m_staged_size = m_chunked ? tail : 0;
+
+        if (m_until_close && tail > 0)
+        {
+            append_body(m_buffer.ptr() + m_header_size, tail);
+        }
+        else if (!m_chunked && tail > 0 && m_body_size > 0)
+        {
+            m_body_received = std::min(tail, m_body_size);
+            m_body_handler(m_buffer.ptr() + m_header_size, m_body_received);
+        }
+    }
+    else if (m_header_size + m_body_size <= m_buffer.size())
+    {
+        m_body_received = std::min(tail, m_body_size);
+    }
+    else // body doesn't fit, alloc new
+    {
+        m_body_received = std::min(tail, m_body_size);
+        m_body = buffer(m_body_size, buffer::uninitialized);
+        memcpy(m_body.ptr(), m_buffer.ptr() + m_header_size, m_body_received);
+    }
 }
 
-http::response_t http::impl::recv_response()
+// head spans point into m_buffer, move them along when it's reallocated
+
+void http::impl::rebase(const uint8_t* _old)
 {
-    switch (m_state)
+    auto base = reinterpret_cast<const char*>(m_buffer.ptr());
+    auto old = reinterpret_cast<const char*>(_old);
+
+    if (base == old)
+        return;
+
+    for (size_t i = 0; i < m_num_headers; ++i)
     {
-        case state_e::sending_body:
-            throw error("http: can't recv while sending data");
+        if (m_pheaders[i].name)
+            m_pheaders[i].name = base + (m_pheaders[i].name - old);
+        if (m_pheaders[i].value)
+            m_pheaders[i].value = base + (m_pheaders[i].value - old);
+    }
+}
 
-        case state_e::send_complete:
-            reset();
-            [[fallthrough]];
+bool http::impl::recv_body()
+{
+    bool in_buffer = !m_body_handler && m_body.size() == 0;
 
-        case state_e::waiting_header:
+    while (m_body_received < m_body_size)
+    {
+        auto need = m_body_size - m_body_received;
+        ssize_t sz = 0;
+
+        if (m_body_handler)
         {
-            size_t data_size = 0;
-            for (;;) // recv data portion (size unknown, so we loop)
-            {
-                if (auto block_size = m_channel.get().recv(m_buffer); block_size > 0)
-                {
-                    int minor_version = 0;
-                    m_buffer.set_position(0);
-                    m_num_headers = sizeof(m_pheaders) / sizeof(phr_header);
-                    auto ret = phr_parse_response((const char*) m_buffer.ptr(), data_size + block_size, &minor_version,
-                                                 &m_status, (const char **) &m_message_ptr, &m_message_len,
-                                                 m_pheaders, &m_num_headers, data_size);
-                    
-                    data_size += block_size;
-                    if (ret > 0) // all headers parsed
-                    {
-                        m_header_size = static_cast<unsigned>(ret);
-                        m_message = std::string_view(m_message_ptr, m_message_len);
-                        m_buffer.set_position(m_header_size);
-                        
-                        for (unsigned i = 0; i < m_num_headers; ++i)
-                        {
-                            auto field = std::string(m_pheaders[i].name, m_pheaders[i].name_len);
-                            auto value = std::string(m_pheaders[i].value, m_pheaders[i].value_len);
-
-                            m_headers.insert({field, value});
-
-                            if (isequal(field,"Content-Length"))
-                            {
-                                unsigned size = 0;
-                                if (auto [p, ec] = std::from_chars(value.data(), value.data() +
-                                                                   value.size(), size); ec == std::errc())
-                                    m_body_size = size;
-                                else
-                                    throw error("http: can't parse 'Content-Length' value");
-                            }
-                            else if (isequal(field,"Transfer-Encoding"))
-                            {
-                                if (value == "chunked")
-                                {
-                                    m_chunked = true;
-                                    m_body_size = m_max_request_body_size;
-                                }
-                            }
-                        }
-
-                        if (m_body_size == 0)
-                            return std::make_tuple(m_status, m_message, m_headers, buffer());
-                        
-                        if (m_body_size <= data_size - m_header_size) // body already received
-                        {
-                            m_buffer.set_size(m_header_size + m_body_size); // shrink buffer
-                            return std::make_tuple(m_status, m_message, m_headers, m_buffer);
-                        }
-                        
-                        if (m_body_size <= m_max_request_body_size)
-                        {
-                            m_state = state_e::waiting_body;
-                            
-                            if (m_buffer.size() < m_body_size) // alloc new if size is not enough
-                            {
-                                m_new_body_buffer = true;
-                                m_body = buffer(m_body_size);
-                                auto tail_size = data_size - m_buffer.position();
-                                if (tail_size > 0)
-                                {
-                                    memcpy(m_body.ptr(), m_buffer.ptr(), tail_size);
-                                    if (m_chunked)
-                                    {
-                                        m_body.set_position(0);
-                                        m_body.set_size(tail_size);
-                                    }
-                                    else
-                                        m_body.set_position(tail_size);
-                                }
-                            }
-                            else
-                                m_buffer.set_position(data_size);
-
-                            break; // exit loop
-                        }
-                        else
-                            throw error("http: body is bigger than allowed");
-                    }
-                    else if (ret == -1)
-                        throw error("http: error parsing http headers");
-                    
-                    if (data_size == m_buffer.size())
-                        throw error("http: request is too big");
-                    
-                    m_buffer.set_position(data_size);
-                }
-                else // would block
-                    return http::response_t();
-
-            } // loop
+            auto staging = m_buffer.ptr() + m_header_size;
+            sz = m_channel.get().recv(staging, std::min(need, m_buffer.size() - m_header_size));
+            if (sz > 0)
+                m_body_handler(staging, sz);
+        }
+        else if (in_buffer)
+            sz = m_channel.get().recv(m_buffer.ptr() + m_header_size + m_body_received, need);
+        else
+            sz = m_channel.get().recv(m_body.ptr() + m_body_received, need);
 
-        } [[fallthrough]];
+        if (sz <= 0) // would block
+            return false;
 
-        case state_e::waiting_body:
+        m_body_received += sz;
+    }
+
+    if (m_data_size > m_header_size + m_body_size) // next pipelined message
+    {
+        m_leftover_pos = m_header_size + m_body_size;
+        m_leftover_size = m_data_size - m_leftover_pos;
+    }
+
+    if (in_buffer && m_body_size > 0)
+    {
+        m_buffer.set_position(m_header_size);
+        m_buffer.set_size(m_header_size + m_body_size); // shrink buffer
+        m_body = m_buffer;
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// the staging area takes portions until the peer closes; a blocking socket throws when it does,
+// see http::request
+
+bool http::impl::recv_until_close()
+{
+    auto staging = m_buffer.ptr() + m_header_size;
+
+    for (;;)
+    {
+        auto sz = m_channel.get().recv(staging, m_buffer.size() - m_header_size);
+        if (sz < 0) // would block
+            return false;
+
+        if (sz == 0) // closed
         {
-            for (;;)
-            {
-                if (m_chunked)
-                {
-
-                    size_t size = m_body.size();
-                    auto ret = phr_decode_chunked(&m_chunked_decoder, (char*) m_body.ptr(), &size);
-                    if (ret == -2)
-                    {
-                        m_body.set_size(m_max_request_body_size);
-                        m_body.set_position(m_body.position()+size);
-                        
-                        if (auto sz = m_channel.get().recv(m_body); sz > 0)
-                        {
-                            m_body.set_size(m_body.position()+sz);
-                        }
-                        else // would block
-                        {
-                            m_body.set_size(m_body.position());
-                            return http::response_t();
-                        }
-                    }
-                    else if (ret > 0)
-                    {
-                        m_body.set_size(m_body.position()+size);
-                        m_body.set_position(0);
-                        return std::make_tuple(m_status, m_message, m_headers, m_body);
-                    }
-                    else if (ret == -1)
-                        throw error("http: unable to parse chunked content");
-                }
-                else if (m_new_body_buffer)
-                {
-                    auto need = m_body_size - m_body.position();
-                    if (auto sz = m_channel.get().recv(m_body); sz == need)
-                    {
-                        m_body.set_position(0);
-                        return std::make_tuple(m_status, m_message, m_headers, m_body);
-                    }
-                    else if (sz > 0)
-                        m_buffer.set_position(m_buffer.position()+sz);
-                    else // would block
-                        return http::response_t();
-                }
-                else
-                {
-                    auto need = m_body_size + m_header_size - m_buffer.position();
-                    if (auto sz = m_channel.get().recv(m_buffer); sz == need)
-                    {
-                        m_buffer.set_position(m_header_size);
-                        m_buffer.set_size(m_header_size+m_body_size); // shrink buffer
-                        return std::make_tuple(m_status, m_message, m_headers, m_buffer);
-                    }
-                    else if (sz > 0)
-                        m_buffer.set_position(m_buffer.position()+sz);
-                    else // would block
-                        return http::response_t();
-                }
-            }
+            m_keep_alive = false;
+            return true;
         }
-            
-        default:
-            throw error("invalid state");
+
+        append_body(staging, static_cast<size_t>(sz));
+    }
+}
+
+void http::impl::append_body(const uint8_t* _data, size_t _size)
+{
+    m_body_received += _size;
+
+    if (m_body_handler)
+        m_body_handler(_data, _size);
+    else if (m_body_received <= m_limits.max_body_size)
+        m_body.append(_data, _size);
+    else
+        throw error("http: body is bigger than allowed");
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// chunks are decoded in place in the staging area, then passed to handler or appended to body
+
+bool http::impl::recv_chunked()
+{
+    auto staging = m_buffer.ptr() + m_header_size;
+
+    for (;;)
+    {
+        size_t size = m_staged_size;
+        auto ret = phr_decode_chunked(&m_chunked_decoder, (char*) staging, &size);
+        if (ret == -1)
+            throw error("http: unable to parse chunked content");
+
+        m_staged_size = 0;
+        m_body_received += size;
+
+        if (m_body_handler)
+        {
+            if (size > 0)
+                m_body_handler(staging, size);
+        }
+        else if (m_body_received <= m_limits.max_body_size)
+            m_body.append(staging, size);
+        else
+            throw error("http: body is bigger than allowed");
+
+        if (ret >= 0) // complete, undecoded tail is the next pipelined message
+        {
+            m_leftover_pos = m_header_size + size;
+            m_leftover_size = static_cast<size_t>(ret);
+            return true;
+        }
+
+        auto sz = m_channel.get().recv(staging, m_buffer.size() - m_header_size);
+        if (sz <= 0) // would block
+            return false;
+
+        m_staged_size = sz;
     }
 }
 
@@ -563,46 +851,112 @@ void http::send_response(const response_t& _response)
     m_impl->send_response(_code, _text, _headers, _body);
 }
 
+void http::send_response(const response_t& _response, const file_t& _body)
+{
+    const auto& [_code, _text, _headers, _unused] = _response;
+    m_impl->send_response(_code, _text, _headers, _body);
+}
+
 // -----------------------------------------------------------------------------------------------------------
 
 void http::impl::send_response(unsigned _code, std::string_view _text, const headers_t& _hdrs, buffer _body)
 {
-    m_state = state_e::sending_body;
+    make_response_head(_code, _text, _hdrs, _body.size());
 
-    std::string resp = "HTTP/1.1 " + std::to_string(_code);
-    resp += " ";
-    resp += _text;
-    resp += "\r\n";
+    // echoed request body lives in m_buffer, which is reused for the next pipelined request
 
-    for (auto& [key, value]: _hdrs)
+    auto base = m_buffer.ptr() - m_buffer.position();
+    if (m_leftover_size > 0 && _body.ptr() >= base && _body.ptr() < base + m_buffer.capacity())
+        _body = buffer(_body.ptr(), _body.size());
+
+    m_send_queue.push(_body);
+    send_or_defer();
+}
+
+void http::impl::send_response(unsigned _code, std::string_view _text, const headers_t& _hdrs, const file_t& _body)
+{
+    make_response_head(_code, _text, _hdrs, _body.size);
+    m_send_queue.push_file(_body.fd, _body.offset, _body.size);
+    flush(); // not deferred, the caller may close fd once state() is send_complete
+}
+
+// -----------------------------------------------------------------------------------------------------------
+// while complete pipelined requests are waiting in m_buffer, responses are only queued
+// and then flushed together with one gather write; the state stays sending_body until
+// the queue is sent, request_buffered() tells the caller to recv the next request first
+
+void http::impl::send_or_defer()
+{
+    if (m_deferred < m_max_deferred && next_request_ready())
     {
-        resp += key;
-        resp += ": ";
-        resp += value;
-        resp += "\r\n";
+        ++m_deferred;
+        m_send_buffer = buffer();
+        return;
     }
 
-    if (_body.size() > 0)
+    flush();
+}
+
+bool http::impl::next_request_ready() const
+{
+    if (m_leftover_size == 0)
+        return false;
+
+    const char *method, *path;
+    size_t method_len, path_len;
+    int minor_version;
+    phr_header headers[64]; // more headers - not ready, the response is just sent
+    size_t num_headers = sizeof(headers) / sizeof(phr_header);
+
+    auto data = (const char*) m_buffer.ptr() - m_buffer.position() + m_leftover_pos;
+    int ret = phr_parse_request(data, m_leftover_size, &method, &method_len, &path, &path_len,
+                                &minor_version, headers, &num_headers, 0);
+    if (ret <= 0)
+        return false;
+
+    size_t body_size = 0;
+    for (size_t i = 0; i < num_headers; ++i)
     {
-        resp += "Content-Length: " + std::to_string(_body.size());
-        resp += "\r\n";
+        std::string_view field(headers[i].name, headers[i].name_len);
+        std::string_view value(headers[i].value, headers[i].value_len);
+
+        if (isequal(field, "Transfer-Encoding"))
+            return false; // can't tell without decoding, don't delay the response
+        else if (isequal(field, "Content-Length"))
+            std::from_chars(value.data(), value.data() + value.size(), body_size);
     }
 
-    resp += "\r\n";
-    
-    auto size = resp.size() + _body.size();
-    m_send_buffer = buffer(size);
+    return ret + body_size <= m_leftover_size;
+}
+
+void http::impl::make_response_head(unsigned _code, std::string_view _text, const headers_t& _hdrs, size_t _body_size)
+{
+    m_state = state_e::sending_body;
 
-    memcpy(m_send_buffer.ptr(), resp.c_str(), resp.size());
-    memcpy(m_send_buffer.ptr() + resp.size(), _body.ptr(), _body.size());
+    m_send_buffer = buffer(256, buffer::uninitialized);
+    m_send_buffer.set_size(0);
+    m_send_buffer.append("HTTP/1.1 " + std::to_string(_code));
+    m_send_buffer.append(" ");
+    m_send_buffer.append(_text);
+    m_send_buffer.append("\r\n");
 
-    if (auto sz = m_channel.get().send(m_send_buffer); sz == m_send_buffer.size())
+    for (auto& [key, value]: _hdrs)
     {
-        m_state = state_e::send_complete;
-        m_send_buffer = buffer();
+        m_send_buffer.append(key);
+        m_send_buffer.append(": ");
+        m_send_buffer.append(value);
+        m_send_buffer.append("\r\n");
     }
-    else if (sz > 0)
-        m_send_buffer.set_position(m_send_buffer.position() + sz);
+
+    if (_body_size > 0)
+    {
+        m_send_buffer.append("Content-Length: " + std::to_string(_body_size));
+        m_send_buffer.append("\r\n");
+    }
+
+    m_send_buffer.append("\r\n");
+
+    m_send_queue.push(m_send_buffer);
 }
 
 
@@ -1,106 +1,508 @@
-
 #include <ez/ip.hpp>
 #include <cinttypes>
-#include <cctype>
+#include <cstring>
 #include <stdexcept>
-//#include <netdb.h>
+
+#include <random>
+
+#if defined(__APPLE__) || defined(__linux__)
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "dns.hpp"
+#include "sockaddr.hpp"
 
 namespace ez
 {
+    // ------------------------------------------------------------------------------------------
+    // "a.b.c.d", no leading zeros (010 would be octal to inet_aton)
+
+    static bool parse_v4(const char* _p, const char* _end, uint8_t* _out)
+    {
+        uint8_t result[4];
+
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            if (i > 0)
+            {
+                if (_p == _end || *_p != '.')
+                    return false;
+                ++_p;
+            }
+
+            const char* start = _p;
+            unsigned value = 0;
+
+            while (_p != _end && *_p >= '0' && *_p <= '9' && _p - start < 3)
+                value = value * 10 + unsigned(*_p++ - '0');
+
+            if (_p == start || value > 255 || (*start == '0' && _p - start > 1))
+                return false;
+
+            result[i] = static_cast<uint8_t>(value);
+        }
+
+        if (_p != _end)
+            return false;
+
+        memcpy(_out, result, 4);
+        return true;
+    }
+
+    static int hex_value(char _c)
+    {
+        if (_c >= '0' && _c <= '9') return _c - '0';
+        if (_c >= 'a' && _c <= 'f') return _c - 'a' + 10;
+        if (_c >= 'A' && _c <= 'F') return _c - 'A' + 10;
+        return -1;
+    }
+
+    // groups separated by ':', one "::" for a run of zero groups, a v4 address may end it
+
+    static bool parse_v6(const char* _p, const char* _end, uint8_t* _out)
+    {
+        uint16_t groups[8];
+        int count = 0, gap = -1;
+
+        if (_p == _end)
+            return false;
+
+        if (*_p == ':')
+        {
+            if (_end - _p < 2 || _p[1] != ':')
+                return false;
+
+            gap = 0;
+            _p += 2;
+        }
+
+        while (_p != _end)
+        {
+            const char* start = _p;
+            unsigned value = 0;
+            int digit;
+
+            while (_p != _end && _p - start < 5 && (digit = hex_value(*_p)) >= 0)
+            {
+                value = value * 16 + unsigned(digit);
+                ++_p;
+            }
+
+            if (_p != _end && *_p == '.')
+            {
+                uint8_t v4[4];
+                if (count > 6 || !parse_v4(start, _end, v4))
+                    return false;
+
+                groups[count++] = uint16_t(v4[0] << 8 | v4[1]);
+                groups[count++] = uint16_t(v4[2] << 8 | v4[3]);
+                _p = _end;
+                break;
+            }
+
+            if (_p == start || _p - start > 4 || count == 8)
+                return false;
+
+            groups[count++] = static_cast<uint16_t>(value);
+
+            if (_p == _end)
+                break;
+
+            if (*_p++ != ':' || _p == _end)
+                return false;
+
+            if (*_p == ':')
+            {
+                if (gap >= 0)
+                    return false;
+
+                gap = count;
+                ++_p;
+            }
+        }
+
+        if (gap < 0 ? count != 8 : count > 7)
+            return false;
+
+        uint8_t result[16] = {};
+        int tail = gap < 0 ? 0 : count - gap;
+
+        for (int i = 0; i < count; ++i)
+        {
+            int at = i < count - tail ? i : 8 - (count - i);
+            result[at * 2] = uint8_t(groups[i] >> 8);
+            result[at * 2 + 1] = uint8_t(groups[i]);
+        }
+
+        memcpy(_out, result, 16);
+        return true;
+    }
+
+    // "2" or an interface name
+
+    static bool parse_scope(const char* _p, const char* _end, uint32_t& _scope)
+    {
+        if (_p == _end)
+            return false;
+
+        uint64_t value = 0;
+        const char* q = _p;
+        while (q != _end && *q >= '0' && *q <= '9' && value <= UINT32_MAX)
+            value = value * 10 + uint64_t(*q++ - '0');
+
+        if (q == _end)
+        {
+            if (value > UINT32_MAX)
+                return false;
+
+            _scope = static_cast<uint32_t>(value);
+            return true;
+        }
+
+#if defined(__APPLE__) || defined(__linux__)
+        char name[IF_NAMESIZE];
+        if (size_t(_end - _p) >= sizeof(name))
+            return false;
+
+        memcpy(name, _p, size_t(_end - _p));
+        name[_end - _p] = 0;
+
+        _scope = if_nametoindex(name);
+        return _scope != 0;
+#else
+        return false;
+#endif
+    }
+
+    static char* format_decimal(char* _out, uint32_t _value)
+    {
+        char digits[10];
+        int n = 0;
+
+        do
+        {
+            digits[n++] = char('0' + _value % 10);
+            _value /= 10;
+        }
+        while (_value != 0);
+
+        while (n > 0)
+            *_out++ = digits[--n];
+
+        return _out;
+    }
+
+    static char* format_v4(char* _out, const uint8_t* _bytes)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            if (i > 0)
+                *_out++ = '.';
+            _out = format_decimal(_out, _bytes[i]);
+        }
+
+        return _out;
+    }
+
+    // ------------------------------------------------------------------------------------------
+
     ipv4_t::ipv4_t(std::string_view _source)
     {
-        bool at_least_one_symbol = false;
-        uint8_t symbol, string_index = 0, result_index = 0;
-        uint16_t data = 0;
-        size_t string_length = _source.size();
-        uint8_t* result = reinterpret_cast<uint8_t*>(&S_addr);
-        const char* string = _source.data();
-        
-        while ( string_index < string_length )
-        {
-            symbol = string[string_index];
-            if ( std::isdigit ( symbol ) != 0 )
+        if (!parse_v4(_source.data(), _source.data() + _source.size(), reinterpret_cast<uint8_t*>(&S_addr)))
+            throw std::runtime_error("invalid ipv4 address");
+    }
+
+    // ------------------------------------------------------------------------------------------
+
+    ip_address::ip_address(ipv4_t _v4)
+    {
+        memcpy(bytes, &_v4.S_addr, 4);
+    }
+
+    ip_address::ip_address(std::string_view _source)
+    {
+        if (!parse(_source, *this))
+            throw std::runtime_error("invalid ip address");
+    }
+
+    ip_address ip_address::any_v6()
+    {
+        ip_address result;
+        result.family = family_e::v6;
+        return result;
+    }
+
+    ip_address ip_address::loopback_v6()
+    {
+        ip_address result = any_v6();
+        result.bytes[15] = 1;
+        return result;
+    }
+
+    bool ip_address::parse(std::string_view _source, ip_address& _result)
+    {
+        const char* p = _source.data();
+        const char* end = p + _source.size();
+
+        ip_address result;
+
+        if (_source.find(':') == std::string_view::npos)
+        {
+            if (!parse_v4(p, end, result.bytes))
+                return false;
+        }
+        else
+        {
+            const char* percent = static_cast<const char*>(memchr(p, '%', _source.size()));
+
+            if (!parse_v6(p, percent ? percent : end, result.bytes))
+                return false;
+
+            if (percent && !parse_scope(percent + 1, end, result.scope))
+                return false;
+
+            result.family = family_e::v6;
+        }
+
+        _result = result;
+        return true;
+    }
+
+    size_t ip_address::format(char* _out) const
+    {
+        char* p = _out;
+
+        if (is_v4())
+            return size_t(format_v4(p, bytes) - _out);
+
+        if (is_v4_mapped())
+        {
+            memcpy(p, "::ffff:", 7);
+            p = format_v4(p + 7, bytes + 12);
+        }
+        else
+        {
+            // the longest run of two or more zero groups becomes "::", the first one of equal runs
+
+            int best = -1, best_length = 1;
+            for (int i = 0; i < 8; )
             {
-                symbol -= '0';
-                data   = data * 10 + symbol;
-                if ( data > UINT8_MAX )
+                int j = i;
+                while (j < 8 && bytes[j * 2] == 0 && bytes[j * 2 + 1] == 0)
+                    ++j;
+
+                if (j - i > best_length)
                 {
-                    // 127.0.0.256
-                    throw std::runtime_error("ERROR_IPV4_DATA_OVERFLOW");
+                    best = i;
+                    best_length = j - i;
                 }
-                at_least_one_symbol = true;
+
+                i = j == i ? i + 1 : j;
             }
-            else if ( symbol == '.' )
+
+            static const char digits[] = "0123456789abcdef";
+
+            for (int i = 0; i < 8; ++i)
             {
-                if ( result_index < 3 )
+                if (i == best)
                 {
-                    if ( at_least_one_symbol )
-                    {
-                        result[result_index] = static_cast<uint8_t>(data);
-                        data = 0;
-                        result_index ++;
-                        at_least_one_symbol = false;
-                    }
-                    else
-                    {
-                        // 127.0..1
-                        throw std::runtime_error("ERROR_IPV4_NO_SYMBOL");
-                    }
+                    *p++ = ':';
+                    if (i == 0)
+                        *p++ = ':';
+                    i += best_length - 1;
+                    continue;
                 }
-                else
+
+                unsigned group = unsigned(bytes[i * 2]) << 8 | bytes[i * 2 + 1];
+                bool started = false;
+                for (int shift = 12; shift >= 0; shift -= 4)
                 {
-                    // 127.0.0.1.2
-                    throw std::runtime_error("ERROR_IPV4_INPUT_OVERFLOW");
+                    unsigned d = (group >> shift) & 0xf;
+                    if (d != 0 || started || shift == 0)
+                    {
+                        *p++ = digits[d];
+                        started = true;
+                    }
                 }
-            } else
-            {
-                // 127.*
-                throw std::runtime_error("ERROR_IPV4_INVALID_SYMBOL");
+
+                if (i < 7)
+                    *p++ = ':';
             }
-            string_index++;
         }
-        
-        if ( result_index == 3 )
+
+        if (scope != 0)
         {
-            if ( at_least_one_symbol )
-            {
-                result[result_index] = static_cast<uint8_t>(data);
-            }
-            else
-            {
-                // 127.0.0.
-                throw std::runtime_error("ERROR_IPV4_NOT_ENOUGH_INPUT");
-            }
+            *p++ = '%';
+            p = format_decimal(p, scope);
         }
+
+        return size_t(p - _out);
+    }
+
+    std::string ip_address::to_string() const
+    {
+        char text[max_length];
+        return std::string(text, format(text));
+    }
+
+    bool ip_address::is_any() const
+    {
+        static const uint8_t zero[16] = {};
+        return memcmp(bytes, zero, is_v4() ? 4 : 16) == 0;
+    }
+
+    bool ip_address::is_v4_mapped() const
+    {
+        static const uint8_t prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+        return is_v6() && memcmp(bytes, prefix, 12) == 0;
+    }
+
+    ipv4_t ip_address::v4() const
+    {
+        ipv4_t result;
+
+        if (is_v4())
+            memcpy(&result.S_addr, bytes, 4);
+        else if (is_v4_mapped())
+            memcpy(&result.S_addr, bytes + 12, 4);
         else
+            throw std::runtime_error("not an ipv4 address");
+
+        return result;
+    }
+
+    bool ip_address::operator == (const ip_address& _right) const
+    {
+        return family == _right.family && scope == _right.scope && memcmp(bytes, _right.bytes, 16) == 0;
+    }
+
+    // ------------------------------------------------------------------------------------------
+
+    socklen_t to_sockaddr(const ip_address& _address, uint16_t _port, sockaddr_storage& _sa)
+    {
+        memset(&_sa, 0, sizeof(_sa));
+
+        if (_address.is_v4())
         {
-            // result_index will be always less than 3
-            // 127.0
-            throw std::runtime_error("ERROR_IPV4_NOT_ENOUGH_INPUT");
+            auto sin = reinterpret_cast<sockaddr_in*>(&_sa);
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(_port);
+            memcpy(&sin->sin_addr, _address.bytes, 4);
+            return sizeof(sockaddr_in);
         }
+
+        auto sin6 = reinterpret_cast<sockaddr_in6*>(&_sa);
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(_port);
+        sin6->sin6_scope_id = _address.scope;
+        memcpy(&sin6->sin6_addr, _address.bytes, 16);
+        return sizeof(sockaddr_in6);
     }
 
-    ipv4_t resolve(const std::string& _name)
+    ip_address from_sockaddr(const sockaddr_storage& _sa, uint16_t* _port)
     {
-        /*struct in_addr* ip = 0;
-        struct hostent* hp = 0;
-        //hp = gethostbyname(_name.c_str());
-        if (hp == 0)
-            throw std::runtime_error("cannot resolve host");
+        ip_address result;
+        uint16_t port = 0;
 
-        for(unsigned i = 0; hp->h_addr_list[i] != NULL; ++i )
+        if (_sa.ss_family == AF_INET6)
         {
-            ip = (struct in_addr*) hp->h_addr_list[i];
-            break;
+            auto sin6 = reinterpret_cast<const sockaddr_in6*>(&_sa);
+            result.family = ip_address::family_e::v6;
+            result.scope = sin6->sin6_scope_id;
+            memcpy(result.bytes, &sin6->sin6_addr, 16);
+            port = ntohs(sin6->sin6_port);
+
+            if (result.is_v4_mapped())
+                result = result.v4();
+        }
+        else if (_sa.ss_family == AF_INET)
+        {
+            auto sin = reinterpret_cast<const sockaddr_in*>(&_sa);
+            memcpy(result.bytes, &sin->sin_addr, 4);
+            port = ntohs(sin->sin_port);
         }
 
-        if (ip == 0)
-            throw std::runtime_error("resolved IP address not found");
+        if (_port)
+            *_port = port;
 
-        return { (uint32_t) (*ip).s_addr };*/
-        
-        return {};
+        return result;
     }
-}
 
+    // ------------------------------------------------------------------------------------------
+
+    // blocking: a literal address, /etc/hosts, then the servers of /etc/resolv.conf in turn;
+    // event loops use ez::resolver
 
+    ipv4_t resolve(std::string_view _name)
+    {
+        ip_address literal;
+        if (ip_address::parse(_name, literal))
+            return literal.v4();
+
+        auto name = dns::normalize(_name);
+        auto hosts = dns::read_hosts("/etc/hosts");
+        if (auto it = hosts.find(name); it != hosts.end())
+            for (auto& a: it->second)
+                if (a.is_v4())
+                    return a.v4();
+
+        auto conf = dns::read_resolv_conf("/etc/resolv.conf");
+        if (conf.servers.empty())
+            conf.servers.push_back(ipv4_t(127, 0, 0, 1));
+
+        unsigned timeout_ms = conf.timeout_ms ? conf.timeout_ms : 5000;
+        unsigned attempts = conf.attempts ? conf.attempts : 2;
+
+        uint8_t query[dns::max_udp], response[4096];
+        uint16_t id = static_cast<uint16_t>(std::random_device()());
+        auto size = dns::make_query(query, id, name, dns::a);
+        if (size == 0)
+            throw std::runtime_error("invalid host name");
+
+        for (unsigned i = 0; i < attempts * conf.servers.size(); ++i)
+        {
+            auto& server = conf.servers[i % conf.servers.size()];
+
+            sockaddr_storage sa;
+            auto length = to_sockaddr(server, 53, sa);
+
+            // connected, so only the server's answers come in
+            int fd = ::socket(sa.ss_family, SOCK_DGRAM, 0);
+            if (fd == -1)
+                continue;
+
+            dns::answer_t answer;
+            bool answered = false;
+
+            if (::connect(fd, reinterpret_cast<sockaddr*>(&sa), length) == 0 && ::send(fd, query, size, 0) == ssize_t(size))
+            {
+                pollfd pfd { fd, POLLIN, 0 };
+                while (!answered && ::poll(&pfd, 1, int(timeout_ms)) > 0)
+                {
+                    auto n = ::recv(fd, response, sizeof(response), 0);
+                    if (n < 0)
+                        break;
+
+                    answered = dns::parse_response(response, size_t(n), id, name, dns::a, answer);
+                }
+            }
+
+            ::close(fd);
+
+            if (!answered)
+                continue;
+
+            if (!answer.addresses.empty())
+                return answer.addresses.front().v4();
+
+            if (answer.rcode == dns::name_error || (answer.rcode == dns::no_error && !answer.truncated))
+                throw std::runtime_error("cannot resolve host");
+        }
+
+        throw std::runtime_error("no dns server answered");
+    }
+}
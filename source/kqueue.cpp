@@ -1,9 +1,20 @@
 
 #include <ez/events.hpp>
+#include "placement.hpp"
+#include "timer_wheel.hpp"
+#include "task_queue.hpp"
+#include "polling.hpp"
+#include "affinity.hpp"
+#include "read_budget.hpp"
 
 #include <thread>
+#include <mutex>
+#include <exception>
 #include <atomic>
 #include <chrono>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <sys/event.h>
@@ -24,13 +35,15 @@ using namespace std::chrono_literals;
 
 // ------------------------------------------------------------------------------------------
 
-static inline bool kqueue_add(int _kqueue, int fd, bool _write = true)
+// udata is the fd's handler, if any
+
+static inline bool kqueue_add(int _kqueue, int fd, bool _write = true, void* _handler = nullptr)
 {
     if (_write)
     {
         struct kevent ev[2];
-        EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, 0);
-        EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, 0);
+        EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, _handler);
+        EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, _handler);
         if (int n = kevent(_kqueue, ev, 2, 0, 0, 0); n == -1)
             return false;
     }
@@ -45,17 +58,54 @@ static inline bool kqueue_add(int _kqueue, int fd, bool _write = true)
     return true;
 }
 
+// read filter is edge triggered (EV_CLEAR), adding it again reports the fd if it's still readable
+
+static inline bool kqueue_rearm(int _kqueue, int fd, void* _handler)
+{
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, _handler);
+    return kevent(_kqueue, &ev, 1, 0, 0, 0) != -1;
+}
+
+static inline bool kqueue_remove(int _kqueue, int fd)
+{
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
+    return kevent(_kqueue, ev, 2, 0, 0, 0) != -1;
+}
+
+// user event to wake the loop up for timers and tasks from other threads
+
+static inline bool kqueue_add_wake(int _kqueue)
+{
+    struct kevent ev;
+    EV_SET(&ev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, 0);
+    return kevent(_kqueue, &ev, 1, 0, 0, 0) != -1;
+}
+
+static inline void kqueue_wake(int _kqueue)
+{
+    struct kevent ev;
+    EV_SET(&ev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
+    kevent(_kqueue, &ev, 1, 0, 0, 0);
+}
+
 // ------------------------------------------------------------------------------------------
 
 namespace ez {
 
+static thread_local int t_fd = -1; // of the event being dispatched, -1 between dispatches
+static thread_local bool t_rearmed = false; // drain_fd armed t_fd again
+
 struct worker
 {
     int         stop_fd[2] = { -1, - 1 };
     int         kqueue_fd = -1;
-
-    std::atomic<bool> running {false};
-    std::atomic<bool> stopping {false};
+    loop_timers timers;
+    task_queue  tasks;
+    poll_meter  meter;
+    bool        drained = false; // no fds left while draining, worker thread only
 
     void stop() { close(kqueue_fd); close(stop_fd[0]); close(stop_fd[1]); }
 };
@@ -64,17 +114,48 @@ struct event_loop::impl
 {
     int                 m_kqueue = -1;
     int                 m_stop_fd[2] = { -1, - 1 };
-    unsigned            m_workers = 0;
+    std::atomic<unsigned> m_workers {0};
+    std::vector<std::thread> m_threads;
     on_event_t          m_event_fn;
     on_timeout_t        m_timeout_fn;
+    on_accept_t         m_accept_fn = nullptr;
     void*               m_param = nullptr;
+    void*               m_accept_param = nullptr;
     worker*             m_worker = nullptr;
+    worker_load*        m_load = nullptr;
+    worker_load         m_main_fds;         // fds of the main kqueue, for their handlers
+    std::atomic<unsigned> m_idle_ms {0};    // migration of idle fds, 0 - disabled
+    on_migrate_t        m_migrate_fn = nullptr;
+    void*               m_migrate_param = nullptr;
+    std::mutex          m_moving;           // held while an fd moves between workers
+    polling_t           m_polling;
+    std::vector<std::pair<int, unsigned>> m_listeners; // fd, worker
+    loop_timers         m_timers;
+    task_queue          m_tasks;
+    worker_startup      m_startup;
+
+    std::atomic<bool>   m_draining {false};
+    std::atomic<unsigned> m_drained {0};    // workers without fds
+    std::atomic<uint64_t> m_drain_timer {0};
+    std::mutex          m_error_lock;
+    std::exception_ptr  m_error;            // first exception of a worker, rethrown by start()
     
     ~impl();
 
     void start_workers(unsigned int _workers, int _timeout);
+    void setup_worker(worker& _worker, unsigned _index);
+    void stop_workers();
+    void fail(std::exception_ptr _error);
+    void drain(unsigned _worker);
+    void check_drained(unsigned _worker);
     void process_events(int _kq, int _stopfd, int _worker, int _timeout);
+    void add_fd(int _fd, handler_t* _handler, unsigned _worker);
     bool process_fd(int _fd, struct kevent&, unsigned _worker);
+    void migrate(unsigned _worker, int64_t _now);
+    bool move(int _fd, handler_t* _handler, unsigned _from, unsigned _to, int64_t _now);
+    void accept_all(int _fd, unsigned _worker);
+    uint64_t schedule(unsigned _ms, void* _param, on_timer_t _fn, unsigned _worker);
+    void post(void* _param, task_t _fn, unsigned _worker);
 };
 
 // ------------------------------------------------------------------------------------------
@@ -86,6 +167,8 @@ event_loop::event_loop() : m_impl(new impl)
 void event_loop::init()
 {
     m_impl->m_kqueue = kqueue();
+    if (m_impl->m_kqueue != -1)
+        kqueue_add_wake(m_impl->m_kqueue);
 }
 
 event_loop::~event_loop()
@@ -99,6 +182,39 @@ event_loop::impl::~impl()
         close(m_kqueue);
 }
 
+void event_loop::set_polling(const polling_t& _polling)
+{
+    if (m_impl->m_workers > 0)
+        throw std::runtime_error("polling is set before start()");
+
+    if (_polling.batch == 0)
+        throw std::runtime_error("polling batch can't be 0");
+
+    if (_polling.busy_poll_us > 0 || _polling.busy_poll_budget > 0 || _polling.prefer_busy_poll)
+        throw std::runtime_error("busy poll is not supported by kqueue");
+
+    m_impl->m_polling = _polling;
+}
+
+// no thread affinity api on macos, anything asked for throws
+
+void event_loop::set_affinity(const affinity_t& _affinity)
+{
+    if (m_impl->m_workers > 0)
+        throw std::runtime_error("affinity is set before start()");
+
+    if (!_affinity.cpus.empty() || !_affinity.irq_device.empty())
+        throw std::runtime_error("cpu pinning is not supported by kqueue");
+}
+
+event_loop::poll_stats_t event_loop::poll_stats(unsigned _worker) const
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->m_worker[_worker].meter.stats();
+}
+
 void event_loop::on_event(void* _param, on_event_t _ev)
 {
     m_impl->m_param = _param;
@@ -110,6 +226,21 @@ void event_loop::on_timeout(on_timeout_t _ev)
     m_impl->m_timeout_fn = _ev;
 }
 
+void event_loop::on_accept(void* _param, on_accept_t _fn)
+{
+    m_impl->m_accept_param = _param;
+    m_impl->m_accept_fn = _fn;
+}
+
+void event_loop::add_listener(int _fd, unsigned _worker)
+{
+    if (m_impl->m_workers > 0)
+        throw std::runtime_error("listeners are added before start()");
+
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK); // accepted until EAGAIN
+    m_impl->m_listeners.emplace_back(_fd, _worker);
+}
+
 unsigned event_loop::workers() const
 {
     return m_impl->m_workers;
@@ -123,9 +254,175 @@ void event_loop::add_fd(int _fd)
 
 void event_loop::add_fd(int _fd, unsigned _worker)
 {
-    if (_worker < m_impl->m_workers)
-        if (!kqueue_add(m_impl->m_worker[_worker].kqueue_fd, _fd))
+    m_impl->add_fd(_fd, nullptr, _worker);
+}
+
+void event_loop::add_fd(handler_t* _handler)
+{
+    if (!kqueue_add(m_impl->m_kqueue, _handler->fd, true, _handler))
+        throw std::runtime_error("can't add server to kqueue");
+
+    m_impl->m_main_fds.add(_handler->fd, 0, _handler);
+}
+
+void event_loop::add_fd(handler_t* _handler, unsigned _worker)
+{
+    m_impl->add_fd(_handler->fd, _handler, _worker);
+}
+
+void event_loop::impl::add_fd(int _fd, handler_t* _handler, unsigned _worker)
+{
+    if (_worker < m_workers)
+    {
+        if (!kqueue_add(m_worker[_worker].kqueue_fd, _fd, true, _handler))
              throw std::runtime_error("can't add client to worker kqueue");
+
+        m_load[_worker].add(_fd, worker_load::now(), _handler);
+    }
+}
+
+ssize_t event_loop::drain_fd(int _fd, buffer& _data, unsigned _worker, size_t _budget)
+{
+    bool more = false;
+    auto result = read_budget(_fd, _data, _budget, more);
+
+    if (more)
+    {
+        // the handler comes from the fd table, drain_fd may run outside the fd's own callback
+        bool main = _worker >= m_impl->m_workers;
+        auto handler = (main ? m_impl->m_main_fds : m_impl->m_load[_worker]).handler_of(_fd);
+        kqueue_rearm(main ? m_impl->m_kqueue : m_impl->m_worker[_worker].kqueue_fd, _fd, handler);
+        if (_fd == t_fd)
+            t_rearmed = true;
+    }
+
+    return result;
+}
+
+void event_loop::remove_fd(int _fd, unsigned _worker)
+{
+    if (_worker < m_impl->m_workers)
+    {
+        // the fd may have moved to another worker since the caller got _worker
+        auto owner = detach_fd(m_impl->m_load, m_impl->m_workers, m_impl->m_moving, _fd, _worker);
+        if (owner == m_impl->m_workers) // not counted anymore, closed or error event
+            owner = _worker;
+
+        kqueue_remove(m_impl->m_worker[owner].kqueue_fd, _fd);
+
+        if (m_impl->m_draining.load(std::memory_order_relaxed)) // the worker checks if it was the last one
+            m_impl->post(m_impl, [](void* _impl, unsigned _w) { static_cast<impl*>(_impl)->check_drained(_w); }, owner);
+    }
+    else
+    {
+        kqueue_remove(m_impl->m_kqueue, _fd);
+        m_impl->m_main_fds.remove(_fd);
+    }
+}
+
+// ------------------------------------------------------------------------------------------
+
+unsigned event_loop::place_fd(int _fd, placement_e _policy)
+{
+    if (m_impl->m_workers == 0)
+        throw std::runtime_error("no workers to place fd");
+
+    auto w = pick_worker(m_impl->m_load, m_impl->m_workers, _policy);
+    add_fd(_fd, w);
+    return w;
+}
+
+unsigned event_loop::place_fd(handler_t* _handler, placement_e _policy)
+{
+    if (m_impl->m_workers == 0)
+        throw std::runtime_error("no workers to place fd");
+
+    auto w = pick_worker(m_impl->m_load, m_impl->m_workers, _policy);
+    add_fd(_handler, w);
+    return w;
+}
+
+event_loop::load_t event_loop::load(unsigned _worker) const
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->m_load[_worker].stats(worker_load::now());
+}
+
+void event_loop::set_migration(unsigned _idle_ms)
+{
+    m_impl->m_idle_ms = _idle_ms;
+}
+
+void event_loop::on_migrate(void* _param, on_migrate_t _fn)
+{
+    m_impl->m_migrate_param = _param;
+    m_impl->m_migrate_fn = _fn;
+}
+
+// ------------------------------------------------------------------------------------------
+
+uint64_t event_loop::impl::schedule(unsigned _ms, void* _param, on_timer_t _fn, unsigned _worker)
+{
+    auto& timers = _worker < m_workers ? m_worker[_worker].timers : m_timers;
+    int kq = _worker < m_workers ? m_worker[_worker].kqueue_fd : m_kqueue;
+
+    bool wake = false;
+    auto id = timers.schedule(_ms, _fn, _param, wake);
+
+    if (wake && kq != -1)
+        kqueue_wake(kq);
+
+    return id;
+}
+
+uint64_t event_loop::schedule(unsigned _ms, void* _param, on_timer_t _fn)
+{
+    return m_impl->schedule(_ms, _param, _fn, -1);
+}
+
+uint64_t event_loop::schedule(unsigned _ms, void* _param, on_timer_t _fn, unsigned _worker)
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->schedule(_ms, _param, _fn, _worker);
+}
+
+void event_loop::impl::post(void* _param, task_t _fn, unsigned _worker)
+{
+    auto& tasks = _worker < m_workers ? m_worker[_worker].tasks : m_tasks;
+    int kq = _worker < m_workers ? m_worker[_worker].kqueue_fd : m_kqueue;
+
+    if (tasks.push(_param, _fn) && kq != -1)
+        kqueue_wake(kq);
+}
+
+void event_loop::post(void* _param, task_t _fn)
+{
+    m_impl->post(_param, _fn, -1);
+}
+
+void event_loop::post(void* _param, task_t _fn, unsigned _worker)
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    m_impl->post(_param, _fn, _worker);
+}
+
+bool event_loop::cancel(uint64_t _id)
+{
+    return m_impl->m_timers.cancel(_id);
+}
+
+bool event_loop::cancel(uint64_t _id, unsigned _worker)
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->m_worker[_worker].timers.cancel(_id);
 }
 
 // ------------------------------------------------------------------------------------------
@@ -139,45 +436,167 @@ void event_loop::stop()
     }
 }
 
+void event_loop::shutdown(unsigned _grace_ms)
+{
+    if (m_impl->m_stop_fd[1] == -1 || m_impl->m_draining.exchange(true))
+        return;
+
+    for (unsigned i = 0; i < m_impl->m_workers; ++i)
+        m_impl->post(m_impl, [](void* _impl, unsigned _worker) { static_cast<impl*>(_impl)->drain(_worker); }, i);
+
+    m_impl->m_drain_timer = schedule(_grace_ms, this, [](void* _loop, uint64_t, unsigned) { static_cast<event_loop*>(_loop)->stop(); });
+}
+
+bool event_loop::draining() const
+{
+    return m_impl->m_draining.load(std::memory_order_relaxed);
+}
+
 // ------------------------------------------------------------------------------------------
 
 void event_loop::impl::start_workers(unsigned int _workers, int _timeout)
 {
-    m_workers = _workers;
-    
+    for (auto& [fd, w]: m_listeners)
+        if (w >= _workers)
+            throw std::runtime_error("listener for wrong worker: " + std::to_string(w));
+
     if (_workers == 0)
         return;
     
     m_worker = new worker[_workers];
+    m_load = new worker_load[_workers];
+    m_startup.reset();
 
     auto wrk = [this, _timeout](unsigned w)
     {
-//        prctl(PR_SET_NAME, std::string("Worker {}" + std::to_string(w)).c_str(),0,0,0);
+        std::string error;
 
-        m_worker[w].kqueue_fd = kqueue();
-        if (m_worker[w].kqueue_fd == -1)
+        try
+        {
+            setup_worker(m_worker[w], w);
+        }
+        catch (const std::exception& e)
         {
-            throw std::runtime_error("kqueue() worker error");
+            error = e.what();
+        }
+
+        if (!m_startup.set_ready(error))
             return;
+
+        try
+        {
+            process_events(m_worker[w].kqueue_fd, m_worker[w].stop_fd[0], w, _timeout); // blocks this thread
         }
-        
-        if (pipe(m_worker[w].stop_fd) == 0)
+        catch (...)
         {
-            kqueue_add(m_worker[w].kqueue_fd, m_worker[w].stop_fd[0], true);
+            fail(std::current_exception());
         }
-        else
-            throw std::runtime_error("can't create worker pipe()");
-        
-        m_worker[w].running = true;
-        process_events(m_worker[w].kqueue_fd, m_worker[w].stop_fd[0], w, _timeout); // blocks this thread
-        close(m_worker[w].kqueue_fd);
-        close(m_worker[w].stop_fd[0]);
-        close(m_worker[w].stop_fd[1]);
-        m_worker[w].running = false;
+
+        m_worker[w].timers.awake(); // no more wake ups, kqueue is closed by stop_workers
     };
 
     for (unsigned i = 0; i < _workers; ++i)
-        std::thread(wrk, i).detach(); // start worker
+        m_threads.emplace_back(wrk, i); // start worker
+
+    // everything is set up before start goes on, so fds and timers can be added right away
+
+    auto error = m_startup.wait(_workers);
+    if (error.empty())
+        m_workers = _workers; // workers see it after release
+
+    m_startup.release();
+
+    if (error.empty())
+        return;
+
+    stop_workers();
+    throw std::runtime_error(error);
+}
+
+void event_loop::impl::setup_worker(worker& _worker, unsigned _index)
+{
+//    prctl(PR_SET_NAME, std::string("Worker {}" + std::to_string(w)).c_str(),0,0,0);
+
+    _worker.kqueue_fd = kqueue();
+    if (_worker.kqueue_fd == -1)
+        throw std::runtime_error("kqueue() worker error");
+
+    if (pipe(_worker.stop_fd) == 0)
+    {
+        kqueue_add(_worker.kqueue_fd, _worker.stop_fd[0], true);
+    }
+    else
+        throw std::runtime_error("can't create worker pipe()");
+
+    kqueue_add_wake(_worker.kqueue_fd);
+
+    for (auto& [fd, lw]: m_listeners)
+        if (lw == _index && !kqueue_add(_worker.kqueue_fd, fd, false))
+            throw std::runtime_error("can't add listener to worker kqueue");
+}
+
+// stops and joins workers, their fds go with them
+
+void event_loop::impl::stop_workers()
+{
+    for (unsigned i = 0; i < m_threads.size(); ++i)
+    {
+        uint64_t c = 1;
+        if (m_worker[i].stop_fd[1] != -1)
+            write(m_worker[i].stop_fd[1], &c, 8);
+    }
+
+    for (auto& t: m_threads)
+        t.join();
+
+    for (unsigned i = 0; i < m_threads.size(); ++i)
+        m_worker[i].stop();
+
+    m_threads.clear();
+    m_workers = 0;
+    delete [] m_worker;
+    delete [] m_load;
+    m_worker = nullptr;
+    m_load = nullptr;
+}
+
+// an exception in a worker stops the loop, start() rethrows it
+
+void event_loop::impl::fail(std::exception_ptr _error)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_error_lock);
+        if (!m_error)
+            m_error = _error;
+    }
+
+    uint64_t c = 1;
+    write(m_stop_fd[1], &c, 8);
+}
+
+// runs on the worker: no new connections, the loop stops when the last worker has no fds
+
+void event_loop::impl::drain(unsigned _worker)
+{
+    for (auto& [fd, w]: m_listeners)
+        if (w == _worker)
+            kqueue_remove(m_worker[_worker].kqueue_fd, fd);
+
+    check_drained(_worker);
+}
+
+void event_loop::impl::check_drained(unsigned _worker)
+{
+    auto& self = m_worker[_worker];
+    if (self.drained || m_load[_worker].size() > 0)
+        return;
+
+    self.drained = true;
+    if (m_drained.fetch_add(1) + 1 == m_workers)
+    {
+        uint64_t c = 1;
+        write(m_stop_fd[1], &c, 8);
+    }
 }
 
 // ------------------------------------------------------------------------------------------
@@ -194,70 +613,121 @@ void event_loop::start(unsigned _workers, int _timeout)
     else
         throw std::runtime_error("can't create main pipe()");
 
-    m_impl->start_workers(_workers, 0);
-    m_impl->process_events(m_impl->m_kqueue, m_impl->m_stop_fd[0], -1, _timeout); // blocks this thread
+    m_impl->m_draining = false;
+    m_impl->m_drained = 0;
+
+    std::exception_ptr error;
+
+    try
+    {
+        m_impl->start_workers(_workers, 0);
+        m_impl->process_events(m_impl->m_kqueue, m_impl->m_stop_fd[0], -1, _timeout); // blocks this thread
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+
+    m_impl->stop_workers(); // joined, nothing writes the stop pipe after it
+    m_impl->m_timers.cancel(m_impl->m_drain_timer);
+    m_impl->m_drain_timer = 0;
 
-    // after calling stop()
-    
     close(m_impl->m_stop_fd[0]);
     close(m_impl->m_stop_fd[1]);
     
     m_impl->m_stop_fd[0] = m_impl->m_stop_fd[1] = -1;
+    m_impl->m_draining = false;
 
-    if (m_impl->m_workers == 0)
-        return;
-    
-    bool found = false;
-    while(!found) // wait until all workers stop
+    if (!error)
     {
-        for (unsigned i = 0; i < m_impl->m_workers; ++i)
-        {
-            if (m_impl->m_worker[i].running)
-            {
-                found = true;
-                if (!m_impl->m_worker[i].stopping)
-                {
-                    m_impl->m_worker[i].stopping = true;
-                    uint64_t c = 1;
-                    write(m_impl->m_worker[i].stop_fd[1], &c, 8);
-                }
-            }
-        }
-
-        std::this_thread::sleep_for(100ms);
+        std::lock_guard<std::mutex> lock(m_impl->m_error_lock);
+        std::swap(error, m_impl->m_error);
     }
 
-    m_impl->m_workers = 0;
-    delete [] m_impl->m_worker;
+    if (error)
+        std::rethrow_exception(error);
 }
 
 // ------------------------------------------------------------------------------------------
 
 void event_loop::impl::process_events(int _kq, int _stopfd, int _worker, int _timeout)
 {
-    constexpr int num_events = 100;
-    struct kevent events[num_events];
+    int num_events = static_cast<int>(m_polling.batch);
+    std::vector<struct kevent> storage(num_events);
+    auto events = storage.data();
+    auto load = unsigned(_worker) < m_workers ? &m_load[_worker] : nullptr;
+    auto meter = unsigned(_worker) < m_workers ? &m_worker[_worker].meter : nullptr;
+    unsigned spin_us = meter ? m_polling.spin_us : 0;
+    auto& timers = unsigned(_worker) < m_workers ? m_worker[_worker].timers : m_timers;
+    auto& tasks = unsigned(_worker) < m_workers ? m_worker[_worker].tasks : m_tasks;
+    int64_t last_migration = 0;
+    bool more_tasks = false;
+
+    std::vector<int> listeners;
+    for (auto& [fd, w]: m_listeners)
+        if (int(w) == _worker)
+            listeners.push_back(fd);
+
     for (;;)
     {
+        // with migration enabled workers wake up to check for idle fds, and for the next timer
+
+        bool draining = load && m_draining.load(std::memory_order_relaxed);
+        unsigned idle_ms = load && !draining ? m_idle_ms.load(std::memory_order_relaxed) : 0;
+        int wait = _timeout > 0 ? _timeout : -1;
+        if (idle_ms > 0 && (wait == -1 || unsigned(wait) > idle_ms))
+            wait = static_cast<int>(idle_ms);
+
+        if (meter)
+            wait = meter->before(wait, spin_us);
+
+        wait = more_tasks ? 0 : timers.wait(wait);
+
         int result = 0; 
-        if (_timeout > 0)
+        if (wait >= 0)
         {
             timespec ts;
-            if (_timeout < 1000)
+            if (wait < 1000)
             {
                 ts.tv_sec = 0;
-                ts.tv_nsec = _timeout * 1000000;
+                ts.tv_nsec = wait * 1000000;
             }
             else
             {
-                ts.tv_sec = _timeout / 1000;
-                ts.tv_nsec = (_timeout - ts.tv_sec * 1000) * 1000000;
+                ts.tv_sec = wait / 1000;
+                ts.tv_nsec = (wait - ts.tv_sec * 1000) * 1000000;
             }
            
             result = kevent(_kq, 0, 0, events, num_events, &ts);
         }
         else
             result = kevent(_kq, 0, 0, events, num_events, nullptr);
+
+        timers.awake();
+
+        if (meter)
+            meter->after(wait, result);
+
+        if (load && result >= 0)
+        {
+            auto now = worker_load::now();
+            load->count(result, now);
+
+            if (idle_ms > 0)
+            {
+                load->lock.lock();
+                for (int i = 0; i < result; ++i)
+                    if (auto it = load->fds.find(static_cast<int>(events[i].ident)); it != load->fds.end())
+                        it->second.last = now;
+                load->lock.unlock();
+
+                if (now - last_migration >= idle_ms)
+                {
+                    last_migration = now;
+                    migrate(_worker, now);
+                }
+            }
+        }
             
         if (result < 0 && errno == EINTR)
             continue;
@@ -280,20 +750,35 @@ void event_loop::impl::process_events(int _kq, int _stopfd, int _worker, int _ti
         }
         else if (result == 0)
         {
-            if (m_timeout_fn)
+            if (m_timeout_fn && _timeout > 0 && wait == _timeout) // not a wake up for timers
                 m_timeout_fn(m_param, _worker);
-                
-            continue;
         }
 
         for (int i = 0; i < result; ++i)
         {
+            if (events[i].filter == EVFILT_USER)
+                continue;
+
             auto fd = static_cast<int>(events[i].ident);
             if (fd == _stopfd)
                 return;
 
+            if (!listeners.empty() && std::find(listeners.begin(), listeners.end(), fd) != listeners.end())
+            {
+                accept_all(fd, _worker);
+                continue;
+            }
+
+            t_fd = fd;
             process_fd(fd, events[i], _worker);
+            t_fd = -1;
         }
+
+        more_tasks = tasks.run(_worker);
+        timers.fire(_worker);
+
+        if (draining)
+            check_drained(_worker);
     }
 }
 
@@ -301,6 +786,13 @@ void event_loop::impl::process_events(int _kq, int _stopfd, int _worker, int _ti
 
 bool event_loop::impl::process_fd(int _fd, struct kevent& _ev, unsigned _worker)
 {
+    auto handler = static_cast<handler_t*>(_ev.udata);
+    auto fn = handler ? handler->fn : m_event_fn;
+    auto param = handler ? handler->param : m_param;
+
+    if (!fn)
+        return false;
+
     if (_ev.flags & EV_ERROR)
     {
         switch (_ev.data)
@@ -311,7 +803,10 @@ bool event_loop::impl::process_fd(int _fd, struct kevent& _ev, unsigned _worker)
             case EPERM:
             case EPIPE:
             {
-                m_event_fn(m_param, _fd, event_e::error, _worker);
+                if (_worker < m_workers)
+                    m_load[_worker].remove(_fd);
+
+                fn(param, _fd, event_e::error, _worker);
                 return false;
             }
         }
@@ -319,22 +814,167 @@ bool event_loop::impl::process_fd(int _fd, struct kevent& _ev, unsigned _worker)
     
     if(_ev.filter == EVFILT_READ) // ready to read
     {
-        m_event_fn(m_param, _fd, event_e::read, _worker);
+        // when drain_fd ran out of budget the rearmed filter comes again with EV_EOF,
+        // closed follows the last read
+        t_rearmed = false;
+        fn(param, _fd, event_e::read, _worker);
+        if (t_rearmed)
+            return true;
     }
     else if (_ev.filter == EVFILT_WRITE) // ready to write
     {
-        m_event_fn(m_param, _fd, event_e::write, _worker);
+        // the read filter reports eof too, after the data left to read
+        if (_ev.flags & EV_EOF)
+            return true;
+
+        fn(param, _fd, event_e::write, _worker);
     }
     
     if (_ev.flags & EV_EOF)
     {
-        m_event_fn(m_param, _fd, event_e::closed, _worker);
+        if (_worker < m_workers)
+            m_load[_worker].remove(_fd);
+
+        fn(param, _fd, event_e::closed, _worker);
         return false;
     }
     
     return true;
 }
 
+// ------------------------------------------------------------------------------------------
+// EV_CLEAR listener, accept until the backlog is empty
+
+void event_loop::impl::accept_all(int _fd, unsigned _worker)
+{
+    for (;;)
+    {
+#ifdef SOCK_NONBLOCK
+        int fd = ::accept4(_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC); // freebsd
+#else
+        int fd = ::accept(_fd, nullptr, nullptr);
+#endif
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return; // EAGAIN, or out of fds until some are closed
+        }
+
+#ifndef SOCK_NONBLOCK
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+        handler_t* handler = nullptr;
+        if (m_accept_fn && !m_accept_fn(m_accept_param, _fd, fd, _worker, &handler))
+        {
+            close(fd);
+            continue;
+        }
+
+        if (kqueue_add(m_worker[_worker].kqueue_fd, fd, true, handler))
+            m_load[_worker].add(fd, worker_load::now(), handler);
+        else
+            close(fd);
+    }
+}
+
+// ------------------------------------------------------------------------------------------
+// runs on the worker thread between batches, so moved fds have no events pending here
+
+void event_loop::impl::migrate(unsigned _worker, int64_t _now)
+{
+    auto target = least_loaded(m_load, m_workers, _now);
+    if (target == _worker)
+        return;
+
+    auto count = migration_count(m_load[_worker], m_load[target], _now);
+    if (count == 0)
+        return;
+
+    for (auto [fd, handler]: m_load[_worker].idle(_now - m_idle_ms, count))
+    {
+        if (m_migrate_fn && !m_migrate_fn(m_migrate_param, fd, handler, _worker, target))
+            continue;
+
+        if (!move(fd, handler, _worker, target, _now) && m_migrate_fn)
+            m_migrate_fn(m_migrate_param, fd, handler, target, _worker);
+    }
+}
+
+// remove_fd from another thread waits for the move and finds the fd on _to; false when the fd
+// stays on _from, re-added after a failed move
+
+bool event_loop::impl::move(int _fd, handler_t* _handler, unsigned _from, unsigned _to, int64_t _now)
+{
+    std::lock_guard<std::mutex> lock(m_moving);
+
+    if (!m_load[_from].remove(_fd))
+        return true; // removed meanwhile
+
+    if (!kqueue_remove(m_worker[_from].kqueue_fd, _fd))
+        return true; // closed without remove_fd
+
+    if (kqueue_add(m_worker[_to].kqueue_fd, _fd, true, _handler))
+    {
+        m_load[_to].add(_fd, _now, _handler);
+        m_load[_from].migrated.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (kqueue_add(m_worker[_from].kqueue_fd, _fd, true, _handler))
+        m_load[_from].add(_fd, _now, _handler);
+
+    return false;
+}
+
+// ------------------------------------------------------------------------------------------
+// completion based i/o needs io_uring backend
+
+[[noreturn]] static void completions_not_supported()
+{
+    throw std::runtime_error("kqueue backend doesn't support completions");
+}
+
+bool event_loop::completions_supported()
+{
+    return false;
+}
+
+void event_loop::on_complete(void*, on_complete_t)
+{
+    completions_not_supported();
+}
+
+void event_loop::accept(int)
+{
+    completions_not_supported();
+}
+
+void event_loop::accept(int, unsigned)
+{
+    completions_not_supported();
 }
 
+void event_loop::recv(int)
+{
+    completions_not_supported();
+}
 
+void event_loop::recv(int, unsigned)
+{
+    completions_not_supported();
+}
+
+void event_loop::send(int, const buffer&)
+{
+    completions_not_supported();
+}
+
+void event_loop::send(int, const buffer&, unsigned)
+{
+    completions_not_supported();
+}
+
+}
@@ -27,13 +27,20 @@
 #include <assert.h>
 #include <stddef.h>
 #include <string.h>
-#ifdef __SSE4_2__
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+/* SSE4.2 (AVX2 with EZ_HTTP_AVX2) path is selected at runtime, see findchar_init */
+#define PHR_SIMD_DISPATCH 1
+#include <immintrin.h>
+#elif defined(__SSE4_2__)
 #ifdef _MSC_VER
 #include <nmmintrin.h>
 #else
 #include <x86intrin.h>
 #endif
 #endif
+#if defined(PHR_SIMD_DISPATCH) || defined(__SSE4_2__)
+#define PHR_FINDCHAR 1
+#endif
 #include "picohttpparser.h"
 
 #if __GNUC__ >= 3
@@ -102,6 +109,118 @@ static const char *token_char_map = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
 
+#ifdef PHR_SIMD_DISPATCH
+
+typedef const char *(*findchar_fn)(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found);
+
+static const char *findchar_scalar(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+{
+    /* callers finish the scan byte by byte */
+    (void)buf_end;
+    (void)ranges;
+    (void)ranges_size;
+    *found = 0;
+    return buf;
+}
+
+__attribute__((target("sse4.2"))) static const char *findchar_sse42(const char *buf, const char *buf_end, const char *ranges,
+                                                                    size_t ranges_size, int *found)
+{
+    __m128i ranges16 = _mm_loadu_si128((const __m128i *)ranges);
+    size_t left = (buf_end - buf) & ~15;
+
+    *found = 0;
+    while (likely(left != 0)) {
+        __m128i b16 = _mm_loadu_si128((const __m128i *)buf);
+        int r = _mm_cmpestri(ranges16, ranges_size, b16, 16, _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
+        if (unlikely(r != 16)) {
+            *found = 1;
+            return buf + r;
+        }
+        buf += 16;
+        left -= 16;
+    }
+    return buf;
+}
+
+#if defined(EZ_HTTP_AVX2) || defined(EZ_HTTP_BENCH) /* the bench compares it either way */
+/* a byte is in [lo, hi] when (byte - lo) <= (hi - lo) unsigned, which is min(byte - lo, hi - lo) == byte - lo;
+ * one compare per range is cheaper than pcmpestri for the few ranges of request line and header values, long
+ * range sets (token chars) stay on pcmpestri; most tokens end within 16 bytes, so the first block is checked
+ * with pcmpestri too, before paying for the broadcasts */
+__attribute__((target("avx2"))) static const char *findchar_avx2(const char *buf, const char *buf_end, const char *ranges,
+                                                                 size_t ranges_size, int *found)
+{
+    if (ranges_size > 6 || buf_end - buf < 48)
+        return findchar_sse42(buf, buf_end, ranges, ranges_size, found);
+
+    int r = _mm_cmpestri(_mm_loadu_si128((const __m128i *)ranges), ranges_size, _mm_loadu_si128((const __m128i *)buf), 16,
+                         _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
+    if (r != 16) {
+        *found = 1;
+        return buf + r;
+    }
+    buf += 16;
+
+    /* unused slots repeat the first range so the loop body is fixed */
+    __m256i lo[3], span[3];
+    size_t i;
+
+    for (i = 0; i != 3; ++i) {
+        size_t r = i * 2 < ranges_size ? i * 2 : 0;
+        lo[i] = _mm256_set1_epi8(ranges[r]);
+        span[i] = _mm256_set1_epi8((char)((unsigned char)ranges[r + 1] - (unsigned char)ranges[r]));
+    }
+
+    *found = 0;
+    while (likely(buf_end - buf >= 32)) {
+        __m256i b32 = _mm256_loadu_si256((const __m256i *)buf);
+        __m256i d0 = _mm256_sub_epi8(b32, lo[0]), d1 = _mm256_sub_epi8(b32, lo[1]), d2 = _mm256_sub_epi8(b32, lo[2]);
+        __m256i match = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(d0, span[0]), d0),
+                                                        _mm256_cmpeq_epi8(_mm256_min_epu8(d1, span[1]), d1)),
+                                        _mm256_cmpeq_epi8(_mm256_min_epu8(d2, span[2]), d2));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(match);
+        if (unlikely(mask != 0)) {
+            *found = 1;
+            return buf + __builtin_ctz(mask);
+        }
+        buf += 32;
+    }
+    /* the remaining 16..31 bytes */
+    if (buf_end - buf >= 16)
+        return findchar_sse42(buf, buf_end, ranges, ranges_size, found);
+    return buf;
+}
+#endif
+
+static findchar_fn findchar_impl = findchar_scalar;
+
+/* sse4.2 by default: most tokens end within the first 16-48 bytes, where the avx2 setup doesn't pay
+ * off on common cpus; EZ_HTTP_AVX2 selects avx2 where bench_http_parse shows it faster */
+__attribute__((constructor)) static void findchar_init(void)
+{
+    __builtin_cpu_init();
+#ifdef EZ_HTTP_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        findchar_impl = findchar_avx2;
+        return;
+    }
+#endif
+    if (__builtin_cpu_supports("sse4.2"))
+        findchar_impl = findchar_sse42;
+}
+
+static inline const char *findchar_fast(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+{
+    if (buf_end - buf < 16) {
+        *found = 0;
+        return buf;
+    }
+    return findchar_impl(buf, buf_end, ranges, ranges_size, found);
+}
+
+#else
+
 static const char *findchar_fast(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
 {
     *found = 0;
@@ -131,11 +250,13 @@ static const char *findchar_fast(const char *buf, const char *buf_end, const cha
     return buf;
 }
 
+#endif
+
 static const char *get_token_to_eol(const char *buf, const char *buf_end, const char **token, size_t *token_len, int *ret)
 {
     const char *token_start = buf;
 
-#ifdef __SSE4_2__
+#ifdef PHR_FINDCHAR
     static const char ALIGNED(16) ranges1[16] = "\0\010"    /* allow HT */
                                                 "\012\037"  /* allow SP and up to but not including DEL */
                                                 "\177\177"; /* allow chars w. MSB set */
@@ -143,7 +264,8 @@ static const char *get_token_to_eol(const char *buf, const char *buf_end, const
     buf = findchar_fast(buf, buf_end, ranges1, 6, &found);
     if (found)
         goto FOUND_CTL;
-#else
+#endif
+#if !defined(PHR_FINDCHAR) || defined(PHR_SIMD_DISPATCH)
     /* find non-printable char within the next 8 bytes, this is the hottest code; manually inlined */
     while (likely(buf_end - buf >= 8)) {
 #define DOIT()                                                                                                                     \
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+
+#include <ez/events.hpp>
+#include <ez/spin_lock.hpp>
+
+namespace ez
+{
+    // load of one event_loop worker, shared by all backends; counters are written by
+    // the worker thread, fd set is touched by add/remove and migration from any thread
+
+    struct worker_load
+    {
+        std::atomic<uint64_t>   events {0};
+        std::atomic<uint64_t>   rate {0};           // events per second in the last full window
+        std::atomic<int64_t>    window_start {0};   // ms
+        std::atomic<uint64_t>   migrated {0};
+        uint64_t                window_events = 0;  // worker thread only
+
+        struct fd_state
+        {
+            int64_t                 last = 0;           // time of last event, ms
+            event_loop::handler_t*  handler = nullptr;  // kept when the fd migrates
+        };
+
+        spin_lock                           lock;
+        std::unordered_map<int, fd_state>   fds;
+
+        static int64_t now()
+        {
+            using namespace std::chrono;
+            return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+        }
+
+        void count(unsigned _events, int64_t _now)
+        {
+            events.fetch_add(_events, std::memory_order_relaxed);
+            window_events += _events;
+
+            auto start = window_start.load(std::memory_order_relaxed);
+            if (_now - start >= 1000)
+            {
+                rate.store(start == 0 ? 0 : window_events * 1000 / (_now - start), std::memory_order_relaxed);
+                window_start.store(_now, std::memory_order_relaxed);
+                window_events = 0;
+            }
+        }
+
+        // a worker waiting for events doesn't close its window, so old rate is dropped here
+
+        uint64_t current_rate(int64_t _now) const
+        {
+            if (_now - window_start.load(std::memory_order_relaxed) > 2000)
+                return 0;
+
+            return rate.load(std::memory_order_relaxed);
+        }
+
+        void add(int _fd, int64_t _now, event_loop::handler_t* _handler = nullptr)
+        {
+            lock.lock();
+            fds[_fd] = {_now, _handler};
+            lock.unlock();
+        }
+
+        bool remove(int _fd)
+        {
+            lock.lock();
+            bool found = fds.erase(_fd) > 0;
+            lock.unlock();
+            return found;
+        }
+
+        // handler the fd was added with, nullptr when it has none or isn't here
+
+        event_loop::handler_t* handler_of(int _fd)
+        {
+            lock.lock();
+            auto it = fds.find(_fd);
+            auto result = it != fds.end() ? it->second.handler : nullptr;
+            lock.unlock();
+            return result;
+        }
+
+        unsigned size()
+        {
+            lock.lock();
+            auto n = fds.size();
+            lock.unlock();
+            return static_cast<unsigned>(n);
+        }
+
+        // up to _count fds without events since _before
+
+        std::vector<std::pair<int, event_loop::handler_t*>> idle(int64_t _before, unsigned _count)
+        {
+            std::vector<std::pair<int, event_loop::handler_t*>> result;
+            lock.lock();
+            for (auto& [fd, state]: fds)
+            {
+                if (result.size() == _count)
+                    break;
+                if (state.last < _before)
+                    result.emplace_back(fd, state.handler);
+            }
+            lock.unlock();
+            return result;
+        }
+
+        event_loop::load_t stats(int64_t _now)
+        {
+            event_loop::load_t result;
+            result.fds = size();
+            result.events = events.load(std::memory_order_relaxed);
+            result.events_per_sec = current_rate(_now);
+            result.migrated = migrated.load(std::memory_order_relaxed);
+            return result;
+        }
+    };
+
+    // removes _fd from the table of the worker that has it, _worker first, and returns that
+    // worker, _count when none has it; migration moves fds holding _moving, so an fd moved
+    // after the caller got _worker is found on its new worker
+
+    inline unsigned detach_fd(worker_load* _loads, unsigned _count, std::mutex& _moving, int _fd, unsigned _worker)
+    {
+        if (_loads[_worker].remove(_fd))
+            return _worker;
+
+        std::lock_guard<std::mutex> lock(_moving);
+        unsigned w = 0;
+        while (w < _count && !_loads[w].remove(_fd))
+            ++w;
+
+        return w;
+    }
+
+    // event rate first, so hot connections repel new ones, then number of fds
+
+    inline bool less_loaded(worker_load& _a, worker_load& _b, int64_t _now)
+    {
+        auto ra = _a.current_rate(_now), rb = _b.current_rate(_now);
+        if (ra != rb)
+            return ra < rb;
+
+        return _a.size() < _b.size();
+    }
+
+    inline unsigned least_loaded(worker_load* _loads, unsigned _count, int64_t _now)
+    {
+        unsigned best = 0;
+        for (unsigned i = 1; i < _count; ++i)
+            if (less_loaded(_loads[i], _loads[best], _now))
+                best = i;
+
+        return best;
+    }
+
+    // fds to move from a busy worker to the least loaded one at a time, 0 when balanced
+
+    inline unsigned migration_count(worker_load& _from, worker_load& _to, int64_t _now)
+    {
+        unsigned from_fds = _from.size(), to_fds = _to.size(), n = 0;
+
+        if (_from.current_rate(_now) > 2 * _to.current_rate(_now) + 100) // hot, move idle ones away
+            n = from_fds / 2;
+        else if (from_fds > to_fds + 1)
+            n = (from_fds - to_fds) / 2;
+
+        return std::min(n, 64u);
+    }
+
+    inline unsigned pick_worker(worker_load* _loads, unsigned _count, event_loop::placement_e _policy)
+    {
+        auto now = worker_load::now();
+
+        if (_policy == event_loop::placement_e::least_loaded || _count < 3)
+            return least_loaded(_loads, _count, now);
+
+        // power of two choices: two random workers, the less loaded one wins
+
+        thread_local uint32_t seed = static_cast<uint32_t>(now) * 2654435761u + 1;
+        auto next = [] { seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5; return seed; };
+
+        unsigned a = next() % _count;
+        unsigned b = next() % (_count - 1);
+        if (b >= a)
+            ++b;
+
+        return less_loaded(_loads[a], _loads[b], now) ? a : b;
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include <ez/events.hpp>
+
+namespace ez
+{
+    // adaptive spinning of a loop: after its last event the loop polls without blocking for
+    // spin_us, then sleeps in the poller; time of both is counted, stats are read from any thread
+
+    struct poll_meter
+    {
+        std::atomic<uint64_t>   spin_ns {0};
+        std::atomic<uint64_t>   sleep_ns {0};
+        std::atomic<uint64_t>   spins {0};
+        std::atomic<uint64_t>   sleeps {0};
+
+        int64_t                 idle_since = 0; // ns, 0 after a poll with events; loop thread only
+        int64_t                 started = 0;
+        bool                    spinning = false;
+
+        static int64_t now()
+        {
+            using namespace std::chrono;
+            return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+        }
+
+        // timeout for the next poll, 0 while spinning
+
+        int before(int _wait, unsigned _spin_us)
+        {
+            started = now();
+            spinning = false;
+
+            if (_wait != 0 && _spin_us > 0)
+            {
+                if (idle_since == 0)
+                    idle_since = started;
+
+                if (started - idle_since < int64_t(_spin_us) * 1000)
+                {
+                    spinning = true;
+                    return 0;
+                }
+            }
+
+            return _wait;
+        }
+
+        void after(int _wait, int _events)
+        {
+            auto elapsed = static_cast<uint64_t>(now() - started);
+
+            if (spinning)
+            {
+                spin_ns.fetch_add(elapsed, std::memory_order_relaxed);
+                spins.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (_wait != 0)
+            {
+                sleep_ns.fetch_add(elapsed, std::memory_order_relaxed);
+                sleeps.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            if (_events > 0)
+                idle_since = 0;
+        }
+
+        event_loop::poll_stats_t stats() const
+        {
+            event_loop::poll_stats_t result;
+            result.spin_ns = spin_ns.load(std::memory_order_relaxed);
+            result.sleep_ns = sleep_ns.load(std::memory_order_relaxed);
+            result.spins = spins.load(std::memory_order_relaxed);
+            result.sleeps = sleeps.load(std::memory_order_relaxed);
+            return result;
+        }
+    };
+}
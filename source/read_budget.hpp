@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+
+#include <ez/buffer.hpp>
+
+namespace ez
+{
+    // reads an edge triggered fd until it would block, appending to _data; stops after _budget
+    // bytes and sets _more, the loop has to report the fd again then; result as event_loop::drain_fd
+
+    inline ssize_t read_budget(int _fd, buffer& _data, size_t _budget, bool& _more)
+    {
+        constexpr size_t chunk = 16 * 1024;
+
+        ssize_t total = 0;
+        _more = false;
+
+        for (;;)
+        {
+            if (size_t(total) >= _budget)
+            {
+                _more = true;
+                return total;
+            }
+
+            // capacity and set_size count from the start of the block, size() and ptr() from the
+            // read position
+
+            size_t want = std::min(chunk, _budget - size_t(total));
+            size_t end = _data.position() + _data.size();
+            if (_data.capacity() < end + want)
+                _data.reserve(end + want);
+
+            ssize_t n = ::read(_fd, _data.mutable_ptr() - _data.position() + end, want);
+            if (n > 0)
+            {
+                _data.set_size(end + n);
+                total += n;
+                continue;
+            }
+
+            if (n == 0)
+                return total;
+
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return total > 0 ? total : -2;
+
+            return total > 0 ? total : -1; // the error is reported again by the next read
+        }
+    }
+}
@@ -0,0 +1,495 @@
+#include <ez/resolver.hpp>
+#include "dns.hpp"
+#include "sockaddr.hpp"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+namespace ez {
+
+// ------------------------------------------------------------------------------------------
+
+static int64_t now_ms()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct resolver::impl
+{
+    // one resolve() call, waits for one lookup or two with any
+
+    struct request
+    {
+        on_resolve_t            fn = nullptr;
+        void*                   param = nullptr;
+        unsigned                pending = 0;
+        status_e                status = status_e::error;   // the best one of the lookups
+        std::vector<ip_address> addresses[2];               // v4, v6
+    };
+
+    // one name and type in flight, shared by the requests for it; its own socket, so an off-path
+    // answer has to guess a random source port as well as the id
+
+    struct query
+    {
+        impl*                   owner = nullptr;
+        std::string             key;    // type and name, as in the cache
+        std::string             name;
+        uint16_t                type = 0;
+        uint16_t                id = 0;
+        unsigned                tries = 0;
+        uint64_t                timer = 0;
+        event_loop::handler_t   socket;
+        int                     family = 0;     // of socket
+        std::vector<request*>   waiting;
+    };
+
+    struct entry
+    {
+        status_e                status;
+        std::vector<ip_address> addresses;
+        int64_t                 expires;    // ms
+    };
+
+    event_loop&                                 m_loop;
+    unsigned                                    m_worker;   // -1 for the main loop
+    config_t                                    m_config;
+    dns::hosts_t                                m_hosts;
+    std::unordered_map<std::string, entry>      m_cache;
+    std::unordered_map<std::string, query*>     m_pending;
+    std::mt19937                                m_random {std::random_device()()};
+
+    impl(event_loop& _loop, unsigned _worker): m_loop(_loop), m_worker(_worker)
+    {
+    }
+
+    bool lookup(request* _request, const std::string& _name, uint16_t _type);
+    void send(query& _query);
+    void finish(query* _query, status_e _status, const std::vector<ip_address>& _addresses, int64_t _ttl);
+    void complete(request* _request, uint16_t _type, status_e _status, const std::vector<ip_address>& _addresses);
+
+    bool open(query& _query, const ip_address& _server);
+    void close(query& _query);
+    void on_read(query& _query);
+
+    uint64_t schedule(unsigned _ms, query* _query);
+    void cancel(uint64_t _id);
+
+    // events of a socket closed for the next server's family are dropped
+
+    static void on_event(void* _query, int _fd, event_loop::event_e _ev, unsigned)
+    {
+        auto q = static_cast<query*>(_query);
+        if ((_ev == event_loop::event_e::read || _ev == event_loop::event_e::error) && _fd == q->socket.fd)
+            q->owner->on_read(*q);
+    }
+
+    static void on_timeout(void* _query, uint64_t, unsigned);
+
+    static std::string key(const std::string& _name, uint16_t _type)
+    {
+        return (_type == dns::a ? "4 " : "6 ") + _name;
+    }
+};
+
+// ------------------------------------------------------------------------------------------
+
+resolver::resolver(event_loop& _loop)
+{
+    m_impl = new impl(_loop, -1);
+}
+
+resolver::resolver(event_loop& _loop, unsigned _worker)
+{
+    m_impl = new impl(_loop, _worker);
+}
+
+resolver::~resolver()
+{
+    auto& _this = *m_impl;
+    bool running = _this.m_worker == unsigned(-1) || _this.m_worker < _this.m_loop.workers();
+
+    std::unordered_set<impl::request*> requests;
+    for (auto& [key, q]: _this.m_pending)
+    {
+        if (running && q->timer)
+            _this.cancel(q->timer);
+
+        if (running && q->socket.fd != -1)
+            _this.m_loop.remove_fd(q->socket.fd, _this.m_worker);
+        if (q->socket.fd != -1)
+            ::close(q->socket.fd);
+
+        requests.insert(q->waiting.begin(), q->waiting.end());
+        delete q;
+    }
+
+    for (auto r: requests)
+        delete r;
+
+    delete m_impl;
+}
+
+void resolver::init()
+{
+    init(config_t());
+}
+
+void resolver::init(const config_t& _config)
+{
+    auto& _this = *m_impl;
+    _this.m_config = _config;
+
+    if (_this.m_config.servers.empty())
+    {
+        auto conf = dns::read_resolv_conf(_config.resolv_conf);
+        _this.m_config.servers = conf.servers;
+        if (conf.timeout_ms)
+            _this.m_config.timeout_ms = conf.timeout_ms;
+        if (conf.attempts)
+            _this.m_config.attempts = conf.attempts;
+    }
+
+    if (_this.m_config.servers.empty())
+        _this.m_config.servers.push_back(ipv4_t(127, 0, 0, 1));
+
+    _this.m_hosts.clear();
+    if (!_config.hosts.empty())
+        _this.m_hosts = dns::read_hosts(_config.hosts);
+
+    _this.m_cache.clear();
+}
+
+bool resolver::resolve(std::string_view _name, query_e _query, void* _param, on_resolve_t _fn)
+{
+    auto& _this = *m_impl;
+
+    ip_address literal;
+    if (ip_address::parse(_name, literal))
+    {
+        bool match = _query == query_e::any || (_query == query_e::v4) == literal.is_v4();
+        _fn(_param, match ? status_e::ok : status_e::not_found, &literal, match ? 1 : 0, _this.m_worker);
+        return true;
+    }
+
+    unsigned lookups = _query == query_e::any ? 2 : 1;
+    auto r = new impl::request{_fn, _param, lookups, status_e::error, {}};
+    auto name = dns::normalize(_name);
+
+    // r is gone once its last lookup completes
+    unsigned done = 0;
+    if (_query != query_e::v6)
+        done += _this.lookup(r, name, dns::a);
+    if (_query != query_e::v4)
+        done += _this.lookup(r, name, dns::aaaa);
+
+    return done == lookups;
+}
+
+void resolver::clear_cache()
+{
+    m_impl->m_cache.clear();
+}
+
+size_t resolver::cached() const
+{
+    return m_impl->m_cache.size();
+}
+
+// ------------------------------------------------------------------------------------------
+// hosts, the cache, a query in flight or a new one; true when completed right away
+
+bool resolver::impl::lookup(request* _request, const std::string& _name, uint16_t _type)
+{
+    auto family = _type == dns::a ? ip_address::family_e::v4 : ip_address::family_e::v6;
+
+    if (auto it = m_hosts.find(_name); it != m_hosts.end())
+    {
+        std::vector<ip_address> addresses;
+        for (auto& a: it->second)
+            if (a.family == family)
+                addresses.push_back(a);
+
+        if (!addresses.empty())
+        {
+            complete(_request, _type, status_e::ok, addresses);
+            return true;
+        }
+    }
+
+    auto k = key(_name, _type);
+
+    if (auto it = m_cache.find(k); it != m_cache.end())
+    {
+        if (it->second.expires > now_ms())
+        {
+            auto e = it->second; // the callback may clear the cache
+            complete(_request, _type, e.status, e.addresses);
+            return true;
+        }
+
+        m_cache.erase(it);
+    }
+
+    if (auto it = m_pending.find(k); it != m_pending.end())
+    {
+        it->second->waiting.push_back(_request);
+        return false;
+    }
+
+    uint8_t message[dns::max_udp];
+    if (dns::make_query(message, 0, _name, _type) == 0)
+    {
+        complete(_request, _type, status_e::error, {});
+        return true;
+    }
+
+    auto q = new query;
+    q->owner = this;
+    q->key = k;
+    q->name = _name;
+    q->type = _type;
+    q->id = static_cast<uint16_t>(m_random());
+    q->socket.fn = on_event;
+    q->socket.param = q;
+    q->waiting.push_back(_request);
+
+    m_pending[k] = q;
+
+    send(*q);
+    return false;
+}
+
+// to the next server, the same id for all tries, so a late answer of the previous one is taken too;
+// a failed send is retried on timeout
+
+void resolver::impl::send(query& _query)
+{
+    auto& server = m_config.servers[_query.tries % m_config.servers.size()];
+    ++_query.tries;
+
+    uint8_t message[dns::max_udp];
+    auto size = dns::make_query(message, _query.id, _query.name, _query.type);
+
+    if (open(_query, server))
+    {
+        sockaddr_storage sa;
+        auto length = to_sockaddr(server, m_config.port, sa);
+        ::sendto(_query.socket.fd, message, size, 0, reinterpret_cast<sockaddr*>(&sa), length);
+    }
+
+    _query.timer = schedule(m_config.timeout_ms, &_query);
+}
+
+void resolver::impl::on_timeout(void* _query, uint64_t, unsigned)
+{
+    auto q = static_cast<query*>(_query);
+    auto _this = q->owner;
+    q->timer = 0;
+
+    if (q->tries < _this->m_config.attempts * _this->m_config.servers.size())
+        _this->send(*q);
+    else
+        _this->finish(q, status_e::timeout, {}, 0);
+}
+
+// the query is out of the maps before the callbacks run, they may resolve again; its socket
+// handler has to outlive the current batch, so it's deleted from a posted task
+
+void resolver::impl::finish(query* _query, status_e _status, const std::vector<ip_address>& _addresses, int64_t _ttl)
+{
+    if (_query->timer)
+        cancel(_query->timer);
+
+    m_pending.erase(_query->key);
+    close(*_query);
+
+    if (_ttl > 0 && (_status == status_e::ok || _status == status_e::not_found))
+    {
+        auto now = now_ms();
+        if (m_cache.size() >= m_config.max_entries)
+        {
+            for (auto it = m_cache.begin(); it != m_cache.end(); )
+                it = it->second.expires <= now ? m_cache.erase(it) : std::next(it);
+
+            while (!m_cache.empty() && m_cache.size() >= m_config.max_entries)
+                m_cache.erase(m_cache.begin());
+        }
+
+        if (m_config.max_entries > 0)
+            m_cache[_query->key] = entry{_status, _addresses, now + _ttl * 1000};
+    }
+
+    auto type = _query->type;
+    auto waiting = std::move(_query->waiting);
+
+    auto release = [](void* _q, unsigned) { delete static_cast<query*>(_q); };
+    if (m_worker == unsigned(-1))
+        m_loop.post(_query, release);
+    else
+        m_loop.post(_query, release, m_worker);
+
+    for (auto r: waiting)
+        complete(r, type, _status, _addresses);
+}
+
+void resolver::impl::complete(request* _request, uint16_t _type, status_e _status, const std::vector<ip_address>& _addresses)
+{
+    auto& r = *_request;
+    r.status = std::min(r.status, _status); // ok, not found, timeout, error
+    if (_status == status_e::ok)
+        r.addresses[_type == dns::a ? 0 : 1] = _addresses;
+
+    if (--r.pending > 0)
+        return;
+
+    const ip_address* addresses = nullptr;
+    std::vector<ip_address> both;
+
+    if (r.addresses[1].empty())
+        addresses = r.addresses[0].data();
+    else if (r.addresses[0].empty())
+        addresses = r.addresses[1].data();
+    else
+    {
+        both = r.addresses[0];
+        both.insert(both.end(), r.addresses[1].begin(), r.addresses[1].end());
+        addresses = both.data();
+    }
+
+    size_t count = r.addresses[0].size() + r.addresses[1].size();
+    r.fn(r.param, count > 0 ? status_e::ok : r.status, addresses, count, m_worker);
+    delete _request;
+}
+
+// ------------------------------------------------------------------------------------------
+
+void resolver::impl::on_read(query& _query)
+{
+    uint8_t message[4096];
+
+    for (;;)
+    {
+        sockaddr_storage from;
+        socklen_t from_length = sizeof(from);
+
+        auto n = ::recvfrom(_query.socket.fd, message, sizeof(message), 0, reinterpret_cast<sockaddr*>(&from), &from_length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break; // would block, or an icmp error of an earlier send
+        }
+
+        if (n < 12)
+            continue;
+
+        // from the port of a server the query went to, servers are tried in turn
+
+        uint16_t port = 0;
+        auto source = from_sockaddr(from, &port);
+        auto tried = std::min<size_t>(_query.tries, m_config.servers.size());
+        auto end = m_config.servers.begin() + tried;
+
+        if (port != m_config.port || std::find(m_config.servers.begin(), end, source) == end)
+            continue;
+
+        dns::answer_t answer;
+        if (!dns::parse_response(message, size_t(n), _query.id, _query.name, _query.type, answer))
+            continue;
+
+        if (!answer.addresses.empty())
+            finish(&_query, status_e::ok, answer.addresses, std::min<int64_t>(answer.ttl, m_config.max_ttl));
+        else if (answer.rcode == dns::name_error || (answer.rcode == dns::no_error && !answer.truncated))
+        {
+            int64_t ttl = answer.ttl == ~0u ? m_config.negative_ttl : std::min<int64_t>(answer.ttl, m_config.max_ttl);
+            finish(&_query, status_e::not_found, {}, ttl);
+        }
+        else if (_query.tries < m_config.attempts * m_config.servers.size())
+        {
+            // server failure, refused or truncated without addresses: the next server right away
+            cancel(_query.timer);
+            send(_query);
+            continue;
+        }
+        else
+            finish(&_query, status_e::error, {}, 0);
+
+        return; // finished
+    }
+}
+
+// a fresh socket for every query, the kernel picks a random ephemeral port for it; kept for
+// the next server of the same family, so late answers of the previous one are taken too
+
+bool resolver::impl::open(query& _query, const ip_address& _server)
+{
+    int family = _server.is_v4() ? AF_INET : AF_INET6;
+    if (_query.socket.fd != -1 && _query.family == family)
+        return true;
+
+    close(_query);
+
+#ifdef SOCK_NONBLOCK
+    int fd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#else
+    int fd = ::socket(family, SOCK_DGRAM, 0);
+    if (fd != -1)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if (fd == -1)
+        return false;
+
+    _query.socket.fd = fd;
+    _query.family = family;
+
+    if (m_worker == unsigned(-1))
+        m_loop.add_fd(&_query.socket);
+    else
+        m_loop.add_fd(&_query.socket, m_worker);
+
+    return true;
+}
+
+void resolver::impl::close(query& _query)
+{
+    if (_query.socket.fd == -1)
+        return;
+
+    m_loop.remove_fd(_query.socket.fd, m_worker);
+    ::close(_query.socket.fd);
+    _query.socket.fd = -1;
+}
+
+uint64_t resolver::impl::schedule(unsigned _ms, query* _query)
+{
+    if (m_worker == unsigned(-1))
+        return m_loop.schedule(_ms, _query, on_timeout);
+
+    return m_loop.schedule(_ms, _query, on_timeout, m_worker);
+}
+
+void resolver::impl::cancel(uint64_t _id)
+{
+    if (m_worker == unsigned(-1))
+        m_loop.cancel(_id);
+    else
+        m_loop.cancel(_id, m_worker);
+}
+
+}
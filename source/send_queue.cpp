@@ -0,0 +1,80 @@
+
+#include "send_queue.hpp"
+
+namespace ez {
+
+constexpr int max_iov = 64;
+
+void send_queue::push(const buffer& _data)
+{
+    if (_data.size() > 0)
+        m_items.push_back({ _data, -1, 0, _data.size() });
+}
+
+void send_queue::push_file(int _fd, off_t _offset, size_t _size)
+{
+    if (_size > 0)
+        m_items.push_back({ buffer(), _fd, _offset, _size });
+}
+
+bool send_queue::empty() const
+{
+    return m_head == m_items.size();
+}
+
+void send_queue::clear()
+{
+    m_items.clear();
+    m_head = 0;
+    m_offset = 0;
+}
+
+// ------------------------------------------------------------------------------------------
+
+bool send_queue::flush(channel& _ch)
+{
+    iovec iov[max_iov];
+    while (!empty())
+    {
+        ssize_t sz = 0;
+        if (auto& front = m_items[m_head]; front.fd != -1)
+        {
+            sz = _ch.send_file(front.fd, front.offset + m_offset, front.size - m_offset);
+        }
+        else
+        {
+            int count = 0;
+            for (auto i = m_head; i < m_items.size() && m_items[i].fd == -1 && count < max_iov; ++i, ++count)
+            {
+                auto skip = (i == m_head) ? m_offset : 0;
+                iov[count].iov_base = m_items[i].data.ptr() + skip;
+                iov[count].iov_len = m_items[i].size - skip;
+            }
+
+            sz = _ch.send(iov, count);
+        }
+
+        if (sz <= 0)
+            return false; // would block or closed, continue in send_more()
+
+        size_t sent = static_cast<size_t>(sz);
+        while (sent > 0)
+        {
+            auto left = m_items[m_head].size - m_offset;
+            if (sent < left)
+            {
+                m_offset += sent;
+                break;
+            }
+
+            sent -= left;
+            m_offset = 0;
+            ++m_head;
+        }
+    }
+
+    clear();
+    return true;
+}
+
+}
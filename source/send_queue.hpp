@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+
+#include <ez/buffer.hpp>
+#include <ez/channel.hpp>
+
+namespace ez
+{
+    // ordered list of buffers and file ranges sent with gather writes and sendfile;
+    // keeps references instead of copying and tracks progress by offset, so positions
+    // of the queued buffers are not touched
+
+    class send_queue
+    {
+        public:
+
+            void push(const buffer& _data);
+            void push_file(int _fd, off_t _offset, size_t _size); // fd must stay open until sent
+            bool flush(channel& _ch); // true when everything is sent
+            bool empty() const;
+            void clear();
+
+        private:
+
+            struct item
+            {
+                buffer data;
+                int    fd = -1;
+                off_t  offset = 0;
+                size_t size = 0;
+            };
+
+            std::vector<item> m_items;
+            size_t m_head = 0;
+            size_t m_offset = 0;
+    };
+}
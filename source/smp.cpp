@@ -3,6 +3,7 @@
 
 #include <ez/smp.hpp>
 #include <ez/buffer.hpp>
+#include "send_queue.hpp"
 
 #define MAX_HEADER 1024*1024*10
 #define MAX_DATA 1024*1024*10
@@ -16,6 +17,7 @@ struct smp::impl
     buffer          m_header;
     buffer          m_body;
     buffer          m_send_buffer;
+    send_queue      m_send_queue;       // meta, header and body slices, sent with one gather write
     bool            m_new_header = false;
     char            m_meta[12];
     uint32_t        m_header_size = 0;
@@ -29,6 +31,7 @@ struct smp::impl
 
     void reset();
     void send_more();
+    void flush();
     smp::message_t recv();
     void send(const buffer& _header, const buffer& _body);
 };
@@ -61,6 +64,8 @@ void smp::impl::reset()
         m_header = buffer(4096);
     m_new_header = false;
     m_body = buffer();
+    m_send_buffer = buffer();
+    m_send_queue.clear();
     m_header_size = 0;
     m_body_size = 0;
     m_header.set_position(0);
@@ -81,14 +86,15 @@ void smp::send_more()
 void smp::impl::send_more()
 {
     if (m_state == state_e::sending_data)
+        flush();
+}
+
+void smp::impl::flush()
+{
+    if (m_send_queue.flush(m_channel))
     {
-        if (auto sz = m_channel.send(m_send_buffer); sz == m_send_buffer.size())
-        {
-            m_state = state_e::send_complete;
-            m_send_buffer = buffer();
-        }
-        else if (sz > 0)
-            m_send_buffer.set_position(m_send_buffer.position() + sz);
+        m_state = state_e::send_complete;
+        m_send_buffer = buffer();
     }
 }
 
@@ -112,24 +118,18 @@ void smp::impl::send(const buffer& _header, const buffer& _body)
     if (body_size > MAX_DATA)
         throw error("invalid body size");
 
-    // todo send separately
-
-    m_send_buffer = buffer(12 + header_size + body_size);
+    m_send_buffer = buffer(12, buffer::uninitialized);
 
     memcpy(m_send_buffer.ptr(), MAGIC, 4);
     memcpy(m_send_buffer.ptr()+4, &header_size, 4);
     memcpy(m_send_buffer.ptr()+8, &body_size, 4);
-    memcpy(m_send_buffer.ptr()+12, _header.ptr(), _header.size());
-    if (body_size > 0)
-        memcpy(m_send_buffer.ptr()+12+header_size, _body.ptr(), _body.size());
 
-    if(auto sz = m_channel.send(m_send_buffer); sz == m_send_buffer.size())
-    {
-        m_state = state_e::send_complete;
-        m_send_buffer = buffer();
-    }
-    else if (sz > 0)
-        m_send_buffer.set_position(m_send_buffer.position() + sz);
+    m_send_queue.clear();
+    m_send_queue.push(m_send_buffer);
+    m_send_queue.push(_header);
+    m_send_queue.push(_body);
+
+    flush();
 }
 
 // ------------------------------------------------------------------------------------------
@@ -177,7 +177,10 @@ smp::message_t smp::impl::recv()
                     throw error("smp: wrong data format");
             }
             else if (sz > 0)
+            {
                 m_header.set_position(m_header.position() + sz);
+                return smp::message_t();
+            }
             else // would block
                 return smp::message_t();
 
@@ -192,7 +195,10 @@ smp::message_t smp::impl::recv()
                 m_header.set_size(m_header_size); // shrink buffer
             }
             else if (sz > 0)
+            {
                 m_header.set_position(m_header.position() + sz);
+                return smp::message_t();
+            }
             else // would block
                 return smp::message_t();
 
@@ -218,7 +224,10 @@ smp::message_t smp::impl::recv()
                 return { m_header, m_body };
             }
             else if (sz > 0)
+            {
                 m_body.set_position(m_body.position() + sz);
+                return smp::message_t();
+            }
             else // would block
                 return smp::message_t();
         }
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <ez/ip.hpp>
+
+#if defined(__APPLE__) || defined(__linux__)
+#include <sys/socket.h>
+#endif
+
+namespace ez
+{
+    // ip_address and port to and from what the system calls take, defined in ip.cpp; a v6
+    // address keeps its scope, a v4 mapped one comes back as v4; _port may be nullptr
+
+    socklen_t to_sockaddr(const ip_address& _address, uint16_t _port, sockaddr_storage& _sa);
+    ip_address from_sockaddr(const sockaddr_storage& _sa, uint16_t* _port = nullptr);
+}
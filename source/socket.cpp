@@ -25,6 +25,13 @@
 #include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <limits.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <linux/filter.h>
+#endif
 
 #elif defined(WIN32)
 
@@ -53,6 +60,11 @@ static wsa_startup wsa;
 
 #include <ez/socket.hpp>
 #include <ez/buffer.hpp>
+#include "sockaddr.hpp"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 bool would_block()
 {
@@ -81,6 +93,18 @@ bool connection_reset()
 
 // ------------------------------------------------------------------------------------------
 
+static int tcp_socket(const ez::ip_address& _address)
+{
+    int family = _address.is_v4() ? AF_INET : AF_INET6;
+#ifdef SOCK_CLOEXEC
+    return ::socket(family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+#else
+    return ::socket(family, SOCK_STREAM, IPPROTO_TCP);
+#endif
+}
+
+// ------------------------------------------------------------------------------------------
+
 namespace ez {
 
 socket::socket()
@@ -256,9 +280,130 @@ ssize_t socket::send(const uint8_t* _data, size_t _size)
 
 // ------------------------------------------------------------------------------------------
 
+ssize_t socket::send(const iovec* _iov, int _count)
+{
+    if (_count <= 0)
+        return 0;
+
+    if (m_state != socket::state::connected)
+        throw socket::error("send fail: socket is not connected");
+
+#if defined(__APPLE__) || defined(__linux__)
+
+    msghdr msg{};
+    msg.msg_iov = const_cast<iovec*>(_iov);
+    msg.msg_iovlen = std::min(_count, IOV_MAX);
+
+    for (;;)
+    {
+        if (auto res = ::sendmsg(m_fd, &msg, SEND_FLAGS); res >= 0)
+        {
+            return res;
+        }
+        else if (res == -1)
+        {
+            if (would_block())
+            {
+                if (m_nonblocking)
+                    return -3;
+
+                throw timeout();
+            }
+            else if (errno == EINTR) // wait and try again
+            {
+                continue;
+            }
+            else if (connection_reset())
+            {
+                close();
+                if (m_nonblocking)
+                    return 0; // event_loop will report about close
+                else
+                    throw socket::error("socket: disconnected");
+            }
+            else
+            {
+                throw socket::error("socket: unknown error");
+            }
+        }
+    }
+
+#elif defined(WIN32)
+
+    for (int i = 0; i < _count; ++i)
+        if (_iov[i].iov_len > 0)
+            return send(reinterpret_cast<const uint8_t*>(_iov[i].iov_base), _iov[i].iov_len);
+
+    return 0;
+
+#endif
+}
+
+// ------------------------------------------------------------------------------------------
+// file is streamed by the kernel without copying it through user space
+
+ssize_t socket::send_file(int _fd, off_t _offset, size_t _size)
+{
+    if (_size == 0)
+        return 0;
+
+    if (m_state != socket::state::connected)
+        throw socket::error("send fail: socket is not connected");
+
+    for (;;)
+    {
+#if defined(__linux__)
+        off_t offset = _offset;
+        auto res = ::sendfile(m_fd, _fd, &offset, _size);
+#elif defined(__APPLE__)
+        off_t len = static_cast<off_t>(_size);
+        auto res = ::sendfile(_fd, m_fd, _offset, &len, nullptr, 0);
+        if (res == 0 || (len > 0 && would_block()))
+            res = len; // partial send is reported together with EAGAIN
+#else
+        uint8_t chunk[16384];
+        auto res = ::pread(_fd, chunk, std::min(_size, sizeof(chunk)), _offset);
+        if (res > 0)
+            return send(chunk, res);
+#endif
+        if (res >= 0)
+        {
+            return res;
+        }
+        else if (res == -1)
+        {
+            if (would_block())
+            {
+                if (m_nonblocking)
+                    return -3;
+
+                throw timeout();
+            }
+            else if (errno == EINTR) // wait and try again
+            {
+                continue;
+            }
+            else if (connection_reset())
+            {
+                close();
+                if (m_nonblocking)
+                    return 0; // event_loop will report about close
+                else
+                    throw socket::error("socket: disconnected");
+            }
+            else
+            {
+                throw socket::error("socket: sendfile error");
+            }
+        }
+    }
+}
+
+// ------------------------------------------------------------------------------------------
+
 ssize_t socket::recv(buffer& _destination, size_t _desired_size)
 {
-    return recv(_destination.ptr(), _destination.size(), _desired_size);
+    return recv(_destination.mutable_ptr(), _destination.size(), _desired_size);
 }
 
 ssize_t socket::recv(uint8_t* _data, size_t _size, size_t _desired_size)
@@ -313,27 +458,30 @@ ssize_t socket::recv(uint8_t* _data, size_t _size, size_t _desired_size)
 
 // ------------------------------------------------------------------------------------------
 
-socket socket::accept()
+socket socket::accept(ip_address* _peer, uint16_t* _peer_port)
 {
     if (m_state != socket::state::listening)
         throw socket::error("accept fail: socket is not listening");
 
-    sockaddr_in remoteAddr;
-    socklen_t addrlen = sizeof(sockaddr_in);
+    sockaddr_storage remote_addr;
 
     for (;;)
     {
+        socklen_t addrlen = sizeof(remote_addr);
 #ifdef SOCK_CLOEXEC
-        auto res = ::accept4(m_fd, reinterpret_cast<sockaddr*>(&remoteAddr), &addrlen, SOCK_CLOEXEC);
+        auto res = ::accept4(m_fd, reinterpret_cast<sockaddr*>(&remote_addr), &addrlen, SOCK_CLOEXEC);
 #else
-        auto res = ::accept(m_fd, reinterpret_cast<sockaddr*>(&remoteAddr), &addrlen);
+        auto res = ::accept(m_fd, reinterpret_cast<sockaddr*>(&remote_addr), &addrlen);
 #endif
         if (res >= 0)
         {
-            ipv4_t a;
-            a.S_addr = remoteAddr.sin_addr.s_addr;
-            //id_t id = { a , ntohs(remoteAddr.sin_port), _this.m_id.server_address, _this.m_id.server_port };
-            
+            if (_peer || _peer_port)
+            {
+                auto peer = from_sockaddr(remote_addr, _peer_port);
+                if (_peer)
+                    *_peer = peer;
+            }
+
             return socket(res, state::connected);
         }
         else if (res == -1)
@@ -357,21 +505,90 @@ socket socket::accept()
     }
 }
 
+// one accept4 per connection, no fcntl pair: the flags are set by the kernel
+
+size_t socket::accept(std::vector<socket>& _sockets, size_t _max, std::vector<peer_t>* _peers)
+{
+    if (m_state != socket::state::listening)
+        throw socket::error("accept fail: socket is not listening");
+
+    if (!m_nonblocking)
+        throw socket::error("accept fail: batch needs a non-blocking socket");
+
+    sockaddr_storage remote_addr;
+    size_t count = 0;
+
+    while (count < _max)
+    {
+        socklen_t addrlen = sizeof(remote_addr);
+#ifdef SOCK_NONBLOCK
+        auto res = ::accept4(m_fd, reinterpret_cast<sockaddr*>(&remote_addr), &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        auto res = ::accept(m_fd, reinterpret_cast<sockaddr*>(&remote_addr), &addrlen);
+        if (res >= 0)
+        {
+            fcntl(res, F_SETFL, fcntl(res, F_GETFL) | O_NONBLOCK);
+            fcntl(res, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (res >= 0)
+        {
+            _sockets.emplace_back(res, state::connected);
+            _sockets.back().m_nonblocking = true;
+
+            if (_peers)
+            {
+                _peers->emplace_back();
+                _peers->back().address = from_sockaddr(remote_addr, &_peers->back().port);
+            }
+
+            ++count;
+        }
+        else if (would_block())
+        {
+            break;
+        }
+        else if (errno == EINTR || errno == ECONNABORTED)
+        {
+            continue;
+        }
+        else if (count == 0)
+        {
+            auto s = std::string("error while accepting clients, errno=") + std::to_string(errno);
+            throw socket::error(s.c_str());
+        }
+        else
+        {
+            break; // out of fds and such come again with the next call
+        }
+    }
+
+    return count;
+}
+
 // ------------------------------------------------------------------------------------------
 
 void socket::listen(ipv4_t _address, uint16_t _port, size_t _max_clients, bool _share)
+{
+    listen(ip_address(_address), _port, _max_clients, _share);
+}
+
+void socket::listen(const ip_address& _address, uint16_t _port, size_t _max_clients, bool _share, bool _v6_only)
 {
     if (m_fd == -1)
     {
-#ifdef SOCK_CLOEXEC
-        m_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
-#else
-        m_fd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-#endif
+        m_fd = tcp_socket(_address);
         if (m_fd == -1)
             throw socket::error("can't create socket");
     }
 
+    if (_address.is_v6())
+    {
+        // the system default differs (linux: off, bsd: on), always set it
+        int set = _v6_only ? 1 : 0;
+        setsockopt(m_fd, IPPROTO_IPV6, IPV6_V6ONLY, (const char*) &set, sizeof(set));
+    }
+
     if (_share)
     {
         int set = 1;
@@ -381,12 +598,10 @@ void socket::listen(ipv4_t _address, uint16_t _port, size_t _max_clients, bool _
 #endif
     }
 
-    sockaddr_in local_addr{};
-    local_addr.sin_family = AF_INET;
-    local_addr.sin_port = htons(_port);
-    local_addr.sin_addr.s_addr = _address.S_addr;
+    sockaddr_storage local_addr;
+    auto addrlen = to_sockaddr(_address, _port, local_addr);
 
-    if (::bind(m_fd, reinterpret_cast<sockaddr*>(&local_addr), sizeof(sockaddr_in)) == -1)
+    if (::bind(m_fd, reinterpret_cast<sockaddr*>(&local_addr), addrlen) == -1)
     {
         throw socket::error("can't bind to selected address");
     }
@@ -401,6 +616,67 @@ void socket::listen(ipv4_t _address, uint16_t _port, size_t _max_clients, bool _
     m_state = socket::state::listening;
 }
 
+// ------------------------------------------------------------------------------------------
+// classic bpf program returns index of the socket in SO_REUSEPORT group: cpu % group size
+
+void socket::set_cpu_steering(unsigned _group_size)
+{
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (m_state != socket::state::listening || _group_size == 0)
+        throw socket::error("cpu steering needs a listening socket and group size");
+
+    sock_filter code[] =
+    {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, _group_size },
+        { BPF_RET | BPF_A, 0, 0, 0 }
+    };
+
+    sock_fprog prog{};
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    if (setsockopt(m_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+    {
+        std::string s = "can't attach reuseport program, errno=" + std::to_string(errno);
+        throw socket::error(s.c_str());
+    }
+#else
+    (void) _group_size;
+    throw socket::error("cpu steering is not supported");
+#endif
+}
+
+// ------------------------------------------------------------------------------------------
+// busy polling of the device queue on blocking reads and polls of this socket
+
+void socket::set_busy_poll(unsigned _usecs, bool _prefer)
+{
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    int usecs = static_cast<int>(_usecs);
+    if (setsockopt(m_fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+    {
+        std::string s = "can't set busy poll, errno=" + std::to_string(errno);
+        throw socket::error(s.c_str());
+    }
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+    int prefer = _prefer ? 1 : 0; // older kernels don't have it, only an error when asked for
+    if (setsockopt(m_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1 && _prefer)
+    {
+        std::string s = "can't set prefer busy poll, errno=" + std::to_string(errno);
+        throw socket::error(s.c_str());
+    }
+#else
+    (void) _usecs;
+    (void) _prefer;
+    throw socket::error("busy poll is not supported");
+#endif
+}
+
 // ------------------------------------------------------------------------------------------
 
 void socket::listen(std::string_view _adr, size_t _max_clients, bool _share)
@@ -476,27 +752,27 @@ void socket::set_close_on_exec()
 // ------------------------------------------------------------------------------------------
 
 void socket::connect(ipv4_t _address, uint16_t _port, unsigned _timeout, ipv4_t _bind_to)
+{
+    connect(ip_address(_address), _port, _timeout, ip_address(_bind_to));
+}
+
+void socket::connect(const ip_address& _address, uint16_t _port, unsigned _timeout, const ip_address& _bind_to)
 {
     if (m_fd == -1)
     {
-#ifdef SOCK_CLOEXEC
-        m_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
-#else
-        m_fd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-#endif
+        m_fd = tcp_socket(_address);
         if (m_fd == -1)
             throw socket::error("can't create socket");
     }
 
     auto fd = m_fd;
 
-    if (_bind_to.S_addr != 0)
+    if (!_bind_to.is_any())
     {
-        sockaddr_in local_addr{};
-        local_addr.sin_family = AF_INET;
-        local_addr.sin_addr.s_addr = _bind_to.S_addr;
+        sockaddr_storage local_addr;
+        auto addrlen = to_sockaddr(_bind_to, 0, local_addr);
 
-        if (bind(fd, (struct sockaddr*)&local_addr, sizeof(sockaddr_in)) == -1)
+        if (bind(fd, reinterpret_cast<sockaddr*>(&local_addr), addrlen) == -1)
         {
             throw std::runtime_error("can't bind to selected address");
         }
@@ -511,13 +787,10 @@ void socket::connect(ipv4_t _address, uint16_t _port, unsigned _timeout, ipv4_t
 
     m_state = socket::state::connecting;
 
-    sockaddr_in sin;
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = _address.S_addr; // adr->s_addr;
-    sin.sin_port = htons(_port);
+    sockaddr_storage sin;
+    auto addrlen = to_sockaddr(_address, _port, sin);
 
-    int res = ::connect(fd, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    int res = ::connect(fd, reinterpret_cast<sockaddr*>(&sin), addrlen);
 
     if (res == 0)
     {
@@ -656,14 +929,15 @@ void socket::connect(std::string_view _adr, unsigned _timeout)
 // ------------------------------------------------------------------------------------------
 
 void socket::connect_async(ipv4_t _address, uint16_t _port, ipv4_t _bind_to)
+{
+    connect_async(ip_address(_address), _port, ip_address(_bind_to));
+}
+
+void socket::connect_async(const ip_address& _address, uint16_t _port, const ip_address& _bind_to)
 {
     if (m_fd == -1)
     {
-#ifdef SOCK_CLOEXEC
-        m_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
-#else
-        m_fd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-#endif
+        m_fd = tcp_socket(_address);
         if (m_fd == -1)
             throw socket::error("can't create socket");
     }
@@ -671,6 +945,15 @@ void socket::connect_async(ipv4_t _address, uint16_t _port, ipv4_t _bind_to)
     auto fd = m_fd;
     if (m_state == socket::state::disconnected)
     {
+        if (!_bind_to.is_any())
+        {
+            sockaddr_storage local_addr;
+            auto addrlen = to_sockaddr(_bind_to, 0, local_addr);
+
+            if (bind(fd, reinterpret_cast<sockaddr*>(&local_addr), addrlen) == -1)
+                throw socket::error("can't bind to selected address");
+        }
+
         #if defined(__APPLE__)
             int set = 1;
             setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(set));
@@ -680,13 +963,10 @@ void socket::connect_async(ipv4_t _address, uint16_t _port, ipv4_t _bind_to)
         
         m_state = socket::state::connecting;
 
-        sockaddr_in sin;
-        memset(&sin, 0, sizeof(sin));
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = _address.S_addr; // adr->s_addr;
-        sin.sin_port = htons(_port);
+        sockaddr_storage sin;
+        auto addrlen = to_sockaddr(_address, _port, sin);
 
-        int res = ::connect(fd, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+        int res = ::connect(fd, reinterpret_cast<sockaddr*>(&sin), addrlen);
 
         if (res == 0)
         {
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+
+#include <ez/events.hpp>
+
+namespace ez
+{
+    // intrusive mpsc queue (D. Vyukov): push is a single exchange from any thread, the loop
+    // thread pops; the loop is woken up once until it drains the queue again
+
+    class task_queue
+    {
+        public:
+
+            static constexpr unsigned budget = 1024; // tasks per batch, so posting tasks can't starve i/o
+
+            task_queue() : m_head(&m_stub), m_tail(&m_stub) {}
+
+            ~task_queue()
+            {
+                while (auto n = pop())
+                    delete n;
+            }
+
+            task_queue(const task_queue&) = delete;
+
+            // true when the loop has to be woken up
+
+            bool push(void* _param, event_loop::task_t _fn)
+            {
+                auto n = new node;
+                n->param = _param;
+                n->fn = _fn;
+                link(n);
+
+                return !m_signaled.exchange(true);
+            }
+
+            // runs up to budget tasks, true when some are left
+
+            bool run(unsigned _worker)
+            {
+                m_signaled.exchange(false, std::memory_order_acq_rel); // pairs with push, sees its link
+
+                for (unsigned i = 0; i < budget; ++i)
+                {
+                    auto n = pop();
+                    if (n == nullptr)
+                        return false;
+
+                    auto fn = n->fn;
+                    auto param = n->param;
+                    delete n;
+
+                    fn(param, _worker);
+                }
+
+                return true;
+            }
+
+        private:
+
+            struct node
+            {
+                std::atomic<node*>  next {nullptr};
+                event_loop::task_t  fn = nullptr;
+                void*               param = nullptr;
+            };
+
+            void link(node* _n)
+            {
+                auto prev = m_head.exchange(_n, std::memory_order_acq_rel);
+                prev->next.store(_n, std::memory_order_release);
+            }
+
+            // nullptr when empty or a producer is between exchange and link, it wakes the loop then
+
+            node* pop()
+            {
+                auto tail = m_tail;
+                auto next = tail->next.load(std::memory_order_acquire);
+
+                if (tail == &m_stub)
+                {
+                    if (next == nullptr)
+                        return nullptr;
+
+                    m_tail = tail = next;
+                    next = next->next.load(std::memory_order_acquire);
+                }
+
+                if (next)
+                {
+                    m_tail = next;
+                    return tail;
+                }
+
+                if (tail != m_head.load(std::memory_order_acquire))
+                    return nullptr;
+
+                m_stub.next.store(nullptr, std::memory_order_relaxed);
+                link(&m_stub);
+
+                next = tail->next.load(std::memory_order_acquire);
+                if (next)
+                {
+                    m_tail = next;
+                    return tail;
+                }
+
+                return nullptr;
+            }
+
+            std::atomic<node*>  m_head;     // producers
+            node*               m_tail;     // loop thread
+            node                m_stub;
+            std::atomic<bool>   m_signaled {false};
+    };
+}
@@ -0,0 +1,320 @@
+#include "timer_wheel.hpp"
+
+#include <chrono>
+#include <climits>
+#include <algorithm>
+
+namespace ez {
+
+// ------------------------------------------------------------------------------------------
+
+timer_wheel::timer_wheel(int64_t _now) : m_nodes(due + 1), m_tick(_now)
+{
+    for (uint32_t i = 0; i <= due; ++i)
+        m_nodes[i].prev = m_nodes[i].next = i; // empty lists point to themselves
+}
+
+// ------------------------------------------------------------------------------------------
+
+uint64_t timer_wheel::schedule(int64_t _expires, event_loop::on_timer_t _fn, void* _param)
+{
+    uint32_t i = m_free;
+    if (i != nil)
+        m_free = m_nodes[i].next;
+    else
+    {
+        i = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.emplace_back();
+    }
+
+    auto& n = m_nodes[i];
+    n.expires = _expires;
+    n.fn = _fn;
+    n.param = _param;
+
+    insert(i);
+    ++m_size;
+
+    return (uint64_t(n.gen) << 32) | i;
+}
+
+bool timer_wheel::cancel(uint64_t _id)
+{
+    auto i = static_cast<uint32_t>(_id);
+    if (i <= due || i >= m_nodes.size())
+        return false;
+
+    auto& n = m_nodes[i];
+    if (n.list == nil || n.gen != uint32_t(_id >> 32))
+        return false;
+
+    unlink(i);
+    release(i);
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------
+
+bool timer_wheel::pop(int64_t _now, timer_t& _timer)
+{
+    if (m_nodes[due].next == due)
+        step(_now);
+
+    uint32_t i = m_nodes[due].next;
+    if (i == due)
+        return false;
+
+    auto& n = m_nodes[i];
+    _timer.id = (uint64_t(n.gen) << 32) | i;
+    _timer.fn = n.fn;
+    _timer.param = n.param;
+
+    unlink(i);
+    release(i);
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------
+// exact for the first level, upper levels give the time their slot is cascaded
+
+int64_t timer_wheel::next() const
+{
+    if (m_nodes[due].next != due)
+        return m_tick - 1;
+
+    if (m_size == 0)
+        return -1;
+
+    int64_t result = LLONG_MAX;
+
+    for (unsigned l = 0; l < levels; ++l)
+    {
+        if (m_used[l] == 0)
+            continue;
+
+        unsigned shift = bits * l;
+        unsigned cur = (m_tick >> shift) & (slots - 1);
+        int64_t base = (m_tick >> (shift + bits)) << (shift + bits);
+
+        // current slot of an upper level is cascaded when the levels below wrap
+        unsigned first = (l == 0 || (m_tick & ((int64_t(1) << shift) - 1)) == 0) ? cur : cur + 1;
+        uint64_t ahead = first < slots ? m_used[l] >> first : 0;
+
+        int64_t at;
+        if (ahead != 0)
+            at = base + (int64_t(first + __builtin_ctzll(ahead)) << shift);
+        else
+            at = base + (int64_t(1) << (shift + bits)) + (int64_t(__builtin_ctzll(m_used[l])) << shift);
+
+        result = std::min(result, at);
+    }
+
+    return result;
+}
+
+// ------------------------------------------------------------------------------------------
+// processes ticks up to _now until something is due, empty spans of the first level are skipped
+
+void timer_wheel::step(int64_t _now)
+{
+    while (m_nodes[due].next == due && m_tick <= _now)
+    {
+        if (m_size == 0)
+        {
+            m_tick = _now + 1;
+            return;
+        }
+
+        unsigned idx = m_tick & (slots - 1);
+
+        if (idx == 0)
+        {
+            for (unsigned l = 1; l < levels; ++l)
+            {
+                cascade(l);
+                if ((m_tick >> (bits * l)) & (slots - 1))
+                    break;
+            }
+        }
+
+        uint64_t ahead = m_used[0] >> idx;
+        if (ahead == 0)
+        {
+            // nothing happens before the next cascade of the first non empty level
+
+            unsigned l = 1;
+            while (m_used[l - 1] == 0 && l < levels - 1 && m_used[l] == 0)
+                ++l;
+
+            int64_t mask = (int64_t(1) << (bits * l)) - 1;
+            m_tick = std::min((m_tick | mask) + 1, _now + 1);
+            continue;
+        }
+
+        if (auto skip = __builtin_ctzll(ahead); skip > 0)
+        {
+            m_tick = std::min(m_tick + skip, _now + 1);
+            continue;
+        }
+
+        for (uint32_t head = idx, i = m_nodes[head].next; i != head; i = m_nodes[head].next)
+        {
+            unlink(i);
+            link(i, due);
+        }
+
+        ++m_tick;
+    }
+}
+
+void timer_wheel::cascade(unsigned _level)
+{
+    uint32_t head = _level * slots + ((m_tick >> (bits * _level)) & (slots - 1));
+
+    // detached first, a parked timer may go back to the same slot
+
+    uint32_t i = m_nodes[head].next;
+    if (i == head)
+        return;
+
+    m_nodes[m_nodes[head].prev].next = nil;
+    m_nodes[head].prev = m_nodes[head].next = head;
+    m_used[_level] &= ~(uint64_t(1) << (head % slots));
+
+    while (i != nil)
+    {
+        uint32_t next = m_nodes[i].next;
+        insert(i);
+        i = next;
+    }
+}
+
+// ------------------------------------------------------------------------------------------
+
+void timer_wheel::insert(uint32_t _i)
+{
+    constexpr int64_t range = int64_t(1) << (bits * levels);
+
+    int64_t expires = std::max(m_nodes[_i].expires, m_tick);
+    int64_t delta = expires - m_tick;
+
+    unsigned l = 0;
+    while (l < levels - 1 && delta >= (int64_t(1) << (bits * (l + 1))))
+        ++l;
+
+    if (delta >= range)
+        expires = m_tick + range - 1; // parked, placed again on cascade
+
+    unsigned slot = (expires >> (bits * l)) & (slots - 1);
+    link(_i, l * slots + slot);
+    m_used[l] |= uint64_t(1) << slot;
+}
+
+void timer_wheel::link(uint32_t _i, uint32_t _list)
+{
+    auto& head = m_nodes[_list];
+    auto& n = m_nodes[_i];
+
+    n.list = _list;
+    n.prev = head.prev;
+    n.next = _list;
+    m_nodes[head.prev].next = _i;
+    head.prev = _i;
+}
+
+void timer_wheel::unlink(uint32_t _i)
+{
+    auto& n = m_nodes[_i];
+    m_nodes[n.prev].next = n.next;
+    m_nodes[n.next].prev = n.prev;
+
+    if (n.list < due && m_nodes[n.list].next == n.list)
+        m_used[n.list / slots] &= ~(uint64_t(1) << (n.list % slots));
+
+    n.list = nil;
+}
+
+void timer_wheel::release(uint32_t _i)
+{
+    auto& n = m_nodes[_i];
+    if (++n.gen == 0)
+        n.gen = 1;
+
+    n.fn = nullptr;
+    n.param = nullptr;
+    n.next = m_free;
+    m_free = _i;
+    --m_size;
+}
+
+// ------------------------------------------------------------------------------------------
+
+int64_t loop_timers::now()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t loop_timers::schedule(unsigned _ms, event_loop::on_timer_t _fn, void* _param, bool& _wake)
+{
+    auto expires = now() + _ms;
+
+    lock.lock();
+    auto id = wheel.schedule(expires, _fn, _param);
+    auto wake = wake_at.load(std::memory_order_relaxed);
+    lock.unlock();
+
+    _wake = wake != 0 && expires < wake;
+    return id;
+}
+
+bool loop_timers::cancel(uint64_t _id)
+{
+    lock.lock();
+    bool result = wheel.cancel(_id);
+    lock.unlock();
+    return result;
+}
+
+int loop_timers::wait(int _timeout)
+{
+    auto t = now();
+
+    lock.lock();
+    auto next = wheel.next();
+
+    int result = _timeout;
+    if (next != -1)
+    {
+        auto ms = std::min<int64_t>(std::max<int64_t>(next - t, 0), INT_MAX);
+        if (result < 0 || ms < result)
+            result = static_cast<int>(ms);
+    }
+
+    wake_at.store(result < 0 ? LLONG_MAX : t + result, std::memory_order_relaxed);
+    lock.unlock();
+
+    return result;
+}
+
+// callbacks run without the lock, so they can schedule and cancel timers
+
+void loop_timers::fire(unsigned _worker)
+{
+    auto t = now();
+    timer_wheel::timer_t timer;
+
+    for (;;)
+    {
+        lock.lock();
+        bool found = wheel.pop(t, timer);
+        lock.unlock();
+
+        if (!found)
+            break;
+
+        timer.fn(timer.param, timer.id, _worker);
+    }
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include <ez/events.hpp>
+#include <ez/spin_lock.hpp>
+
+namespace ez
+{
+    // hierarchical timer wheel with 1 ms ticks: 5 levels of 64 slots cover ~12 days,
+    // later timers are parked in the last level and placed again when it cascades;
+    // schedule and cancel are O(1), a timer is cascaded at most once per level
+
+    class timer_wheel
+    {
+        public:
+
+            struct timer_t
+            {
+                uint64_t                id = 0;
+                event_loop::on_timer_t  fn = nullptr;
+                void*                   param = nullptr;
+            };
+
+            explicit timer_wheel(int64_t _now = 0);
+
+            uint64_t schedule(int64_t _expires, event_loop::on_timer_t _fn, void* _param); // ms, returns id
+            bool cancel(uint64_t _id);  // false when fired already or unknown
+
+            // next expired timer up to _now, it is removed from the wheel;
+            // timers scheduled while firing are not due before the next tick
+
+            bool pop(int64_t _now, timer_t& _timer);
+
+            // earliest time something is due, may be a cascade only, -1 when empty
+
+            int64_t next() const;
+
+            size_t size() const { return m_size; }
+
+        private:
+
+            static constexpr unsigned bits = 6;
+            static constexpr unsigned slots = 1u << bits;
+            static constexpr unsigned levels = 5;
+            static constexpr uint32_t due = levels * slots; // list of popped slots
+            static constexpr uint32_t nil = ~0u;
+
+            struct node
+            {
+                uint32_t                prev = nil;
+                uint32_t                next = nil;
+                uint32_t                gen = 1;
+                uint32_t                list = nil;     // slot or due, nil when free
+                int64_t                 expires = 0;
+                event_loop::on_timer_t  fn = nullptr;
+                void*                   param = nullptr;
+            };
+
+            void insert(uint32_t _i);
+            void link(uint32_t _i, uint32_t _list);
+            void unlink(uint32_t _i);
+            void release(uint32_t _i);
+            void cascade(unsigned _level);
+            void step(int64_t _now);
+
+            std::vector<node>       m_nodes;            // list heads first, then timers
+            uint32_t                m_free = nil;
+            uint64_t                m_used[levels] = {};  // bitmap of non empty slots
+            int64_t                 m_tick;             // next tick to process
+            size_t                  m_size = 0;
+    };
+
+    // timers of one loop; the wheel is owned by the loop thread, others schedule and cancel
+    // under the lock and wake the loop when a new timer is due before it plans to wake up
+
+    struct loop_timers
+    {
+        spin_lock               lock;
+        timer_wheel             wheel {now()};
+        std::atomic<int64_t>    wake_at {0};    // 0 while the loop is awake
+
+        static int64_t now();
+
+        uint64_t schedule(unsigned _ms, event_loop::on_timer_t _fn, void* _param, bool& _wake);
+        bool cancel(uint64_t _id);
+
+        // poll timeout, ms, shortened to the next timer, -1 for infinite
+
+        int wait(int _timeout);
+        void awake() { wake_at.store(0, std::memory_order_relaxed); }
+        void fire(unsigned _worker);
+    };
+}
@@ -1,6 +1,10 @@
 
 #include <ez/tls.hpp>
 #include <memory>
+#include <algorithm>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <tls.h>
 #include <tls_internal.h>
@@ -235,6 +239,87 @@ ssize_t tls::send(const uint8_t* _data, size_t _size)
     return _this.send(_data, _size);
 }
 
+// gathered slices are coalesced into one record instead of a record per slice
+
+ssize_t tls::send(const iovec* _iov, int _count)
+{
+    auto& _this = get(&m_impl);
+
+    constexpr size_t record_size = 16384;
+    thread_local uint8_t record[record_size];
+
+    size_t used = 0;
+    for (int i = 0; i < _count && used < record_size; ++i)
+    {
+        auto len = _iov[i].iov_len;
+        if (len == 0)
+            continue;
+
+        if (used == 0 && len >= record_size) // big slice, no need to copy
+            return _this.send(reinterpret_cast<const uint8_t*>(_iov[i].iov_base), len);
+
+        auto n = std::min(len, record_size - used);
+        memcpy(record + used, _iov[i].iov_base, n);
+        used += n;
+    }
+
+    if (used == 0)
+        return 0;
+
+    return _this.send(record, used);
+}
+
+// ------------------------------------------------------------------------------------------
+// records have to be encrypted in user space, so file is mapped and written in chunks
+
+ssize_t tls::send_file(int _fd, off_t _offset, size_t _size)
+{
+    auto& _this = get(&m_impl);
+
+    constexpr size_t window_size = 1024*1024;
+    constexpr size_t chunk_size = 16384;
+
+    if (_size == 0)
+        return 0;
+
+    static const off_t page = sysconf(_SC_PAGESIZE);
+    auto aligned = _offset - (_offset % page);
+    auto skip = static_cast<size_t>(_offset - aligned);
+    auto length = std::min(_size, window_size);
+
+    auto map = mmap(nullptr, length + skip, PROT_READ, MAP_SHARED, _fd, aligned);
+    if (map == MAP_FAILED)
+        throw channel::error("tls: can't map file");
+
+    auto data = static_cast<const uint8_t*>(map) + skip;
+    size_t sent = 0;
+    ssize_t res = 0;
+
+    try
+    {
+        while (sent < length)
+        {
+            res = _this.send(data + sent, std::min(chunk_size, length - sent));
+            if (res <= 0)
+                break;
+
+            sent += res;
+        }
+    }
+    catch (...)
+    {
+        munmap(map, length + skip);
+        throw;
+    }
+
+    munmap(map, length + skip);
+
+    if (sent == 0)
+        return res;
+
+    return sent;
+}
+
 ssize_t impl::send(const uint8_t* _data, size_t _size)
 {
     for (;;)
@@ -267,7 +352,7 @@ ssize_t impl::send(const uint8_t* _data, size_t _size)
 ssize_t tls::recv(buffer& _buff, size_t _desired_size)
 {
     auto& _this = get(&m_impl);
-    return _this.recv(_buff.ptr(), _buff.size(), _desired_size);
+    return _this.recv(_buff.mutable_ptr(), _buff.size(), _desired_size);
 }
 
 ssize_t tls::recv(uint8_t* _data, size_t _size, size_t _desired_size)
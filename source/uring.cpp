@@ -0,0 +1,1372 @@
+
+#include <ez/events.hpp>
+#include "placement.hpp"
+#include "timer_wheel.hpp"
+#include "task_queue.hpp"
+#include "polling.hpp"
+#include "affinity.hpp"
+#include "read_budget.hpp"
+
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <atomic>
+#include <string>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+using namespace std::chrono_literals;
+
+// ------------------------------------------------------------------------------------------
+// raw syscalls, so liburing is not needed
+
+static inline int uring_setup(unsigned _entries, io_uring_params* _params)
+{
+    return (int) syscall(__NR_io_uring_setup, _entries, _params);
+}
+
+static inline int uring_enter(int _fd, unsigned _submit, unsigned _wait, unsigned _flags, void* _arg, size_t _size)
+{
+    return (int) syscall(__NR_io_uring_enter, _fd, _submit, _wait, _flags, _arg, _size);
+}
+
+static inline int uring_register(int _fd, unsigned _op, void* _arg, unsigned _count)
+{
+    return (int) syscall(__NR_io_uring_register, _fd, _op, _arg, _count);
+}
+
+// napi busy polling of sockets on the ring, linux 6.9+, older headers don't have it
+
+struct uring_napi
+{
+    uint32_t    busy_poll_to;
+    uint8_t     prefer_busy_poll;
+    uint8_t     pad[3];
+    uint64_t    resv;
+};
+
+static constexpr unsigned uring_register_napi = 27; // IORING_REGISTER_NAPI
+
+static inline bool uring_set_busy_poll(int _fd, const ez::event_loop::polling_t& _polling)
+{
+    uring_napi napi{};
+    napi.busy_poll_to = _polling.busy_poll_us;
+    napi.prefer_busy_poll = _polling.prefer_busy_poll ? 1 : 0;
+    return uring_register(_fd, uring_register_napi, &napi, 1) == 0;
+}
+
+// ------------------------------------------------------------------------------------------
+
+namespace ez {
+
+enum class op_kind_e
+{
+    free,
+    wake,
+    poll,
+    accept,
+    listen,     // accept sharding, accepted fds stay on the ring with readiness events
+    recv,
+    send,
+    cancel
+};
+
+// operation in flight, multishot ones live until the completion without IORING_CQE_F_MORE
+
+struct uring_op
+{
+    op_kind_e   kind = op_kind_e::free;
+    int         fd = -1;
+    buffer      data;
+    size_t      sent = 0;
+    bool        poll_first = false; // send would block, wait for space instead of trying first
+    event_loop::handler_t* handler = nullptr; // poll events go to it instead of on_event
+    std::deque<buffer> queued;      // later sends to the same fd, they go out in order
+};
+
+// operation started from another thread, picked up by the ring's own thread
+
+struct uring_post
+{
+    op_kind_e   kind;
+    int         fd;
+    buffer      data;
+    event_loop::handler_t* handler;
+};
+
+struct ring
+{
+    static constexpr unsigned sq_size = 256;
+    static constexpr unsigned buf_count = 256;  // provided buffers for multishot recv, power of 2
+    static constexpr unsigned buf_size = 4096;
+    static constexpr uint64_t no_op = ~0ull;    // user_data of cancel requests
+
+    int                 fd = -1;
+    int                 wake_fd = -1;
+
+    unsigned*           sq_head = nullptr;
+    unsigned*           sq_tail = nullptr;
+    unsigned            sq_mask = 0;
+    unsigned            sq_entries = 0;
+    unsigned            sq_local_tail = 0;  // prepared, not published to kernel yet
+    io_uring_sqe*       sqes = nullptr;
+    unsigned*           cq_head = nullptr;
+    unsigned*           cq_tail = nullptr;
+    unsigned            cq_mask = 0;
+    io_uring_cqe*       cqes = nullptr;
+
+    void*               ring_map = MAP_FAILED;
+    size_t              ring_map_size = 0;
+    void*               sqes_map = MAP_FAILED;
+    size_t              sqes_map_size = 0;
+
+    io_uring_buf*       buf_ring = nullptr;
+    uint8_t*            bufs = nullptr;
+    uint16_t            buf_tail = 0;
+
+    std::vector<uring_op>   ops;
+    std::vector<unsigned>   free_ops;
+    std::unordered_map<int, unsigned> sending; // fd -> send op in flight
+
+    std::mutex              posted_lock;
+    std::vector<uring_post> posted;
+    std::atomic<bool>       stopping {false};
+
+    loop_timers             timers;
+    task_queue              tasks;
+    poll_meter              meter;
+
+    std::vector<std::pair<unsigned, int>> again; // poll op, fd: drain_fd ran out of budget, reported after the batch
+
+    ring() = default;
+    ring(const ring&) = delete;
+    ~ring();
+
+    void init();
+    void wake();
+    void post(op_kind_e _kind, int _fd, const buffer& _data = buffer(), event_loop::handler_t* _handler = nullptr);
+    void drain_posted();
+    int submit_and_wait(int _timeout);
+
+    io_uring_sqe* get_sqe();
+    unsigned start(op_kind_e _kind, int _fd, const buffer& _data, event_loop::handler_t* _handler = nullptr);
+    void arm(unsigned _op);
+    void cancel(unsigned _op);
+    void cancel_fd(int _fd);
+    unsigned poll_of(int _fd) const;
+    void cancel_accepts();
+    void release(unsigned _op);
+    void recycle(uint16_t _bid);
+};
+
+static thread_local ring* t_ring = nullptr; // ring of the loop running on this thread
+static thread_local unsigned t_poll_op = ~0u; // poll op of the event being dispatched
+static thread_local int t_fd = -1; // of the event being dispatched, -1 between dispatches
+static thread_local bool t_more = false; // drain_fd of t_fd ran out of budget
+
+struct worker
+{
+    ring        r;
+    bool        drained = false; // no fds left while draining, worker thread only
+};
+
+struct event_loop::impl
+{
+    on_event_t          m_event_fn;
+    on_timeout_t        m_timeout_fn;
+    on_complete_t       m_complete_fn = nullptr;
+    on_accept_t         m_accept_fn = nullptr;
+    void*               m_param = nullptr;
+    void*               m_complete_param = nullptr;
+    void*               m_accept_param = nullptr;
+    std::vector<std::pair<int, unsigned>> m_listeners; // fd, worker
+    worker**            m_worker = nullptr;   // created by the worker threads
+    worker_load*        m_load = nullptr;
+    ring*               m_ring = nullptr;
+    std::atomic<unsigned> m_workers {0};
+    std::vector<std::thread> m_threads;
+    polling_t           m_polling;
+    cpu_sets_t          m_cpus;             // per worker, empty - not pinned
+    worker_startup      m_startup;
+
+    std::atomic<bool>   m_running {false};
+    std::atomic<bool>   m_draining {false};
+    std::atomic<unsigned> m_drained {0};    // workers without fds
+    std::atomic<uint64_t> m_drain_timer {0};
+    std::mutex          m_error_lock;
+    std::exception_ptr  m_error;            // first exception of a worker, rethrown by start()
+
+    ~impl();
+
+    ring& main_ring();
+    ring& ring_of(unsigned _worker);
+    void start_workers(unsigned int _workers, int _timeout);
+    void setup_worker(worker& _worker, unsigned _index);
+    void stop_workers();
+    void fail(std::exception_ptr _error);
+    void drain(unsigned _worker);
+    void check_drained(unsigned _worker);
+    void process_events(ring& _ring, unsigned _worker, int _timeout);
+    void process_cqe(ring& _ring, const io_uring_cqe& _cqe, unsigned _worker);
+    void process_fd(int _fd, uint32_t _flags, unsigned _worker, handler_t* _handler);
+    void complete(int _fd, op_e _op, int _result, const uint8_t* _data, unsigned _worker);
+};
+
+// ------------------------------------------------------------------------------------------
+
+void ring::init()
+{
+    io_uring_params params{};
+    fd = uring_setup(sq_size, &params);
+    if (fd == -1)
+        throw std::runtime_error("io_uring_setup() error, errno: " + std::to_string(errno));
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+        throw std::runtime_error("io_uring: kernel is too old");
+
+    ring_map_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                             params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+
+    ring_map = mmap(nullptr, ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring_map == MAP_FAILED)
+        throw std::runtime_error("io_uring: can't map rings");
+
+    sqes_map_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_map = mmap(nullptr, sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes_map == MAP_FAILED)
+        throw std::runtime_error("io_uring: can't map sqes");
+
+    auto base = static_cast<uint8_t*>(ring_map);
+    sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_local_tail = *sq_tail;
+    cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+    sqes = static_cast<io_uring_sqe*>(sqes_map);
+
+    auto array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; ++i)
+        array[i] = i;
+
+    // provided buffer ring, the kernel picks a buffer for every multishot recv completion
+
+    auto br = mmap(nullptr, buf_count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED)
+        throw std::runtime_error("io_uring: can't allocate buffer ring");
+
+    buf_ring = static_cast<io_uring_buf*>(br);
+    bufs = new uint8_t[buf_count * buf_size];
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+    reg.ring_entries = buf_count;
+    reg.bgid = 0;
+
+    if (uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        throw std::runtime_error("io_uring: can't register buffer ring, errno: " + std::to_string(errno));
+
+    for (unsigned i = 0; i < buf_count; ++i)
+        recycle(static_cast<uint16_t>(i));
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd == -1)
+        throw std::runtime_error("eventfd() error");
+
+    start(op_kind_e::wake, wake_fd, buffer());
+}
+
+ring::~ring()
+{
+    if (fd != -1)
+        close(fd); // cancels everything in flight
+
+    if (wake_fd != -1)
+        close(wake_fd);
+
+    if (ring_map != MAP_FAILED)
+        munmap(ring_map, ring_map_size);
+
+    if (sqes_map != MAP_FAILED)
+        munmap(sqes_map, sqes_map_size);
+
+    if (buf_ring)
+        munmap(buf_ring, buf_count * sizeof(io_uring_buf));
+
+    delete [] bufs;
+}
+
+// ------------------------------------------------------------------------------------------
+// the tail of the buffer ring overlays the reserved field of the first entry
+
+void ring::recycle(uint16_t _bid)
+{
+    auto& b = buf_ring[buf_tail & (buf_count - 1)];
+    b.addr = reinterpret_cast<uint64_t>(bufs + size_t(_bid) * buf_size);
+    b.len = buf_size;
+    b.bid = _bid;
+    ++buf_tail;
+
+    __atomic_store_n(&reinterpret_cast<io_uring_buf_ring*>(buf_ring)->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+// ------------------------------------------------------------------------------------------
+
+void ring::wake()
+{
+    uint64_t c = 1;
+    write(wake_fd, &c, 8);
+}
+
+void ring::post(op_kind_e _kind, int _fd, const buffer& _data, event_loop::handler_t* _handler)
+{
+    if (t_ring == this)
+    {
+        if (_kind == op_kind_e::cancel)
+            cancel_fd(_fd);
+        else
+            start(_kind, _fd, _data, _handler);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(posted_lock);
+        posted.push_back({_kind, _fd, _data, _handler});
+    }
+
+    wake();
+}
+
+void ring::drain_posted()
+{
+    std::vector<uring_post> items;
+
+    {
+        std::lock_guard<std::mutex> lock(posted_lock);
+        items.swap(posted);
+    }
+
+    for (auto& p: items)
+    {
+        if (p.kind == op_kind_e::cancel)
+            cancel_fd(p.fd);
+        else
+            start(p.kind, p.fd, p.data, p.handler);
+    }
+}
+
+// ------------------------------------------------------------------------------------------
+
+io_uring_sqe* ring::get_sqe()
+{
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+    {
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        uring_enter(fd, sq_entries, 0, 0, nullptr, 0);
+
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+            throw std::runtime_error("io_uring: submission queue is full");
+    }
+
+    auto sqe = &sqes[sq_local_tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sq_local_tail;
+    return sqe;
+}
+
+// returns -1 with errno ETIME when timed out, doesn't wait with 0, waits forever with -1
+
+int ring::submit_and_wait(int _timeout)
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+    if (_timeout == 0)
+        return uring_enter(fd, to_submit, 0, 0, nullptr, 0);
+
+    if (_timeout > 0)
+    {
+        __kernel_timespec ts{};
+        ts.tv_sec = _timeout / 1000;
+        ts.tv_nsec = (_timeout % 1000) * 1000000LL;
+
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+        return uring_enter(fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+
+    return uring_enter(fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, _NSIG / 8);
+}
+
+// ------------------------------------------------------------------------------------------
+
+unsigned ring::start(op_kind_e _kind, int _fd, const buffer& _data, event_loop::handler_t* _handler)
+{
+    if (_kind == op_kind_e::send)
+    {
+        if (auto it = sending.find(_fd); it != sending.end())
+        {
+            ops[it->second].queued.push_back(_data);
+            return it->second;
+        }
+    }
+
+    unsigned i = 0;
+    if (free_ops.empty())
+    {
+        i = static_cast<unsigned>(ops.size());
+        ops.emplace_back();
+    }
+    else
+    {
+        i = free_ops.back();
+        free_ops.pop_back();
+    }
+
+    ops[i].kind = _kind;
+    ops[i].fd = _fd;
+    ops[i].data = _data;
+    ops[i].sent = 0;
+    ops[i].poll_first = false;
+    ops[i].handler = _handler;
+
+    if (_kind == op_kind_e::send)
+        sending[_fd] = i;
+
+    arm(i);
+    return i;
+}
+
+void ring::arm(unsigned _op)
+{
+    auto& op = ops[_op];
+    auto sqe = get_sqe();
+    sqe->fd = op.fd;
+    sqe->user_data = _op;
+
+    switch (op.kind)
+    {
+        case op_kind_e::wake:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLIN;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            break;
+
+        case op_kind_e::poll:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLIN | POLLOUT | POLLRDHUP;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            break;
+
+        case op_kind_e::accept:
+        case op_kind_e::listen:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            break;
+
+        case op_kind_e::recv:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            break;
+
+        case op_kind_e::send:
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = reinterpret_cast<uint64_t>(op.data.ptr() + op.sent);
+            sqe->len = static_cast<uint32_t>(op.data.size() - op.sent);
+            sqe->msg_flags = MSG_NOSIGNAL;
+            if (op.poll_first)
+                sqe->ioprio = IORING_RECVSEND_POLL_FIRST;
+            break;
+
+        default:
+            throw std::runtime_error("io_uring: invalid operation");
+    }
+}
+
+void ring::cancel(unsigned _op)
+{
+    auto sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = _op;
+    sqe->user_data = no_op;
+}
+
+// by op index, the fd may be closed and reused before the cancel request is submitted
+
+void ring::cancel_fd(int _fd)
+{
+    for (unsigned i = 0; i < ops.size(); ++i)
+        if (ops[i].fd == _fd && ops[i].kind != op_kind_e::free && ops[i].kind != op_kind_e::wake)
+            cancel(i);
+}
+
+unsigned ring::poll_of(int _fd) const
+{
+    for (unsigned i = 0; i < ops.size(); ++i)
+        if (ops[i].fd == _fd && ops[i].kind == op_kind_e::poll)
+            return i;
+
+    return ~0u;
+}
+
+void ring::cancel_accepts()
+{
+    for (unsigned i = 0; i < ops.size(); ++i)
+        if (ops[i].kind == op_kind_e::accept || ops[i].kind == op_kind_e::listen)
+            cancel(i);
+}
+
+void ring::release(unsigned _op)
+{
+    if (ops[_op].kind == op_kind_e::send)
+        sending.erase(ops[_op].fd);
+
+    ops[_op].queued.clear();
+    ops[_op].kind = op_kind_e::free;
+    ops[_op].fd = -1;
+    ops[_op].data = buffer();
+    ops[_op].handler = nullptr;
+    free_ops.push_back(_op);
+}
+
+// ------------------------------------------------------------------------------------------
+
+event_loop::event_loop() : m_impl(new impl)
+{
+}
+
+void event_loop::init()
+{
+    m_impl->m_ring = new ring;
+    m_impl->m_ring->init();
+}
+
+event_loop::~event_loop()
+{
+    delete m_impl;
+}
+
+event_loop::impl::~impl()
+{
+    delete m_ring;
+}
+
+bool event_loop::completions_supported()
+{
+    return true;
+}
+
+unsigned event_loop::workers() const
+{
+    return m_impl->m_workers;
+}
+
+void event_loop::stop()
+{
+    if (m_impl->m_ring == nullptr)
+        return;
+
+    m_impl->m_ring->stopping = true;
+    m_impl->m_ring->wake();
+}
+
+// accepts started with accept() on the main ring are cancelled too
+
+void event_loop::shutdown(unsigned _grace_ms)
+{
+    if (!m_impl->m_running || m_impl->m_draining.exchange(true))
+        return;
+
+    for (unsigned i = 0; i < m_impl->m_workers; ++i)
+        post(m_impl, [](void* _impl, unsigned _worker) { static_cast<impl*>(_impl)->drain(_worker); }, i);
+
+    post(m_impl, [](void* _impl, unsigned) { static_cast<impl*>(_impl)->main_ring().cancel_accepts(); });
+    m_impl->m_drain_timer = schedule(_grace_ms, this, [](void* _loop, uint64_t, unsigned) { static_cast<event_loop*>(_loop)->stop(); });
+}
+
+bool event_loop::draining() const
+{
+    return m_impl->m_draining.load(std::memory_order_relaxed);
+}
+
+ring& event_loop::impl::main_ring()
+{
+    if (m_ring == nullptr)
+        throw std::runtime_error("io_uring main error");
+
+    return *m_ring;
+}
+
+ring& event_loop::impl::ring_of(unsigned _worker)
+{
+    if (_worker < m_workers)
+        return m_worker[_worker]->r;
+
+    throw std::runtime_error("wrong worker");
+}
+
+void event_loop::add_fd(int _fd)
+{
+    m_impl->main_ring().post(op_kind_e::poll, _fd);
+}
+
+void event_loop::add_fd(int _fd, unsigned _worker)
+{
+    m_impl->ring_of(_worker).post(op_kind_e::poll, _fd);
+    m_impl->m_load[_worker].add(_fd, worker_load::now());
+}
+
+void event_loop::add_fd(handler_t* _handler)
+{
+    m_impl->main_ring().post(op_kind_e::poll, _handler->fd, buffer(), _handler);
+}
+
+void event_loop::add_fd(handler_t* _handler, unsigned _worker)
+{
+    m_impl->ring_of(_worker).post(op_kind_e::poll, _handler->fd, buffer(), _handler);
+    m_impl->m_load[_worker].add(_handler->fd, worker_load::now(), _handler);
+}
+
+// cancels everything started for fd, call it before closing fd: operations in flight
+// keep a reference to the file
+
+ssize_t event_loop::drain_fd(int _fd, buffer& _data, unsigned _worker, size_t _budget)
+{
+    (void) _worker; // the ring of this thread
+
+    bool more = false;
+    auto result = read_budget(_fd, _data, _budget, more);
+    if (_fd == t_fd)
+        t_more = more;
+
+    // outside the fd's own callback its poll op is looked up
+    auto op = _fd == t_fd ? t_poll_op : (more && t_ring ? t_ring->poll_of(_fd) : ~0u);
+    if (more && t_ring && op < t_ring->ops.size() && t_ring->ops[op].fd == _fd)
+        t_ring->again.emplace_back(op, _fd);
+
+    return result;
+}
+
+void event_loop::remove_fd(int _fd, unsigned _worker)
+{
+    if (_worker < m_impl->m_workers)
+    {
+        m_impl->m_worker[_worker]->r.post(op_kind_e::cancel, _fd);
+        m_impl->m_load[_worker].remove(_fd);
+
+        if (m_impl->m_draining.load(std::memory_order_relaxed)) // the worker checks if it was the last one
+            post(m_impl, [](void* _impl, unsigned _w) { static_cast<impl*>(_impl)->check_drained(_w); }, _worker);
+    }
+    else if (m_impl->m_ring)
+        m_impl->m_ring->post(op_kind_e::cancel, _fd);
+}
+
+// ------------------------------------------------------------------------------------------
+
+unsigned event_loop::place_fd(int _fd, placement_e _policy)
+{
+    if (m_impl->m_workers == 0)
+        throw std::runtime_error("no workers to place fd");
+
+    auto w = pick_worker(m_impl->m_load, m_impl->m_workers, _policy);
+    add_fd(_fd, w);
+    return w;
+}
+
+unsigned event_loop::place_fd(handler_t* _handler, placement_e _policy)
+{
+    if (m_impl->m_workers == 0)
+        throw std::runtime_error("no workers to place fd");
+
+    auto w = pick_worker(m_impl->m_load, m_impl->m_workers, _policy);
+    add_fd(_handler, w);
+    return w;
+}
+
+event_loop::load_t event_loop::load(unsigned _worker) const
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->m_load[_worker].stats(worker_load::now());
+}
+
+// requests in flight are bound to their ring, so fds stay where they are placed
+
+void event_loop::set_migration(unsigned)
+{
+}
+
+void event_loop::on_migrate(void*, on_migrate_t)
+{
+}
+
+// batch limits completions handled per iteration, the rest are handled right after
+
+void event_loop::set_polling(const polling_t& _polling)
+{
+    if (m_impl->m_workers > 0)
+        throw std::runtime_error("polling is set before start()");
+
+    if (_polling.batch == 0)
+        throw std::runtime_error("polling batch can't be 0");
+
+    if (_polling.busy_poll_budget > 0)
+        throw std::runtime_error("busy poll budget is not supported by io_uring");
+
+    if (_polling.busy_poll_us > 0 || _polling.prefer_busy_poll) // checked here, workers can't report it
+    {
+        io_uring_params params{};
+        int fd = uring_setup(8, &params);
+        bool ok = fd != -1 && uring_set_busy_poll(fd, _polling);
+        int err = errno;
+
+        if (fd != -1)
+            close(fd);
+
+        if (!ok)
+            throw std::runtime_error("io_uring busy poll is not supported, errno: " + std::to_string(err));
+    }
+
+    m_impl->m_polling = _polling;
+}
+
+void event_loop::set_affinity(const affinity_t& _affinity)
+{
+    if (m_impl->m_workers > 0)
+        throw std::runtime_error("affinity is set before start()");
+
+    auto cpus = _affinity.cpus;
+    if (cpus.empty() && !_affinity.irq_device.empty())
+        cpus = rx_queue_cpus(_affinity.irq_device);
+
+    check_cpus(cpus);
+    m_impl->m_cpus = cpus;
+}
+
+event_loop::poll_stats_t event_loop::poll_stats(unsigned _worker) const
+{
+    if (_worker >= m_impl->m_workers)
+        throw std::runtime_error("wrong worker");
+
+    return m_impl->m_worker[_worker]->r.meter.stats();
+}
+
+void event_loop::on_event(void* _param, on_event_t _ev)
+{
+    m_impl->m_param = _param;
+    m_impl->m_event_fn = _ev;
+}
+
+void event_loop::on_timeout(on_timeout_t _ev)
+{
+    m_impl->m_timeout_fn = _ev;
+}
+
+// ------------------------------------------------------------------------------------------
+
+static uint64_t schedule_on(ring& _ring, unsigned _ms, void* _param, event_loop::on_timer_t _fn)
+{
+    bool wake = false;
+    auto id = _ring.timers.schedule(_ms, _fn, _param, wake);
+    if (wake)
+        _ring.wake();
+
+    return id;
+}
+
+uint64_t event_loop::schedule(unsigned _ms, void* _param, on_timer_t _fn)
+{
+    return schedule_on(m_impl->main_ring(), _ms, _param, _fn);
+}
+
+uint64_t event_loop::schedule(unsigned _ms, void* _param, on_timer_t _fn, unsigned _worker)
+{
+    return schedule_on(m_impl->ring_of(_worker), _ms, _param, _fn);
+}
+
+void event_loop::post(void* _param, task_t _fn)
+{
+    auto& r = m_impl->main_ring();
+    if (r.tasks.push(_param, _fn))
+        r.wake();
+}
+
+void event_loop::post(void* _param, task_t _fn, unsigned _worker)
+{
+    auto& r = m_impl->ring_of(_worker);
+    if (r.tasks.push(_param, _fn))
+        r.wake();
+}
+
+bool event_loop::cancel(uint64_t _id)
+{
+    return m_impl->main_ring().timers.cancel(_id);
+}
+
+bool event_loop::cancel(uint64_t _id, unsigned _worker)
+{
+    return m_impl->ring_of(_worker).timers.cancel(_id);
+}
+
+// ------------------------------------------------------------------------------------------
+
+void event_loop::on_accept(void* _param, on_accept_t _fn)
+{
+    m_impl->m_accept_param = _param;
+    m_impl->m_accept_fn = _fn;
+}
+
+void event_loop::add_listener(int _fd, unsigned _worker)
+{
+    if (m_impl->m_workers > 0)
+        throw std::runtime_error("listeners are added before start()");
+
+    m_impl->m_listeners.emplace_back(_fd, _worker);
+}
+
+void event_loop::on_complete(void* _param, on_complete_t _fn)
+{
+    m_impl->m_complete_param = _param;
+    m_impl->m_complete_fn = _fn;
+}
+
+// ------------------------------------------------------------------------------------------
+
+void event_loop::accept(int _fd)
+{
+    m_impl->main_ring().post(op_kind_e::accept, _fd);
+}
+
+void event_loop::accept(int _fd, unsigned _worker)
+{
+    m_impl->ring_of(_worker).post(op_kind_e::accept, _fd);
+}
+
+void event_loop::recv(int _fd)
+{
+    m_impl->main_ring().post(op_kind_e::recv, _fd);
+}
+
+void event_loop::recv(int _fd, unsigned _worker)
+{
+    m_impl->ring_of(_worker).post(op_kind_e::recv, _fd);
+    m_impl->m_load[_worker].add(_fd, worker_load::now());
+}
+
+void event_loop::send(int _fd, const buffer& _data)
+{
+    m_impl->main_ring().post(op_kind_e::send, _fd, _data);
+}
+
+void event_loop::send(int _fd, const buffer& _data, unsigned _worker)
+{
+    m_impl->ring_of(_worker).post(op_kind_e::send, _fd, _data);
+}
+
+// ------------------------------------------------------------------------------------------
+// rings are created by the workers, after pinning, so the kernel allocates them on their node;
+// start goes on when all of them are set up, so fds can be added to workers right away
+
+void event_loop::impl::start_workers(unsigned int _workers, int _timeout)
+{
+    for (auto& [fd, w]: m_listeners)
+        if (w >= _workers)
+            throw std::runtime_error("listener for wrong worker: " + std::to_string(w));
+
+    if (_workers == 0)
+        return;
+
+    m_worker = new worker*[_workers]();
+    m_load = new worker_load[_workers];
+    m_startup.reset();
+
+    auto wrk = [this, _timeout](unsigned w)
+    {
+        std::string error;
+        if (!m_cpus.empty() && !pin_thread(m_cpus[w % m_cpus.size()]))
+            error = "can't pin worker " + std::to_string(w) + ", errno: " + std::to_string(errno);
+
+        auto& self = *(m_worker[w] = new worker);
+
+        if (error.empty())
+        {
+            try
+            {
+                setup_worker(self, w);
+            }
+            catch (const std::exception& e)
+            {
+                error = e.what();
+            }
+        }
+
+        if (!m_startup.set_ready(error))
+            return;
+
+        try
+        {
+            process_events(self.r, w, _timeout); // blocks this thread
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+        }
+    };
+
+    for (unsigned i = 0; i < _workers; ++i)
+        m_threads.emplace_back(wrk, i); // start worker
+
+    auto error = m_startup.wait(_workers);
+    if (error.empty())
+        m_workers = _workers; // workers see it after release
+
+    m_startup.release();
+
+    if (error.empty())
+        return;
+
+    stop_workers();
+    throw std::runtime_error(error);
+}
+
+// stops and joins workers, their rings go with them
+
+void event_loop::impl::stop_workers()
+{
+    for (unsigned i = 0; i < m_threads.size(); ++i)
+    {
+        m_worker[i]->r.stopping = true;
+        if (m_worker[i]->r.fd != -1)
+            m_worker[i]->r.wake();
+    }
+
+    for (auto& t: m_threads)
+        t.join();
+
+    for (unsigned i = 0; i < m_threads.size(); ++i)
+        delete m_worker[i];
+
+    m_threads.clear();
+    m_workers = 0;
+    delete [] m_worker;
+    delete [] m_load;
+    m_worker = nullptr;
+    m_load = nullptr;
+}
+
+// an exception in a worker stops the loop, start() rethrows it
+
+void event_loop::impl::fail(std::exception_ptr _error)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_error_lock);
+        if (!m_error)
+            m_error = _error;
+    }
+
+    m_ring->stopping = true;
+    m_ring->wake();
+}
+
+// runs on the worker: no new connections, the loop stops when the last worker has no fds
+
+void event_loop::impl::drain(unsigned _worker)
+{
+    m_worker[_worker]->r.cancel_accepts();
+    check_drained(_worker);
+}
+
+void event_loop::impl::check_drained(unsigned _worker)
+{
+    auto& self = *m_worker[_worker];
+    if (self.drained || m_load[_worker].size() > 0)
+        return;
+
+    self.drained = true;
+    if (m_drained.fetch_add(1) + 1 == m_workers)
+    {
+        m_ring->stopping = true;
+        m_ring->wake();
+    }
+}
+
+void event_loop::impl::setup_worker(worker& _worker, unsigned _index)
+{
+    _worker.r.init();
+
+    if (m_polling.busy_poll_us > 0 || m_polling.prefer_busy_poll)
+        uring_set_busy_poll(_worker.r.fd, m_polling);
+
+    for (auto& [fd, w]: m_listeners)
+        if (w == _index)
+            _worker.r.post(op_kind_e::listen, fd);
+
+    std::string name = "worker " + std::to_string(_index);
+    prctl(PR_SET_NAME, name.c_str(),0,0,0);
+}
+
+// ------------------------------------------------------------------------------------------
+
+void event_loop::start(unsigned _workers, int _timeout)
+{
+    auto& main = m_impl->main_ring();
+    main.stopping = false;
+
+    m_impl->m_draining = false;
+    m_impl->m_drained = 0;
+    m_impl->m_running = true;
+
+    std::exception_ptr error;
+
+    try
+    {
+        m_impl->start_workers(_workers, 0);
+        m_impl->process_events(main, -1, _timeout);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+
+    m_impl->stop_workers();
+    m_impl->m_running = false;
+    main.timers.cancel(m_impl->m_drain_timer);
+    m_impl->m_drain_timer = 0;
+    m_impl->m_draining = false;
+
+    if (!error)
+    {
+        std::lock_guard<std::mutex> lock(m_impl->m_error_lock);
+        std::swap(error, m_impl->m_error);
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// ------------------------------------------------------------------------------------------
+
+void event_loop::impl::process_events(ring& _ring, unsigned _worker, int _timeout)
+{
+    t_ring = &_ring;
+    bool more_tasks = false;
+    bool more_cqes = false;
+    std::vector<std::pair<unsigned, int>> again;
+    auto meter = _worker < m_workers ? &_ring.meter : nullptr;
+    unsigned spin_us = meter ? m_polling.spin_us : 0;
+
+    for(;;)
+    {
+        _ring.drain_posted();
+
+        if (_ring.stopping)
+            break;
+
+        int wait = _timeout > 0 ? _timeout : -1;
+        if (meter)
+            wait = meter->before(wait, spin_us);
+
+        wait = more_tasks || more_cqes || !_ring.again.empty() ? 0 : _ring.timers.wait(wait);
+
+        int result = _ring.submit_and_wait(wait);
+        _ring.timers.awake();
+
+        if (result < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+            throw std::runtime_error("io_uring_enter() error, errno: " + std::to_string(errno));
+
+        bool timeout = result < 0 && errno == ETIME;
+
+        unsigned head = *_ring.cq_head;
+        unsigned count = 0;
+
+        more_cqes = false;
+
+        while (head != __atomic_load_n(_ring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if (count == m_polling.batch)
+            {
+                more_cqes = true;
+                break;
+            }
+
+            auto cqe = _ring.cqes[head & _ring.cq_mask];
+            __atomic_store_n(_ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+            process_cqe(_ring, cqe, _worker);
+            ++count;
+        }
+
+        // fds that still have data, after the others; the op is checked, remove_fd may have cancelled it
+
+        again.swap(_ring.again);
+        for (auto [op, fd]: again)
+        {
+            if (_ring.ops[op].kind != op_kind_e::poll || _ring.ops[op].fd != fd)
+                continue;
+
+            t_poll_op = op;
+            t_fd = fd;
+            process_fd(fd, POLLIN, _worker, _ring.ops[op].handler);
+            t_poll_op = ~0u;
+            t_fd = -1;
+            ++count;
+        }
+        again.clear();
+
+        if (meter)
+            meter->after(wait, static_cast<int>(count));
+
+        if (_worker < m_workers)
+            m_load[_worker].count(count, worker_load::now());
+
+        if (timeout && count == 0 && m_timeout_fn && wait == _timeout) // not a wake up for timers
+            m_timeout_fn(m_param, _worker);
+
+        more_tasks = _ring.tasks.run(_worker);
+        _ring.timers.fire(_worker);
+
+        if (_worker < m_workers && m_draining.load(std::memory_order_relaxed))
+            check_drained(_worker);
+    }
+
+    t_ring = nullptr;
+}
+
+// ------------------------------------------------------------------------------------------
+// ops may be added by callbacks, so only the index is kept across them
+
+void event_loop::impl::process_cqe(ring& _ring, const io_uring_cqe& _cqe, unsigned _worker)
+{
+    if (_cqe.user_data == ring::no_op)
+        return;
+
+    auto i = static_cast<unsigned>(_cqe.user_data);
+    auto kind = _ring.ops[i].kind;
+    auto fd = _ring.ops[i].fd;
+    auto handler = _ring.ops[i].handler;
+    bool more = _cqe.flags & IORING_CQE_F_MORE;
+    int res = _cqe.res;
+
+    switch (kind)
+    {
+        case op_kind_e::wake:
+        {
+            uint64_t c = 0;
+            read(fd, &c, 8);
+            if (!more)
+                _ring.arm(i);
+            break;
+        }
+
+        case op_kind_e::poll:
+        {
+            if (res < 0)
+            {
+                if (!more)
+                    _ring.release(i);
+                break;
+            }
+
+            // the request holds a file reference, drop it so closing fd closes the socket
+
+            if (res & (POLLRDHUP | POLLERR | POLLHUP))
+            {
+                if (_worker < m_workers)
+                    m_load[_worker].remove(fd);
+
+                if (more)
+                    _ring.cancel(i);
+                else
+                    _ring.release(i);
+            }
+            else if (!more)
+                _ring.arm(i);
+
+            t_poll_op = res & (POLLRDHUP | POLLERR | POLLHUP) ? ~0u : i;
+            t_fd = fd;
+            process_fd(fd, static_cast<uint32_t>(res), _worker, handler);
+            t_poll_op = ~0u;
+            t_fd = -1;
+            break;
+        }
+
+        case op_kind_e::accept:
+        {
+            if (res != -ECANCELED)
+                complete(fd, op_e::accept, res, nullptr, _worker);
+
+            if (!more)
+            {
+                if (res >= 0)
+                    _ring.arm(i);
+                else
+                    _ring.release(i);
+            }
+            break;
+        }
+
+        case op_kind_e::listen:
+        {
+            if (res >= 0)
+            {
+                handler_t* handler = nullptr;
+                if (m_accept_fn && !m_accept_fn(m_accept_param, fd, res, _worker, &handler))
+                    close(res);
+                else
+                {
+                    _ring.start(op_kind_e::poll, res, buffer(), handler);
+                    if (_worker < m_workers)
+                        m_load[_worker].add(res, worker_load::now(), handler);
+                }
+            }
+
+            if (!more)
+            {
+                if (res >= 0 || res == -EINTR || res == -ECONNABORTED)
+                    _ring.arm(i);
+                else
+                    _ring.release(i);
+            }
+            break;
+        }
+
+        case op_kind_e::recv:
+        {
+            if (res > 0 && (_cqe.flags & IORING_CQE_F_BUFFER))
+            {
+                auto bid = static_cast<uint16_t>(_cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                complete(fd, op_e::recv, res, _ring.bufs + size_t(bid) * ring::buf_size, _worker);
+                _ring.recycle(bid);
+            }
+
+            if (!more)
+            {
+                if (res > 0 || res == -ENOBUFS) // stopped by kernel, not by connection
+                    _ring.arm(i);
+                else
+                {
+                    _ring.release(i);
+                    if (_worker < m_workers)
+                        m_load[_worker].remove(fd);
+
+                    if (res != -ECANCELED)
+                        complete(fd, op_e::recv, res, nullptr, _worker);
+                }
+            }
+            break;
+        }
+
+        case op_kind_e::send:
+        {
+            if (res > 0)
+                _ring.ops[i].sent += res;
+
+            if ((res > 0 || res == -EAGAIN) && _ring.ops[i].sent < _ring.ops[i].data.size())
+            {
+                _ring.ops[i].poll_first = true; // partial or would block, socket buffer is full
+                _ring.arm(i);
+                break;
+            }
+
+            if (res >= 0 && !_ring.ops[i].queued.empty()) // next one for this fd
+            {
+                auto sent = static_cast<int>(_ring.ops[i].sent);
+                auto& op = _ring.ops[i];
+                op.data = op.queued.front();
+                op.queued.pop_front();
+                op.sent = 0;
+                op.poll_first = false;
+                _ring.arm(i);
+
+                complete(fd, op_e::send, sent, nullptr, _worker);
+                break;
+            }
+
+            int result = res < 0 ? res : static_cast<int>(_ring.ops[i].sent);
+            auto failed = res < 0 ? _ring.ops[i].queued.size() : 0;
+            _ring.release(i);
+
+            if (res != -ECANCELED)
+                for (size_t n = 0; n <= failed; ++n) // queued sends fail with the same error
+                    complete(fd, op_e::send, result, nullptr, _worker);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+// ------------------------------------------------------------------------------------------
+
+void event_loop::impl::process_fd(int _fd, uint32_t _flags, unsigned _worker, handler_t* _handler)
+{
+    auto fn = _handler ? _handler->fn : m_event_fn;
+    auto param = _handler ? _handler->param : m_param;
+
+    if (!fn)
+        return;
+
+    if (_flags & POLLRDHUP)
+    {
+        // the peer sent all it will, its data is read before closed; the poll is gone already,
+        // so a read that runs out of budget gets the next one right away
+
+        if (_flags & POLLIN)
+        {
+            do
+            {
+                t_more = false;
+                fn(param, _fd, event_e::read, _worker);
+            }
+            while (t_more);
+        }
+
+        fn(param, _fd, event_e::closed, _worker);
+        return;
+    }
+
+    if ((_flags & POLLERR) || (_flags & POLLHUP))
+    {
+        fn(param, _fd, event_e::error, _worker);
+        return;
+    }
+
+    if (_flags & POLLIN)
+        fn(param, _fd, event_e::read, _worker);
+
+    if (_flags & POLLOUT)
+        fn(param, _fd, event_e::write, _worker);
+}
+
+void event_loop::impl::complete(int _fd, op_e _op, int _result, const uint8_t* _data, unsigned _worker)
+{
+    if (m_complete_fn)
+        m_complete_fn(m_complete_param, _fd, _op, _result, _data, _worker);
+}
+
+}